@@ -0,0 +1,164 @@
+/*!
+ * @file   future.h
+ * \brief  the result of an asynchronous request
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define PS_USE_COROUTINE 1
+#endif
+namespace ps {
+
+/**
+ * \brief a future finished when a request is finished
+ *
+ * Copies of a future share the state. It can be waited, or chained by \ref
+ * Then and \ref WhenAll. The functions chained run on the thread finishing
+ * the future, usually the receiving thread of the app, so they should not
+ * block. With C++20 coroutines, it can also be awaited by `co_await`, which
+ * returns false if the request failed, and the coroutine then continues on
+ * that thread too.
+ *
+ * Sample usage: pull the next batch while computing the current one
+ * \code
+ *   auto next = kv.ZPullAsync(keys[i+1], &vals[i+1]);
+ *   Compute(vals[i], &grads[i]);
+ *   auto done = kv.ZPushAsync(keys[i], grads[i]);
+ *   Future::WhenAll({next, done}).Wait();
+ * \endcode
+ */
+class Future {
+ public:
+  /** \brief an invalid future */
+  Future() { }
+
+  /** \brief return true if it is from a request or chained */
+  bool valid() const { return state_ != nullptr; }
+
+  /** \brief return true if finished. threadsafe */
+  bool ready() const { return state_->done.load(std::memory_order_acquire); }
+
+  /**
+   * \brief return true if some receivers of the request could not be
+   * reached. valid once finished
+   */
+  bool failed() const { return state_->failed.load(); }
+
+  /** \brief block until finished. threadsafe */
+  void Wait() const {
+    if (ready()) return;
+    std::unique_lock<std::mutex> lk(state_->mu);
+    state_->cond.wait(lk, [this] { return ready(); });
+  }
+
+  /**
+   * \brief run a function once finished, or right now if finished already
+   * \return a future finished after the function runs, failed if this one
+   * failed
+   */
+  Future Then(const std::function<void()>& func) const {
+    Future next = Create();
+    auto state = state_;
+    auto next_state = next.state_;
+    OnDone([state, next_state, func]() {
+        func();
+        Finish(next_state, state->failed.load());
+      });
+    return next;
+  }
+
+  /**
+   * \brief return a future finished once all given futures finished, failed
+   * if any of them failed
+   */
+  static Future WhenAll(const std::vector<Future>& futures) {
+    Future all = Create();
+    auto state = all.state_;
+    auto count = std::make_shared<std::atomic<size_t>>(futures.size() + 1);
+    auto failed = std::make_shared<std::atomic<bool>>(false);
+    auto arrive = [state, count, failed]() {
+      if (--*count == 0) Finish(state, failed->load());
+    };
+    for (const auto& f : futures) {
+      auto fstate = f.state_;
+      f.OnDone([fstate, failed, arrive]() {
+          if (fstate->failed.load()) *failed = true;
+          arrive();
+        });
+    }
+    arrive();
+    return all;
+  }
+
+  /**
+   * \brief create an unfinished future, which is finished by \ref Finish
+   */
+  static Future Create() {
+    Future f;
+    f.state_ = std::make_shared<State>();
+    return f;
+  }
+
+  /**
+   * \brief finish a future created by \ref Create, and run the functions
+   * chained
+   */
+  void Finish(bool failed = false) const { Finish(state_, failed); }
+
+#ifdef PS_USE_COROUTINE
+  bool await_ready() const { return ready(); }
+  bool await_suspend(std::coroutine_handle<> handle) const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    if (ready()) return false;
+    state_->then.push_back([handle]() { handle.resume(); });
+    return true;
+  }
+  bool await_resume() const { return !failed(); }
+#endif
+
+ private:
+  struct State {
+    std::atomic<bool> done{false};
+    std::atomic<bool> failed{false};
+    std::mutex mu;
+    std::condition_variable cond;
+    /** \brief the functions to run once finished */
+    std::vector<std::function<void()>> then;
+  };
+
+  /**
+   * \brief run func once finished, or right now if finished already
+   */
+  void OnDone(const std::function<void()>& func) const {
+    {
+      std::lock_guard<std::mutex> lk(state_->mu);
+      if (!ready()) {
+        state_->then.push_back(func);
+        return;
+      }
+    }
+    func();
+  }
+
+  static void Finish(const std::shared_ptr<State>& state, bool failed) {
+    std::vector<std::function<void()>> then;
+    {
+      std::lock_guard<std::mutex> lk(state->mu);
+      state->failed = failed;
+      state->done.store(true, std::memory_order_release);
+      then.swap(state->then);
+    }
+    state->cond.notify_all();
+    for (auto& func : then) func();
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace ps
@@ -0,0 +1,85 @@
+#pragma once
+#include <functional>
+#include <condition_variable>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <deque>
+#include <vector>
+#include "ps/internal/message.h"
+#include "ps/internal/peer_map.h"
+#include "ps/internal/priority_queue.h"
+
+namespace ps {
+
+/**
+ * \brief sends messages by background threads
+ *
+ * \ref Send puts a message into the bounded queue of its receiver and returns,
+ * it only blocks when that queue is full. A queue with messages is handed to
+ * one sending thread at a time, which sends the messages to the same node by
+ * their priorities and otherwise in order, while the queues of different
+ * nodes are drained in parallel.
+ */
+class AsyncSender {
+ public:
+  /** \brief sends a message, returns -1 if failed */
+  using SendFunc = std::function<int(const Message& msg)>;
+  /** \brief called with a message failed to send */
+  using ErrorFunc = std::function<void(const Message& msg)>;
+
+  /**
+   * \param send the function sending a message
+   * \param on_error called by the sending threads when send failed
+   * \param num_threads the number of sending threads
+   * \param capacity the maximal number of messages queued for a node
+   */
+  AsyncSender(const SendFunc& send, const ErrorFunc& on_error,
+              int num_threads, size_t capacity);
+  ~AsyncSender() { Stop(); }
+
+  /**
+   * \brief queue a message for sending, threadsafe
+   * \return the number of bytes of meta and data. -1 if stopped
+   */
+  int Send(const Message& msg);
+
+  /**
+   * \brief send all queued messages and stop the threads
+   */
+  void Stop();
+
+ private:
+  /** \brief the messages to a node */
+  struct Queue {
+    std::mutex mu;
+    std::condition_variable not_full;
+    PriorityQueue msgs;
+    /** \brief in ready_ or being drained by a thread */
+    bool scheduled = false;
+  };
+
+  /**
+   * thread function draining the ready queues
+   */
+  void Sending();
+
+  /** \brief the maximal messages sent from a queue before the next queue */
+  static const int kMaxBatch = 64;
+
+  SendFunc send_;
+  ErrorFunc on_error_;
+  size_t capacity_;
+
+  /** \brief protects ready_ and queues_' creation */
+  std::mutex mu_;
+  std::condition_variable cond_;
+  PeerMap<Queue> queues_;
+  /** \brief the queues with messages waiting for a thread */
+  std::deque<std::shared_ptr<Queue>> ready_;
+  bool exit_ = false;
+  std::vector<std::unique_ptr<std::thread>> threads_;
+  DISALLOW_COPY_AND_ASSIGN(AsyncSender);
+};
+
+}  // namespace ps
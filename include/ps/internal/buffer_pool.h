@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "ps/base.h"
+#include "ps/sarray.h"
+
+namespace ps {
+
+/**
+ * \brief a pool of buffers for received messages, threadsafe
+ *
+ * Buffers are grouped into power-of-two size classes. A buffer returns to the
+ * pool when the last \ref SArray referencing it is destroyed, which often
+ * happens in another thread.
+ *
+ * The buffers of 2^kHugeShift bytes or more are mapped aligned to huge pages,
+ * carved from slabs of 2MB which are kept once mapped, or one mapping each if
+ * larger. `DMLC_PS_HUGE_PAGES` picks explicit huge pages, transparent ones, or
+ * none.
+ *
+ * It also recycles small blocks, such as the reference counts of the \ref
+ * SArray it returns, and those wrapping the frames of the transports by \ref
+ * Wrap, so that receiving a frame needs no heap allocation in the steady
+ * state.
+ */
+class BufferPool {
+ public:
+  /** \brief the counters of the pool */
+  struct Stats {
+    /** \brief the buffers served from a free list */
+    uint64_t hits;
+    /** \brief the buffers allocated since the free list was empty */
+    uint64_t misses;
+    /** \brief the small blocks served from a free list */
+    uint64_t block_hits;
+    /** \brief the small blocks allocated since the free list was empty */
+    uint64_t block_misses;
+    /** \brief the bytes mapped for the large buffers */
+    uint64_t mapped_bytes;
+  };
+
+  /**
+   * \brief return the singleton object, it is never destroyed since
+   * buffers may be released during static destruction
+   */
+  static BufferPool* Get() {
+    static BufferPool* pool = new BufferPool(); return pool;
+  }
+
+  /**
+   * \brief allocate a buffer, whose content is not initialized
+   * \param size the size in bytes
+   */
+  SArray<char> Alloc(size_t size);
+
+  /**
+   * \brief allocate a block of at most kMaxBlock bytes from the free lists,
+   * or the heap if larger
+   */
+  void* AllocBlock(size_t size);
+
+  /**
+   * \brief return a block given by \ref AllocBlock with the same size
+   */
+  void FreeBlock(void* block, size_t size);
+
+  /**
+   * \brief make arr reference data, and call del once the last reference is
+   * gone. the reference count is kept in a recycled block
+   */
+  template <typename V, typename Deleter>
+  void Wrap(V* data, size_t size, Deleter del, SArray<V>* arr);
+
+  /** \brief return the counters */
+  Stats GetStats() const;
+
+ private:
+  BufferPool();
+
+  /** \brief return a buffer to its size class */
+  void Free(char* buf, int cls);
+
+  /** \brief map size bytes aligned to huge pages, nullptr on failure */
+  char* Map(size_t size);
+
+  /** \brief the smallest size class is 2^kMinShift bytes */
+  static const int kMinShift = 8;
+  /** \brief the number of size classes, larger buffers are not pooled */
+  static const int kNumClasses = 20;
+  /** \brief the maximal bytes kept in the free list of a size class */
+  static const size_t kMaxFreeBytes = 64 << 20;
+  /** \brief the buffers of 2^kHugeShift bytes or more are mapped */
+  static const int kHugeShift = 16;
+  /** \brief the size of a slab and a huge page */
+  static const int kSlabShift = 21;
+  /** \brief the size step of the small blocks */
+  static const size_t kBlockAlign = 16;
+  /** \brief the largest small block */
+  static const size_t kMaxBlock = 256;
+  /** \brief the maximal number of blocks kept in a free list */
+  static const size_t kMaxFreeBlocks = 1 << 16;
+
+  struct SizeClass {
+    std::mutex mu;
+    std::vector<char*> free;
+  };
+  SizeClass classes_[kNumClasses];
+  SizeClass blocks_[kMaxBlock / kBlockAlign];
+
+  /** \brief 0 for no huge pages, 1 for transparent ones, 2 for explicit */
+  int huge_pages_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> block_hits_{0};
+  std::atomic<uint64_t> block_misses_{0};
+  std::atomic<uint64_t> mapped_bytes_{0};
+  DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+/**
+ * \brief an allocator taking blocks from \ref BufferPool, it is for the
+ * reference counts of shared pointers
+ */
+template <typename T>
+struct BlockAllocator {
+  using value_type = T;
+  BlockAllocator() { }
+  template <typename U> BlockAllocator(const BlockAllocator<U>&) { }
+  T* allocate(size_t n) {
+    return static_cast<T*>(BufferPool::Get()->AllocBlock(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    BufferPool::Get()->FreeBlock(p, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const BlockAllocator<T>&, const BlockAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const BlockAllocator<T>&, const BlockAllocator<U>&) {
+  return false;
+}
+
+template <typename V, typename Deleter>
+void BufferPool::Wrap(V* data, size_t size, Deleter del, SArray<V>* arr) {
+  arr->reset(data, size, del, BlockAllocator<V>());
+}
+
+}  // namespace ps
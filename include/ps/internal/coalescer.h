@@ -0,0 +1,117 @@
+#pragma once
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include "ps/internal/message.h"
+#include "ps/internal/peer_map.h"
+
+namespace ps {
+
+/**
+ * \brief packs the small data messages to the same node into one message
+ *
+ * A small message is appended into the batch of its receiver, whose meta,
+ * data sizes and data are copied into one buffer. The batch is sent as a
+ * single data frame with meta.batch set, once it reaches a byte threshold or
+ * its first message has waited for a while. The receiver unpacks it by \ref
+ * Unpack and handles the messages in order. Large messages and control
+ * messages are sent right away, after flushing the batch to the same node so
+ * that the order is kept. If a batch fails to send, the requests in it are
+ * passed to the error function one by one.
+ */
+class Coalescer {
+ public:
+  /** \brief sends a message to the network */
+  using SendFunc = std::function<int(const Message& msg)>;
+  /** \brief called with a request failed to send */
+  using ErrorFunc = std::function<void(const Message& msg)>;
+
+  /**
+   * \param send the function sending a message
+   * \param on_error called with each request in a batch failed to send
+   * \param max_bytes flush a batch once it has max_bytes, messages larger
+   * than it are not packed
+   * \param max_delay_us flush a batch once its first message waited for that
+   * many microseconds
+   */
+  Coalescer(const SendFunc& send, const ErrorFunc& on_error, size_t max_bytes,
+            int max_delay_us);
+  ~Coalescer() { Stop(); }
+
+  /**
+   * \brief send a message, threadsafe. it may be delayed
+   * \return the number of bytes of meta and data. -1 if failed
+   */
+  int Send(const Message& msg);
+
+  /**
+   * \brief flush all batches and stop the flushing thread
+   */
+  void Stop();
+
+  /**
+   * \brief unpack a message sent with meta.batch set, the metas of the
+   * messages are left undecoded in raw_meta
+   * \param msgs the messages packed, appended in the order being sent
+   */
+  static void Unpack(const Message& batch, std::vector<Message>* msgs);
+
+  /**
+   * \brief call on_error with each request packed in a batch, with its meta
+   * decoded
+   */
+  static void Fail(const Message& batch, const ErrorFunc& on_error);
+
+ private:
+  /** \brief the messages waiting for sending to a node */
+  struct Batch {
+    int recver;
+    std::mutex mu;
+    /** \brief the packed messages are buf[0, used) */
+    SArray<char> buf;
+    size_t used = 0;
+    int count = 0;
+    /** \brief when the first message was appended */
+    std::chrono::steady_clock::time_point first;
+  };
+
+  /**
+   * \brief return the batch for a node, created if not exist
+   */
+  std::shared_ptr<Batch> GetBatch(int recver);
+
+  /**
+   * \brief send the messages in a batch, the caller holds batch->mu
+   */
+  void Flush(Batch* batch);
+
+  /**
+   * thread function flushing the batches waited too long
+   */
+  void Flushing();
+
+  SendFunc send_;
+  ErrorFunc on_error_;
+  size_t max_bytes_;
+  std::chrono::microseconds max_delay_;
+
+  /** \brief protects all_ and wakes up the flushing thread */
+  std::mutex mu_;
+  std::condition_variable cond_;
+  PeerMap<Batch> batches_;
+  std::vector<std::shared_ptr<Batch>> all_;
+  /** \brief the number of non-empty batches */
+  std::atomic<int> num_pending_{0};
+  bool exit_ = false;
+  /** \brief messages are sent right away after stopped */
+  std::atomic<bool> stopped_{false};
+  std::unique_ptr<std::thread> thread_;
+  DISALLOW_COPY_AND_ASSIGN(Coalescer);
+};
+
+}  // namespace ps
@@ -0,0 +1,67 @@
+#pragma once
+#include "ps/base.h"
+#include "ps/internal/message.h"
+
+namespace ps {
+
+/**
+ * \brief compresses the data frames of messages sent through the network
+ *
+ * A message is compressed by the codec in `meta.compression`. Frames smaller
+ * than `DMLC_PS_COMPRESS_THRESHOLD` bytes, or which do not shrink, are sent
+ * as they are, and bit i of `meta.compressed` tells whether data[i] is
+ * compressed. A compressed frame is the uint64 original size followed by the
+ * compressed bytes.
+ *
+ * \ref LZ is a byte-oriented LZ77 codec in the block format of LZ4. \ref
+ * FLOAT_SHUFFLE first replaces each float (double) by its xor with the
+ * previous one and groups the i-th bytes of all values together, which makes
+ * slowly changing values such as embeddings compress well, then applies \ref
+ * LZ. Frames of other types use \ref LZ only.
+ */
+class Compressor {
+ public:
+  /**
+   * \brief compress the data of msg in place, frames not compressed are kept
+   * zero-copy
+   */
+  static void Compress(Message* msg);
+
+  /**
+   * \brief decompress the data of msg in place, does nothing if none is
+   * compressed
+   */
+  static void Decompress(Message* msg);
+
+  /**
+   * \brief return the maximal size of compressing size bytes by \ref
+   * LZCompress
+   */
+  static size_t LZBound(size_t size) { return size + size / 255 + 16; }
+
+  /**
+   * \brief compress src into dst, which has at least \ref LZBound bytes
+   * \return the compressed size
+   */
+  static size_t LZCompress(const char* src, size_t size, char* dst);
+
+  /**
+   * \brief decompress src into dst of raw_size bytes
+   * \return false if src is corrupted
+   */
+  static bool LZDecompress(const char* src, size_t size,
+                           char* dst, size_t raw_size);
+
+  /**
+   * \brief xor each value of elem_size bytes with the previous one, and
+   * group their bytes by position
+   */
+  static void Shuffle(const char* src, size_t size, int elem_size, char* dst);
+
+  /**
+   * \brief undo \ref Shuffle
+   */
+  static void Unshuffle(const char* src, size_t size, int elem_size, char* dst);
+};
+
+}  // namespace ps
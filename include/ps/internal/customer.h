@@ -1,37 +1,71 @@
 #pragma once
 #include <mutex>
 #include <atomic>
-#include <condition_variable>
 #include <functional>
 #include <thread>
 #include <memory>
+#include <vector>
 #include "ps/internal/message.h"
-#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/metrics.h"
+#include "ps/internal/priority_queue.h"
 namespace ps {
 
 /**
  * \brief The object for communication.
  *
- * As a sender, a customer tracks the responses for each request sent.
+ * As a sender, a customer tracks the responses for each request sent. The
+ * requests are kept in a ring of a fixed number of slots, set by
+ * `DMLC_PS_MAX_REQUESTS`, and timestamps wrap around at 2^31. A new request
+ * reuses the slot of the request that many requests earlier, waiting for it
+ * to finish if not yet. So that many requests at most are in flight, and the
+ * state of a request, such as \ref HasFailed, is kept until that many newer
+ * requests are made.
  *
- * It has its own receiving thread which is able to process any message received
- * from a remote node with `msg.meta.customer_id()` equal to this customer's id
+ * It has its own receiving threads which are able to process any message
+ * received from a remote node with `msg.meta.customer_id()` equal to this
+ * customer's id. There is one thread in default. With more threads, a message
+ * is processed by the thread picked by a \ref ShardFunc, so the messages of
+ * the same shard are processed in order, and the others concurrently.
+ *
+ * The time from \ref NewRequest to the last response of each request, and
+ * the messages waiting for the receiving threads are recorded in \ref
+ * Metrics.
  */
 class Customer {
  public:
 
   /**
    * \brief the handle for a received message
-   * \param recved the received message
+   * \param recved the received message, whose data the handle can move out.
+   * the meta is read after the handle
    */
-  using RecvHandle = std::function<void(const Message& recved)>;
+  using RecvHandle = std::function<void(Message& recved)>;
+
+  /**
+   * \brief return the shard of a received message, the thread processing it
+   * is the shard modulo the number of threads. it is called by the threads
+   * of \ref Van, so it should be cheap
+   */
+  using ShardFunc = std::function<int(const Message& recved)>;
 
   /**
    * \brief constructor
    * \param id the unique id, any received message with
    * \param recv_handle the functino for processing a received message
    */
-  Customer(int id, const RecvHandle& recv_handle);
+  Customer(int id, const RecvHandle& recv_handle)
+      : Customer(id, recv_handle, 1, nullptr) { }
+
+  /**
+   * \brief constructor with several receiving threads
+   * \param id the unique id
+   * \param recv_handle the function for processing a received message, called
+   * concurrently if num_threads > 1
+   * \param num_threads the number of receiving threads
+   * \param shard picks the thread of a message, only used if num_threads > 1
+   */
+  Customer(int id, const RecvHandle& recv_handle, int num_threads,
+           const ShardFunc& shard);
 
   /**
    * \brief desconstructor
@@ -43,8 +77,19 @@ class Customer {
    */
   int id() { return id_; }
 
+  /**
+   * \brief return the number of slots of the request ring, a power of 2. the
+   * request of timestamp t is in slot `t & (num_slots() - 1)`
+   */
+  int num_slots() const { return mask_ + 1; }
+
   /**
    * \brief get a timestamp for a new request. threadsafe
+   *
+   * it blocks while the slot to reuse has a request not finished, so at most
+   * \ref num_slots() requests are not finished at a time. a receiving thread
+   * of this customer, such as in a handle or a callback, must not block on
+   * its own, which aborts
    * \param recver the receive node id of this request
    * \return the timestamp of this request
    */
@@ -52,43 +97,98 @@ class Customer {
 
 
   /**
-   * \brief wait until the request is finished. threadsafe
+   * \brief wait until the request is finished. threadsafe. only the waiters
+   * of this request are woken up by its responses
    * \param timestamp the timestamp of the request
    */
   void WaitRequest(int timestamp);
 
   /**
    * \brief return the number of responses received for the request. threadsafe
+   * and lock-free
    * \param timestamp the timestamp of the request
    */
   int NumResponse(int timestamp);
 
   /**
-   * \brief add a number of responses to timestamp
+   * \brief add a number of responses to timestamp. threadsafe and lock-free
    */
   void AddResponse(int timestamp, int num = 1);
 
+  /**
+   * \brief return true if the request failed to reach some receivers.
+   * threadsafe
+   * \param timestamp the timestamp of the request
+   */
+  bool HasFailed(int timestamp);
+
   /**
    * \brief accept a received message from \ref Van. threadsafe
-   * \param recved the received the message
+   * \param recved the received the message, moved in by \ref Van
    */
-  void Accept(const Message& recved) { recv_queue_.Push(recved); }
+  void Accept(Message recved) {
+    size_t i = 0;
+    if (recv_queues_.size() > 1) {
+      i = static_cast<unsigned>(shard_(recved)) % recv_queues_.size();
+    }
+    metrics_->queue_depth.fetch_add(1, std::memory_order_relaxed);
+    recv_queues_[i]->Push(std::move(recved));
+  }
 
  private:
   /**
    * \brief the thread function
+   * \param queue the queue of this thread
    */
-  void Receiving();
+  void Receiving(ThreadsafePriorityQueue* queue);
 
   int id_;
 
   RecvHandle recv_handle_;
-  ThreadsafeQueue<Message> recv_queue_;
-  std::unique_ptr<std::thread> recv_thread_;
+  ShardFunc shard_;
+  /** \brief one queue for each receiving thread */
+  std::vector<std::unique_ptr<ThreadsafePriorityQueue>> recv_queues_;
+  std::vector<std::thread> recv_threads_;
+  std::shared_ptr<Metrics::Customer> metrics_;
+
+  /**
+   * \brief a slot of the request ring. a reader checks timestamp again after
+   * reading the other fields, in case the slot is reused meanwhile
+   */
+  struct Request {
+    /** \brief -1 if never used */
+    std::atomic<int> timestamp{-1};
+    std::atomic<int> num_expected{0};
+    /** \brief the futex word the waiters of this request block on */
+    std::atomic<uint32_t> num_response{0};
+    /** \brief whether the request failed to reach some receivers */
+    std::atomic<bool> failed{false};
+    /** \brief 1 if some threads may block on num_response */
+    std::atomic<uint32_t> waiting{0};
+    /** \brief the time made, in nanoseconds of the steady clock */
+    std::atomic<int64_t> start{0};
+    /** \brief timestamp once the other fields are set for it */
+    std::atomic<int> made{-1};
+  };
+
+  /**
+   * \brief return the slot of a request, nullptr if it is reused by a newer
+   * request, which means the request finished
+   */
+  Request* Find(int timestamp) {
+    Request* req = &tracker_[timestamp & mask_];
+    return req->timestamp.load() == timestamp ? req : nullptr;
+  }
 
+  /** \brief guards next_, it is not held while waiting for a slot */
   std::mutex tracker_mu_;
-  std::condition_variable tracker_cond_;
-  std::vector<std::pair<int, int>> tracker_;
+  /** \brief the ring of requests, whose size is a power of 2 */
+  std::unique_ptr<Request[]> tracker_;
+  int mask_;
+  /** \brief the number of requests made, the timestamp is its low 31 bits */
+  int64_t next_ = 0;
+  /** \brief the customer whose receiving thread this is, if any */
+  static thread_local const Customer* receiving_;
 
   DISALLOW_COPY_AND_ASSIGN(Customer);
 };
@@ -0,0 +1,34 @@
+#pragma once
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <time.h>
+#include <climits>
+#include <atomic>
+#include <cstdint>
+
+namespace ps {
+
+/**
+ * \brief block while *addr equals val, it may return spuriously. it also
+ * works for the words in shared memory
+ * \param timeout_ms wait for at most that many milliseconds, forever if
+ * negative
+ */
+inline void FutexWait(std::atomic<uint32_t>* addr, uint32_t val,
+                      int timeout_ms = -1) {
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? nullptr : &ts,
+          nullptr, 0);
+}
+
+/**
+ * \brief wake up all threads blocked in \ref FutexWait on addr
+ */
+inline void FutexWake(std::atomic<uint32_t>* addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+}  // namespace ps
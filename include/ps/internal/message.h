@@ -1,7 +1,9 @@
 #pragma once
+#include <utility>
 #include <vector>
 #include "ps/sarray.h"
 #include "ps/internal/meta_message.pb.h"
+#include "ps/internal/meta_pool.h"
 namespace ps {
 
 enum DataType {
@@ -10,6 +12,19 @@ enum DataType {
   FLOAT, DOUBLE, OTHER
 };
 
+/**
+ * \brief the codecs compressing the data of messages, see \ref Compressor
+ */
+enum Compression {
+  NO_COMPRESSION, LZ, FLOAT_SHUFFLE
+};
+
+/**
+ * \brief the priority of small messages others are waiting for, such as pulls
+ * and responses. bulk pushes use the default 0
+ */
+const int kHighPriority = 1;
+
 template<typename V, typename W>
 inline bool SameType() {
   return std::is_same<typename std::remove_cv<V>::type, W>::value;
@@ -50,7 +65,36 @@ DataType GetDataType() {
 struct Message {
   static const int kInvalidNode = 0;
   Message() : sender(kInvalidNode), recver(kInvalidNode) { }
+  Message(const Message& msg) = default;
+  Message& operator=(const Message& msg) = default;
+  /**
+   * \brief the meta is swapped, since the messages of protobuf 2 have no
+   * move operations and would be copied
+   */
+  Message(Message&& msg)
+      : raw_meta(std::move(msg.raw_meta)), data(std::move(msg.data)),
+        sender(msg.sender), recver(msg.recver) {
+    meta.Swap(&msg.meta);
+  }
+  Message& operator=(Message&& msg) {
+    if (this == &msg) return *this;
+    meta.Swap(&msg.meta);
+    raw_meta = std::move(msg.raw_meta);
+    data = std::move(msg.data);
+    sender = msg.sender;
+    recver = msg.recver;
+    return *this;
+  }
+  /** \brief the memory of the meta is recycled, see \ref MetaPool */
+  ~Message() {
+    if (meta.data_type().Capacity()) MetaPool::Release(&meta);
+  }
   MetaMessage meta;
+  /**
+   * \brief the meta as received, decoded into meta by \ref Van. it is empty
+   * once decoded, or if the message is not received
+   */
+  SArray<char> raw_meta;
 
   std::vector<SArray<char> > data;
 
@@ -60,6 +104,7 @@ struct Message {
   template <typename V>
   void AddData(const SArray<V>& val) {
     CHECK_EQ(data.size(), (size_t)meta.data_type_size());
+    if (!meta.data_type().Capacity()) MetaPool::AcquireDataTypes(&meta);
     meta.add_data_type(GetDataType<V>());
     data.push_back(SArray<char>(val));
   }
@@ -0,0 +1,85 @@
+#pragma once
+#include "ps/base.h"
+#include "ps/internal/message.h"
+#include "ps/internal/meta_message.pb.h"
+
+namespace ps {
+
+/**
+ * \brief the fixed layout of the meta of an app message on the wire
+ *
+ * It is followed by num_data bytes of data types, then if \ref kHasCompression
+ * is set, the uint8 compression and the uint32 compressed, then if \ref
+ * kHasPriority is set, the int32 priority, and then the body.
+ */
+struct PackedMeta {
+  /** \brief always 0, which is never the first byte of a protobuf message */
+  uint8_t magic;
+  uint8_t num_data;
+  /** \brief a bitwise or of the flags below */
+  uint16_t flags;
+  int32_t head;
+  int32_t customer_id;
+  int32_t timestamp;
+  uint32_t body_size;
+
+  static const uint16_t kRequest = 1;
+  static const uint16_t kPush = 2;
+  static const uint16_t kSimpleApp = 4;
+  static const uint16_t kHasHead = 8;
+  static const uint16_t kHasCustomerID = 16;
+  static const uint16_t kHasTimestamp = 32;
+  static const uint16_t kHasPush = 64;
+  static const uint16_t kHasBody = 128;
+  static const uint16_t kBatch = 256;
+  static const uint16_t kHasCompression = 512;
+  static const uint16_t kHasPriority = 1024;
+};
+
+/**
+ * \brief encodes the meta of a message for the wire
+ *
+ * Control messages are encoded by protobuf, while app messages use the
+ * compact \ref PackedMeta unless a field does not fit in it. Decoding accepts
+ * both, which tells them apart by the first byte.
+ */
+class MetaCodec {
+ public:
+  /**
+   * \brief return the encoded size of meta
+   */
+  static int Size(const MetaMessage& meta);
+
+  /**
+   * \brief encode meta into buf
+   * \param size the size returned by \ref Size, which must be called right
+   * before
+   */
+  static void Encode(const MetaMessage& meta, int size, char* buf);
+
+  /**
+   * \brief decode meta from buf
+   * \return false if buf is corrupted
+   */
+  static bool Decode(const char* buf, int size, MetaMessage* meta);
+
+  /**
+   * \brief decode msg->raw_meta into msg->meta, then release it
+   */
+  static void Decode(Message* msg);
+
+  /**
+   * \brief decode only the fixed fields of a compact meta and the priority,
+   * which are enough to route the message, skipping the data types and the
+   * body
+   * \return false if buf is not compact, such as the meta of a control
+   * message, or is corrupted
+   */
+  static bool Peek(const char* buf, int size, MetaMessage* meta);
+
+ private:
+  /** \brief whether meta can use the compact layout */
+  static bool Compact(const MetaMessage& meta);
+};
+
+}  // namespace ps
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include "ps/base.h"
+#include "ps/internal/meta_message.pb.h"
+
+namespace ps {
+
+/**
+ * \brief recycles the memory held by the metas of finished messages
+ *
+ * A cleared MetaMessage keeps the capacity of its data types, body and
+ * control, so the pool keeps the metas of destroyed messages and swaps them
+ * into new ones. Then decoding or building the meta of a steady stream of
+ * messages does not allocate.
+ *
+ * Every thread keeps a cache of metas without locking. The metas are mostly
+ * released by other threads than the ones acquiring, such as the customer
+ * threads and the receiving threads of the van, so the caches exchange them
+ * in magazines of \ref kMagazine metas through a locked depot.
+ */
+class MetaPool {
+ public:
+  /** \brief the counters of the pool, summed over all threads */
+  struct Stats {
+    /** \brief the acquires served by a recycled meta */
+    uint64_t hits;
+    /** \brief the acquires finding the pool empty */
+    uint64_t misses;
+    /** \brief the metas kept by releases */
+    uint64_t releases;
+    /** \brief the metas freed since the depot was full */
+    uint64_t drops;
+  };
+
+  /**
+   * \brief give an empty meta the memory of a recycled one, if any
+   * \param meta a meta holding no memory, such as a new one
+   */
+  static void Acquire(MetaMessage* meta);
+
+  /**
+   * \brief give an empty repeated field the memory of the data types of a
+   * recycled meta, if any. it is for the metas being built, whose other
+   * fields may be set already
+   */
+  static void AcquireDataTypes(MetaMessage* meta);
+
+  /**
+   * \brief clear meta and keep its memory for reuse
+   */
+  static void Release(MetaMessage* meta);
+
+  /** \brief return the counters */
+  static Stats GetStats();
+
+  /** \brief the number of metas moved between a thread and the depot at once */
+  static const size_t kMagazine = 64;
+  /** \brief the maximal number of magazines in the depot */
+  static const size_t kMaxMagazines = 256;
+
+ private:
+  /** \brief the metas of a thread */
+  struct Cache;
+  /** \brief the magazines shared by the threads, and the counters */
+  struct Depot;
+  /**
+   * \brief return the cache of this thread, nullptr once the thread is
+   * exiting
+   */
+  static Cache* GetCache();
+  /** \brief return the depot, which is never destroyed */
+  static Depot* GetDepot();
+
+  /** \brief move a magazine from the depot into cache, false if none */
+  static bool Refill(Cache* cache);
+  /** \brief move a magazine from cache into the depot */
+  static void Spill(Cache* cache);
+};
+
+}  // namespace ps
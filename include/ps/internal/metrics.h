@@ -0,0 +1,250 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/message.h"
+#include "ps/internal/peer_map.h"
+
+namespace ps {
+
+/**
+ * \brief a histogram of latencies with a bounded relative error, as HDR
+ * histograms do
+ *
+ * The values below 2^kSubBits nanoseconds have a bucket each. Above, every
+ * power of two is split into 2^(kSubBits-1) buckets, so a value is known
+ * within 1/2^(kSubBits-1) of it, from 1 nanosecond to centuries. Recording
+ * is lock-free.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() {
+    for (auto& count : counts_) count = 0;
+  }
+
+  /** \brief record a value in nanoseconds. threadsafe */
+  void Record(uint64_t ns) {
+    counts_[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns)) { }
+  }
+
+  /** \brief the number of values recorded */
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  /** \brief the sum of the values recorded, in nanoseconds */
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  /** \brief the maximal value recorded, in nanoseconds */
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  /**
+   * \brief return the value at quantile q in [0, 1], in nanoseconds. it is
+   * the upper bound of the bucket holding it, 0 if nothing was recorded
+   */
+  uint64_t Quantile(double q) const;
+
+ private:
+  static const int kSubBits = 5;
+  static const int kSubCount = 1 << kSubBits;
+  static const int kNumBuckets = (64 - kSubBits + 1) * (kSubCount / 2) +
+                                 kSubCount / 2;
+
+  static int Bucket(uint64_t v) {
+    if (v < (uint64_t)kSubCount) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - kSubBits + 1;
+    return shift * (kSubCount / 2) + (int)(v >> shift);
+  }
+
+  /** \brief the largest value of a bucket */
+  static uint64_t UpperBound(int bucket) {
+    if (bucket < kSubCount) return bucket;
+    int shift = bucket / (kSubCount / 2) - 1;
+    uint64_t top = bucket - shift * (kSubCount / 2);
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::atomic<uint64_t> counts_[kNumBuckets];
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+  DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+/**
+ * \brief the traffic counters and latencies of this node
+ *
+ * \ref Van counts the bytes and messages sent to and received from each
+ * peer node, and for each customer. A \ref Customer tracks the messages
+ * queued for its receiving threads, and the time from \ref
+ * Customer::NewRequest to the last response of a request. The counters are
+ * atomic, and are found without locking.
+ *
+ * If `DMLC_PS_METRICS_FILE` is set, a thread writes them every
+ * `DMLC_PS_METRICS_INTERVAL` seconds into that file, in the text format of
+ * Prometheus.
+ */
+class Metrics {
+ public:
+  /** \brief the traffic in one direction */
+  struct Traffic {
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> messages{0};
+    void Add(size_t n) {
+      bytes.fetch_add(n, std::memory_order_relaxed);
+      messages.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  /** \brief the counters of a peer node */
+  struct Peer {
+    Traffic sent, recv;
+  };
+
+  /** \brief the counters of a customer */
+  struct Customer {
+    Traffic sent, recv;
+    /** \brief the messages waiting in the queues of the receiving threads */
+    std::atomic<int64_t> queue_depth{0};
+    /** \brief the round trips of the requests */
+    LatencyHistogram latency;
+  };
+
+  /** \brief a copy of the counters */
+  struct Snapshot {
+    struct TrafficStats {
+      uint64_t sent_bytes, sent_messages, recv_bytes, recv_messages;
+    };
+    struct PeerStats : TrafficStats {
+      int node_id;
+    };
+    struct CustomerStats : TrafficStats {
+      int customer_id;
+      int64_t queue_depth;
+      /** \brief the number of requests finished */
+      uint64_t num_requests;
+      /** \brief the latencies of the requests, in nanoseconds */
+      uint64_t latency_sum, latency_p50, latency_p90, latency_p99,
+          latency_max;
+    };
+    /** \brief my node id */
+    int node_id;
+    /** \brief sorted by the node id */
+    std::vector<PeerStats> peers;
+    /** \brief sorted by the customer id */
+    std::vector<CustomerStats> customers;
+  };
+
+  Metrics() { }
+  ~Metrics() { StopDump(); }
+
+  /**
+   * \brief count a message sent, also for its customer unless it is a
+   * control message. threadsafe
+   * \param bytes the bytes sent by the transport
+   */
+  void AddSent(const Message& msg, size_t bytes) {
+    if (msg.recver != Message::kInvalidNode) {
+      GetPeer(msg.recver)->sent.Add(bytes);
+    }
+    if (!msg.meta.has_control()) {
+      GetCustomer(msg.meta.customer_id())->sent.Add(bytes);
+    }
+  }
+
+  /**
+   * \brief count a message received, also for its customer unless it is a
+   * control message. threadsafe
+   * \param bytes the bytes received by the transport
+   */
+  void AddRecv(const Message& msg, size_t bytes) {
+    if (msg.sender != Message::kInvalidNode) {
+      GetPeer(msg.sender)->recv.Add(bytes);
+    }
+    if (!msg.meta.has_control()) {
+      GetCustomer(msg.meta.customer_id())->recv.Add(bytes);
+    }
+  }
+
+  /**
+   * \brief return the counters of a peer node, which are created on the
+   * first call and kept till exit. threadsafe
+   */
+  std::shared_ptr<Peer> GetPeer(int node_id) {
+    auto peer = peers_.Find(node_id);
+    return peer ? peer : Create(&peers_, &peer_ids_, node_id);
+  }
+
+  /**
+   * \brief return the counters of a customer, which are created on the
+   * first call and kept till exit, so a new customer of the same id goes on
+   * with them. threadsafe
+   */
+  std::shared_ptr<Customer> GetCustomer(int customer_id) {
+    auto customer = customers_.Find(customer_id);
+    return customer ? customer :
+        Create(&customers_, &customer_ids_, customer_id);
+  }
+
+  /** \brief return a copy of the counters. threadsafe */
+  Snapshot GetSnapshot() const;
+
+  /**
+   * \brief return the counters in the text format of Prometheus, labeled by
+   * my node id
+   */
+  std::string ToPrometheus() const;
+
+  /**
+   * \brief start writing the counters if `DMLC_PS_METRICS_FILE` is set, a
+   * `%i` in the file name is replaced by my node id
+   */
+  void StartDump(int node_id);
+
+  /** \brief stop writing, after writing them the last time */
+  void StopDump();
+
+ private:
+  template <typename T>
+  std::shared_ptr<T> Create(PeerMap<T>* map, std::vector<int>* ids, int id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto found = map->Find(id);
+    if (found) return found;
+    auto created = std::make_shared<T>();
+    map->Put(id, created);
+    ids->push_back(id);
+    return created;
+  }
+
+  /** \brief the thread function writing the file */
+  void Dumping();
+
+  /** \brief write the file, through a temporary one renamed to it */
+  void Dump();
+
+  PeerMap<Peer> peers_;
+  PeerMap<Customer> customers_;
+  /** \brief serializes the puts, and guards the ids */
+  mutable std::mutex mu_;
+  /** \brief the ids of the peers and the customers created */
+  std::vector<int> peer_ids_, customer_ids_;
+
+  int node_id_ = 0;
+  std::string dump_file_;
+  std::chrono::seconds dump_interval_{10};
+  std::unique_ptr<std::thread> dump_thread_;
+  std::mutex dump_mu_;
+  std::condition_variable dump_cond_;
+  bool dump_exit_ = false;
+  DISALLOW_COPY_AND_ASSIGN(Metrics);
+};
+
+}  // namespace ps
@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/futex.h"
+namespace ps {
+
+/**
+ * \brief a lock-free queue of many producers and a single consumer
+ *
+ * It is a linked list, a push exchanges the head and links the old head to
+ * the new node, and the consumer pops from the tail. A push costs an
+ * allocation and an atomic exchange, and never blocks the consumer or other
+ * producers. A waiting consumer spins for a while before blocking on a futex,
+ * and the spinning is lengthened if it often succeeds, shortened otherwise.
+ * The producers only touch the futex while the consumer is blocked or about
+ * to.
+ *
+ * The pops must be called by one thread at a time. T must be default
+ * constructible.
+ */
+template<typename T> class MPSCQueue {
+ public:
+  MPSCQueue() : head_(new Node()), tail_(head_.load()) { }
+  ~MPSCQueue() {
+    T value;
+    while (TryPop(&value)) { }
+    delete tail_;
+  }
+
+  /**
+   * \brief push an value into the end. threadsafe and lock-free
+   */
+  void Push(T new_value) {
+    Node* node = new Node();
+    new (&node->storage) T(std::move(new_value));
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    // pairs with the fence in WaitAndPop, either the consumer sees the node,
+    // or this sees it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // only the first push after the consumer slept pays for the syscall
+    if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(0)) {
+      wakeups_.fetch_add(1);
+      FutexWake(&wakeups_);
+    }
+  }
+
+  /**
+   * \brief pop an element from the beginning if any. called by the consumer
+   * \return false if it is empty, or the pushes in the middle are not
+   * finished yet
+   */
+  bool TryPop(T* value) {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    if (!next) return false;
+    T* v = next->value();
+    *value = std::move(*v);
+    v->~T();
+    // next becomes the dummy head of the list
+    delete tail_;
+    tail_ = next;
+    return true;
+  }
+
+  /**
+   * \brief return true if there is nothing to pop. called by the consumer
+   */
+  bool empty() const {
+    return tail_->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+  /**
+   * \brief pop all elements available and append them. called by the
+   * consumer
+   * \return the number of elements popped
+   */
+  size_t PopAll(std::vector<T>* values) {
+    size_t n = 0;
+    T value;
+    while (TryPop(&value)) {
+      values->push_back(std::move(value));
+      ++n;
+    }
+    return n;
+  }
+
+  /**
+   * \brief wait until pop an element from the beginning. called by the
+   * consumer
+   */
+  void WaitAndPop(T* value) {
+    for (int i = 0; i < spin_; ++i) {
+      if (TryPop(value)) {
+        // spinning paid off
+        if (i > 0 && spin_ < kMaxSpin) spin_ *= 2;
+        return;
+      }
+      Pause();
+    }
+    if (spin_ > kMinSpin) spin_ /= 2;
+    while (true) {
+      sleeping_.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      uint32_t wakeups = wakeups_.load();
+      if (TryPop(value)) break;
+      FutexWait(&wakeups_, wakeups);
+    }
+    sleeping_.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  /** \brief the value is constructed by the push and destroyed by the pop */
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    T* value() { return reinterpret_cast<T*>(&storage); }
+  };
+
+  static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  static const int kMinSpin = 16;
+  static const int kMaxSpin = 1 << 14;
+  static const int kCacheLine = 64;
+
+  /** \brief the last node pushed, touched by the producers */
+  std::atomic<Node*> head_;
+  /** \brief bumped to wake the consumer up */
+  std::atomic<uint32_t> wakeups_{0};
+  /** \brief 1 if the consumer may block, cleared by the push waking it */
+  std::atomic<int> sleeping_{0};
+  /**
+   * \brief keeps the fields of the consumer off the cache line of the
+   * producers, wherever the queue is allocated. alignas is not used since
+   * operator new only guarantees it from C++17
+   */
+  char pad_[kCacheLine];
+  /** \brief the dummy node before the first element, touched by the consumer */
+  Node* tail_;
+  /** \brief the number of tries before blocking */
+  int spin_ = 128;
+
+  DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+}  // namespace ps
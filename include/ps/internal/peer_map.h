@@ -0,0 +1,67 @@
+#pragma once
+#include <unordered_map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace ps {
+
+/**
+ * \brief node id to the per-peer state of a transport
+ *
+ * \ref Find is called on every send by many threads, while peers are only
+ * added when connecting. So the map is copied and replaced as a whole by
+ * \ref Put, and \ref Find takes a snapshot without locking the map. Each peer
+ * then has its own lock, so sends to different nodes run in parallel.
+ */
+template <typename T>
+class PeerMap {
+ public:
+  PeerMap() : map_(std::make_shared<const Map>()) { }
+
+  /**
+   * \brief find a peer, threadsafe
+   * \return nullptr if not found
+   */
+  std::shared_ptr<T> Find(int id) const {
+    auto map = std::atomic_load(&map_);
+    auto it = map->find(id);
+    return it == map->end() ? nullptr : it->second;
+  }
+
+  /**
+   * \brief add or replace a peer, the callers must be serialized
+   */
+  void Put(int id, const std::shared_ptr<T>& peer) {
+    std::shared_ptr<Map> map(new Map(*std::atomic_load(&map_)));
+    (*map)[id] = peer;
+    std::atomic_store(&map_, std::shared_ptr<const Map>(map));
+  }
+
+  /**
+   * \brief add or replace many peers with a single copy of the map, the
+   * callers must be serialized
+   */
+  void Put(const std::vector<std::pair<int, std::shared_ptr<T>>>& peers) {
+    std::shared_ptr<Map> map(new Map(*std::atomic_load(&map_)));
+    for (const auto& peer : peers) (*map)[peer.first] = peer.second;
+    std::atomic_store(&map_, std::shared_ptr<const Map>(map));
+  }
+
+  /**
+   * \brief remove all peers, the callers must be serialized
+   * \return the removed peers
+   */
+  std::vector<std::shared_ptr<T>> Clear() {
+    auto map = std::atomic_exchange(&map_, std::make_shared<const Map>());
+    std::vector<std::shared_ptr<T>> peers;
+    for (auto& it : *map) peers.push_back(it.second);
+    return peers;
+  }
+
+ private:
+  typedef std::unordered_map<int, std::shared_ptr<T>> Map;
+  std::shared_ptr<const Map> map_;
+};
+
+}  // namespace ps
@@ -1,8 +1,10 @@
 #pragma once
+#include <atomic>
 #include <mutex>
 #include "ps/range.h"
 #include "ps/internal/customer.h"
 #include "ps/internal/van.h"
+#include "ps/internal/metrics.h"
 namespace ps {
 
 /**
@@ -20,6 +22,9 @@ class Postoffice {
   /** \brief get the van */
   Van* van() { return van_; }
 
+  /** \brief get the traffic counters and latencies of this node */
+  Metrics* metrics() { return &metrics_; }
+
 
   /**
    * \brief start the system
@@ -37,8 +42,13 @@ class Postoffice {
    */
   void Finalize();
 
+  /** \brief the customer ids must be in [0, kMaxCustomers) */
+  static const int kMaxCustomers = 1024;
+
   /**
    * \brief add an customer to the system. threadsafe
+   *
+   * the messages received for it before are passed to it first
    */
   void AddCustomer(Customer* customer);
 
@@ -48,13 +58,20 @@ class Postoffice {
   void RemoveCustomer(Customer* customer);
 
   /**
-   * \brief get the customer by id, threadsafe
+   * \brief get the customer by id, threadsafe and lock-free
    * \param id the customer id
    * \param timeout timeout in sec
    * \return return nullptr if doesn't exist and timeout
    */
   Customer* GetCustomer(int id, int timeout = 0) const;
 
+  /**
+   * \brief pass a received message to its customer, or keep it until the
+   * customer is added. threadsafe, and lock-free if the customer exists
+   * \param msg the message, which is moved away
+   */
+  void Deliver(Message* msg);
+
   /**
    * \brief get the id of a node (group), threadsafe
    *
@@ -143,35 +160,32 @@ class Postoffice {
   int is_scheduler() const { return is_scheduler_; }
 
   /**
-   * \brief barrier
-   * \param node_id the barrier group id
+   * \brief barrier, block until all alive nodes in the group reached it
+   * \param node_id the barrier group id, any combination of the groups
    */
   void Barrier(int node_id);
 
-  /**
-   * \brief process a control message, called by van
-   * \param the received message
-   */
-  void Manage(const Message& recv);
-
  private:
   Postoffice();
   ~Postoffice() { delete van_; }
   Van* van_;
+  Metrics metrics_;
   mutable std::mutex mu_;
   DISALLOW_COPY_AND_ASSIGN(Postoffice);
 
-  std::unordered_map<int, Customer*> customers_;
+  /**
+   * \brief indexed by the customer id. written under mu_, and read without
+   * locking
+   */
+  std::atomic<Customer*> customers_[kMaxCustomers];
+  /** \brief the messages received for the customers not added yet */
+  std::unordered_map<int, std::vector<Message>> pending_;
   std::unordered_map<int, std::vector<int>> node_ids_;
   std::vector<Range> server_key_ranges_;
 
   bool is_worker_, is_server_, is_scheduler_;
   int num_servers_, num_workers_;
 
-  bool barrier_done_;
-  std::mutex barrier_mu_;
-  std::condition_variable barrier_cond_;
-
   Callback exit_callback_;
 };
 }  // namespace ps
@@ -0,0 +1,127 @@
+#pragma once
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/message.h"
+#include "ps/internal/mpsc_queue.h"
+namespace ps {
+
+/**
+ * \brief a queue of messages ordered by `meta.priority`, not threadsafe
+ *
+ * A message of priority p is popped before the messages of lower priority
+ * pushed less than p * \ref kOvertake pushes before it, and otherwise in the
+ * order of pushing. So high priority messages go first, while a low priority
+ * message waits for a bounded number of pops only. Messages of the same
+ * priority keep their order.
+ *
+ * The messages of the same sender and customer always keep their order, so a
+ * pull never passes the pushes of the same worker before it. A message only
+ * overtakes the other streams, as it gets no earlier deadline than the one
+ * before it in its stream.
+ */
+class PriorityQueue {
+ public:
+  /** \brief the number of pushes a message can overtake per priority */
+  static const int64_t kOvertake = 1024;
+
+  void Push(Message msg) {
+    int64_t deadline = (int64_t)seq_ - msg.meta.priority() * kOvertake;
+    uint64_t stream = Stream(msg);
+    auto& last = streams_[stream];
+    if (last.queued++) deadline = std::max(deadline, last.deadline);
+    last.deadline = deadline;
+    heap_.push_back(Entry{deadline, seq_++, stream, std::move(msg)});
+    std::push_heap(heap_.begin(), heap_.end());
+  }
+
+  /**
+   * \brief pop the first message, the queue must not be empty
+   */
+  void Pop(Message* msg) {
+    std::pop_heap(heap_.begin(), heap_.end());
+    auto it = streams_.find(heap_.back().stream);
+    if (--it->second.queued == 0) streams_.erase(it);
+    *msg = std::move(heap_.back().msg);
+    heap_.pop_back();
+  }
+
+  bool empty() const { return heap_.empty(); }
+  size_t size() const { return heap_.size(); }
+
+ private:
+  /** \brief the messages of a stream are popped in the order of pushing */
+  static uint64_t Stream(const Message& msg) {
+    return ((uint64_t)(uint32_t)msg.sender << 32) |
+        (uint32_t)msg.meta.customer_id();
+  }
+
+  struct Entry {
+    int64_t deadline;
+    uint64_t seq;
+    uint64_t stream;
+    Message msg;
+    /** \brief for the max-heap, the later one is smaller */
+    bool operator<(const Entry& other) const {
+      return deadline != other.deadline ? deadline > other.deadline :
+          seq > other.seq;
+    }
+  };
+  /** \brief a stream with messages queued */
+  struct Last {
+    /** \brief the deadline of its last message */
+    int64_t deadline;
+    /** \brief the number of its messages queued */
+    int queued = 0;
+  };
+
+  std::vector<Entry> heap_;
+  std::unordered_map<uint64_t, Last> streams_;
+  uint64_t seq_ = 0;
+};
+
+/**
+ * \brief thread-safe \ref PriorityQueue allowing push and waited pop
+ *
+ * The pushes go to a lock-free \ref MPSCQueue, and the consumer moves them
+ * into its own \ref PriorityQueue before every pop. So the producers and the
+ * consumer do not contend on a lock, and the priorities order all messages
+ * pushed before the pop, as a locked queue does. The pops must be called by
+ * one thread at a time.
+ */
+class ThreadsafePriorityQueue {
+ public:
+  /**
+   * \brief push a message. threadsafe.
+   */
+  void Push(Message msg) { inbox_.Push(std::move(msg)); }
+
+  /**
+   * \brief wait until pop the first message, called by the consumer
+   */
+  void WaitAndPop(Message* msg) {
+    Drain();
+    if (queue_.empty()) {
+      inbox_.WaitAndPop(msg);
+      if (inbox_.empty()) return;
+      queue_.Push(std::move(*msg));
+      Drain();
+    }
+    queue_.Pop(msg);
+  }
+
+ private:
+  /** \brief move the pushed messages into queue_ */
+  void Drain() {
+    if (inbox_.empty()) return;
+    Message msg;
+    while (inbox_.TryPop(&msg)) queue_.Push(std::move(msg));
+  }
+
+  MPSCQueue<Message> inbox_;
+  /** \brief touched by the consumer only */
+  PriorityQueue queue_;
+};
+
+}  // namespace ps
@@ -0,0 +1,165 @@
+#pragma once
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "ps/internal/transport.h"
+#include "ps/internal/peer_map.h"
+
+namespace ps {
+
+struct ShmInbox;
+struct ShmChannel;
+
+/**
+ * \brief shared-memory transport between nodes running on the same machine
+ *
+ * Every node owns an inbox, a shared-memory segment named after the port it
+ * binds. The inbox is split into one channel per remote sender. A channel is a
+ * single-producer single-consumer ring whose bytes are also the payload arena:
+ * the sender serializes the meta and copies the data frames into the ring
+ * once, and the receiver hands them out as \ref SArray without copying. A
+ * record is recycled by the sender when the last \ref SArray referencing it
+ * on the receiver side is destroyed.
+ *
+ * It is used either as the only transport when all nodes run on the same
+ * machine, or by \ref Van for the data messages to the nodes on the same
+ * machine. In the latter case, a channel refusing messages because its ring
+ * stays full is used again once the ring drains and the receiver has got the
+ * messages sent through the network meanwhile, which the receiver counts by
+ * \ref CountReceived in its own channel to the sender.
+ */
+class ShmTransport : public Transport {
+ public:
+  /**
+   * \param connect_timeout seconds to wait for the inbox of a remote node
+   * being created in \ref Connect
+   */
+  explicit ShmTransport(int connect_timeout = 0)
+      : connect_timeout_(connect_timeout) { }
+  ~ShmTransport() override { Stop(); }
+
+  /**
+   * \brief create the inbox of this node with one channel for every other
+   * node. the inbox is named after the port, a random one if it is 0
+   * \return the port, -1 if failed
+   */
+  int Bind(const Node& node, int max_retry) override;
+
+  /**
+   * \brief attach to the inbox of a remote node
+   * \return false if the remote node has no inbox or it is full. attaching is
+   * tried again on the first message sent to it
+   */
+  bool Connect(const Node& node, int my_id) override;
+
+  /**
+   * \brief send a message, threadsafe
+   *
+   * blocks while the ring to the receiver is full.
+   * \return the number of bytes sent. -1 if the message cannot go through
+   * shared memory. Every message sent before has been received in this case.
+   * The following messages to the same node do not use shared memory either
+   * until the receiver has counted as many messages by \ref CountReceived,
+   * so the caller can switch to another transport without reordering
+   */
+  int SendMsg(const Message& msg) override;
+
+  /**
+   * \brief count a data message from sender received through another
+   * transport, after it is handed on. it is called by a single thread, not
+   * after \ref Stop
+   */
+  void CountReceived(int sender);
+
+  /**
+   * \brief receive a message from any channel
+   * \return the number of bytes received. -1 if stopped
+   */
+  int RecvMsg(Message* msg) override;
+
+  /**
+   * \brief detach from all remote inboxes and remove my inbox
+   */
+  void Stop() override;
+
+ private:
+  /** \brief a mapped channel in a remote inbox */
+  struct Peer {
+    /** \brief the node id */
+    int id = Message::kInvalidNode;
+    /** \brief the name of the inbox */
+    std::string name;
+    void* base = nullptr;
+    size_t length = 0;
+    ShmInbox* inbox = nullptr;
+    /** \brief nullptr if not attached */
+    ShmChannel* channel = nullptr;
+    /** \brief set once channel is, for \ref CountReceived */
+    std::atomic<bool> attached{false};
+    /** \brief my id written into each record */
+    int my_id = Message::kInvalidNode;
+    /** \brief true if attaching was tried on the first message */
+    bool retried = false;
+    /** \brief true if messages do not go through this channel for now */
+    bool disabled = false;
+    /** \brief the messages refused since the channel was claimed */
+    uint64_t refused = 0;
+    /** \brief the channel of the peer in my inbox, found once disabled */
+    ShmChannel* back = nullptr;
+    std::mutex mu;
+  };
+
+  /**
+   * \brief map the inbox of peer and claim a free channel in it
+   * \return false if it does not exist, is not initialized yet, or is full
+   */
+  bool Attach(Peer* peer);
+
+  /**
+   * \brief return true if a disabled channel can be used again: the receiver
+   * has counted every message refused, and released every record
+   */
+  bool Drained(Peer* peer);
+
+  /** \brief recycle the records of a channel released by the receiver */
+  void Reclaim(Peer* peer);
+
+  /**
+   * \brief reserve a record of size bytes in the channel of peer
+   * \param head returns the head of the channel after this record
+   * \return nullptr if the record cannot be placed
+   */
+  char* Reserve(Peer* peer, size_t size, uint64_t* head);
+
+  /** \brief mark the record received last as consumed */
+  void CommitRecv();
+
+  /** \brief the name of the inbox for a port */
+  static std::string InboxName(int port) {
+    return "/ps-lite-" + std::to_string(port);
+  }
+
+  int connect_timeout_;
+  std::string name_;
+  void* base_ = nullptr;
+  size_t length_ = 0;
+  ShmInbox* inbox_ = nullptr;
+  std::vector<ShmChannel*> channels_;
+
+  /** \brief the channel and the record size received last */
+  ShmChannel* last_channel_ = nullptr;
+  size_t last_size_ = 0;
+  size_t next_channel_ = 0;
+
+  std::atomic<bool> exit_{false};
+
+  /** \brief serializes adding peers in Connect and Stop */
+  std::mutex mu_;
+  /** \brief node id to the channel for sending data to this node */
+  PeerMap<Peer> peers_;
+  DISALLOW_COPY_AND_ASSIGN(ShmTransport);
+};
+}  // namespace ps
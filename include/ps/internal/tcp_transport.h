@@ -0,0 +1,140 @@
+#pragma once
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <string>
+#include <sys/uio.h>
+#include "ps/sarray.h"
+#include "ps/internal/transport.h"
+#include "ps/internal/peer_map.h"
+
+namespace ps {
+
+/**
+ * \brief the transport based on plain TCP sockets and epoll
+ *
+ * Each message is framed as a fixed header, the data sizes, the meta and the
+ * data frames, the latter two padded to 8 bytes. A message is sent by a
+ * single sendmsg with one iovec per part, without copying the data. The
+ * receiving thread polls all incoming connections and reads each message
+ * body into one buffer from \ref BufferPool, which then backs both the meta
+ * and the data frames.
+ */
+class TCPTransport : public Transport {
+ public:
+  TCPTransport() { }
+  ~TCPTransport() override { }
+
+  int Bind(const Node& node, int max_retry) override;
+  bool Connect(const Node& node, int my_id) override;
+  int SendMsg(const Message& msg) override;
+  int RecvMsg(Message* msg) override;
+  void Stop() override;
+
+ protected:
+  /** \brief an outgoing connection */
+  struct Peer {
+    int fd = -1;
+    /** \brief my id written into each message */
+    int my_id = Message::kInvalidNode;
+    std::mutex mu;
+  };
+
+  /** \brief an incoming connection */
+  struct Conn {
+    int fd = -1;
+    /** \brief received bytes not parsed yet are staging[begin, end) */
+    char* staging = nullptr;
+    size_t capacity = 0;
+    /** \brief owns staging unless it is provided by a subclass */
+    std::vector<char> buffer;
+    size_t begin = 0, end = 0;
+    /** \brief the header of the message being received */
+    int sender = Message::kInvalidNode;
+    uint32_t meta_size = 0;
+    std::vector<uint64_t> data_size;
+    /** \brief the body being filled, empty if waiting for a header */
+    SArray<char> body;
+    size_t filled = 0;
+    bool in_body = false;
+  };
+
+  /** \brief the header, the meta and iovecs of a message to send */
+  struct SendBuffer {
+    std::vector<uint64_t> head;
+    std::string meta;
+    std::vector<struct iovec> iov;
+  };
+
+  /**
+   * \brief create the listening socket
+   * \return the port bound. -1 if failed
+   */
+  int Listen(int port, int max_retry);
+
+  /**
+   * \brief frame a message, the iovecs point to the data of msg
+   * \return the number of bytes of the meta and data
+   */
+  int Pack(const Message& msg, int my_id, SendBuffer* buf);
+
+  /**
+   * \brief handle the bytes read into a connection and decide the next read
+   *
+   * complete messages are appended into \ref received_
+   * \param bytes the number of bytes just read into the place returned by the
+   * last call
+   * \param dst returns where to read next
+   * \param len returns the number of bytes to read next
+   */
+  void Consume(Conn* conn, size_t bytes, char** dst, size_t* len);
+
+  /**
+   * \brief move the first received message into msg
+   * \return the number of bytes received
+   */
+  int PopReceived(Message* msg);
+
+  int listen_fd_ = -1;
+
+  /** \brief received messages and their sizes */
+  std::deque<std::pair<Message, int>> received_;
+
+  /** \brief serializes adding peers in Connect and Stop */
+  std::mutex mu_;
+  /** \brief node id to the connection for sending data to this node */
+  PeerMap<Peer> peers_;
+
+ private:
+  /**
+   * \brief accept all pending connections
+   */
+  void Accept();
+
+  /**
+   * \brief read from a connection until it would block
+   * \return false if the connection is closed
+   */
+  bool Read(Conn* conn);
+
+  /**
+   * \brief parse a header from the staging buffer, which is replaced by a
+   * larger one owned by the connection if the header does not fit in it
+   * \return false if not enough bytes
+   */
+  bool ParseHeader(Conn* conn);
+
+  /**
+   * \brief a body is complete, assemble the message
+   */
+  void Finish(Conn* conn);
+
+  int epoll_fd_ = -1;
+
+  /** \brief incoming connections, only accessed by the receiving thread */
+  std::unordered_map<int, std::unique_ptr<Conn>> conns_;
+  DISALLOW_COPY_AND_ASSIGN(TCPTransport);
+};
+}  // namespace ps
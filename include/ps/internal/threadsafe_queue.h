@@ -1,12 +1,16 @@
+#pragma once
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
+#include <vector>
 #include "ps/base.h"
 namespace ps {
 
 /**
  * \brief thread-safe queue allowing push and waited pop
+ *
+ * Any thread can pop. For a single consumer, \ref MPSCQueue avoids the lock.
  */
 template<typename T> class ThreadsafeQueue {
  public:
@@ -21,7 +25,7 @@ template<typename T> class ThreadsafeQueue {
     mu_.lock();
     queue_.push(std::move(new_value));
     mu_.unlock();
-    cond_.notify_all();
+    cond_.notify_one();
   }
 
   /**
@@ -35,6 +39,32 @@ template<typename T> class ThreadsafeQueue {
     queue_.pop();
   }
 
+  /**
+   * \brief pop an element from the beginning if any, threadsafe
+   * \return false if it is empty
+   */
+  bool TryPop(T* value) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (queue_.empty()) return false;
+    *value = std::move(queue_.front());
+    queue_.pop();
+    return true;
+  }
+
+  /**
+   * \brief pop all elements and append them, threadsafe
+   * \return the number of elements popped
+   */
+  size_t PopAll(std::vector<T>* values) {
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t n = queue_.size();
+    while (!queue_.empty()) {
+      values->push_back(std::move(queue_.front()));
+      queue_.pop();
+    }
+    return n;
+  }
+
  private:
   mutable std::mutex mu_;
   std::queue<T> queue_;
@@ -42,13 +72,3 @@ template<typename T> class ThreadsafeQueue {
 };
 
 } // namespace ps
-
-
-  // bool TryPop(T& value) {
-  //   std::lock_guard<std::mutex> lk(mut);
-  //   if(data_queue.empty())
-  //     return false;
-  //   value=std::move(data_queue.front());
-  //   data_queue.pop();
-  //   return true;
-  // }
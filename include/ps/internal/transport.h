@@ -0,0 +1,90 @@
+#pragma once
+#include <functional>
+#include <string>
+#include "ps/base.h"
+#include "ps/internal/message.h"
+#include "ps/internal/node.pb.h"
+
+namespace ps {
+
+/**
+ * \brief the engine moving messages between nodes
+ *
+ * \ref Van manages the nodes and calls a transport to actually move the
+ * bytes. An engine only needs to deliver the messages sent from one node to
+ * another in order.
+ */
+class Transport {
+ public:
+  /**
+   * \brief the handle of a message which failed after \ref SendMsg returned
+   */
+  using ErrorHandle = std::function<void(const Message& msg)>;
+
+  /**
+   * \brief create a transport engine
+   * \param type "zmq" for ZeroMQ, "tcp" for plain TCP, "uring" for io_uring,
+   * "shm" for shared memory (all nodes run on the same machine)
+   */
+  static Transport* Create(const std::string& type);
+
+  virtual ~Transport() { }
+
+  /**
+   * \brief set the handle of the messages failed in the background, by the
+   * engines sending after \ref SendMsg returns. must be called before \ref
+   * Bind
+   */
+  void set_error_handle(const ErrorHandle& handle) { error_handle_ = handle; }
+
+  /**
+   * \brief bind to the port of node to receive messages
+   *
+   * if the port is 0, an unused port is picked, by the system when possible,
+   * otherwise by retrying random ports
+   * \param node my node
+   * \param max_retry the maximal number of retries
+   * \return the port bound. -1 if failed
+   */
+  virtual int Bind(const Node& node, int max_retry) = 0;
+
+  /**
+   * \brief connect to a node, calling it again updates my id. threadsafe,
+   * and the connections to different nodes can be set up in parallel
+   * \param node the remote node
+   * \param my_id my node id seen by the remote node, Message::kInvalidNode if
+   * not assigned yet
+   * \return false if failed
+   */
+  virtual bool Connect(const Node& node, int my_id) = 0;
+
+  /**
+   * \brief send a message to msg.recver, threadsafe
+   * \return the number of bytes sent. -1 if failed
+   */
+  virtual int SendMsg(const Message& msg) = 0;
+
+  /**
+   * \brief receive a message, called by a single thread
+   *
+   * msg.sender is filled with the id given by the sender in \ref Connect,
+   * and the meta is left undecoded in msg.raw_meta
+   * \return the number of bytes received. -1 if failed or stopped
+   */
+  virtual int RecvMsg(Message* msg) = 0;
+
+  /**
+   * \brief close all connections
+   */
+  virtual void Stop() = 0;
+
+ protected:
+  /**
+   * \brief return a random port in [10000, 50000) to retry binding with
+   */
+  static int RandomPort();
+
+  ErrorHandle error_handle_;
+};
+
+}  // namespace ps
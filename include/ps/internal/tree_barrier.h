@@ -0,0 +1,121 @@
+#pragma once
+#include <functional>
+#include <condition_variable>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "ps/internal/message.h"
+#include "ps/internal/node.pb.h"
+
+namespace ps {
+
+/**
+ * \brief a barrier combining the arrivals along a tree of the group
+ *
+ * The alive nodes of a group, in the order of \ref Postoffice::GetNodeIDs,
+ * form a tree with at most fanout children per node. A node tells its parent
+ * once itself and all its children arrived, and the root then releases the
+ * tree top-down. So a node handles at most fanout + 1 messages per barrier,
+ * and the barrier takes O(log N) hops.
+ *
+ * Every barrier of a group has a generation, so the messages of back-to-back
+ * barriers cannot be confused, and the groups are independent. A tree is
+ * also tagged with its view, namely the number of dead nodes in the group.
+ * Only the arrivals of the same view are combined, and the nodes arrive again
+ * along the new tree after a node died, so a barrier never passes before all
+ * alive nodes reached it.
+ */
+class TreeBarrier {
+ public:
+  /** \brief sends a control message */
+  using SendFunc = std::function<int(const Message& msg)>;
+  /** \brief returns true if a node is dead */
+  using DeadFunc = std::function<bool(int id)>;
+
+  /**
+   * \param my_node my node, its id is read when the barriers are used
+   * \param send the function sending a message
+   * \param is_dead the function checking whether a node is dead
+   * \param fanout the maximal number of children of a node
+   */
+  TreeBarrier(const Node& my_node, const SendFunc& send,
+              const DeadFunc& is_dead, int fanout);
+
+  /**
+   * \brief block until all alive nodes in a group reached the barrier. a
+   * group is waited by at most one thread of a node at a time
+   */
+  void Wait(int group);
+
+  /**
+   * \brief handle a received BARRIER message, threadsafe
+   */
+  void Process(const Message& msg);
+
+  /**
+   * \brief rebuild the trees after nodes died, threadsafe
+   */
+  void Update();
+
+ private:
+  /** \brief the barrier state of a group */
+  struct Group {
+    /** \brief the number of barriers entered */
+    int gen = 0;
+    /** \brief the number of barriers passed */
+    int done = 0;
+    /** \brief the view the current barrier is arrived at, -1 if not yet */
+    int arrived_view = -1;
+    /** \brief the view the last passed barrier is arrived at */
+    int done_view = 0;
+    /** \brief (generation, view) => the children arrived */
+    std::map<std::pair<int, int>, std::unordered_set<int>> arrived;
+  };
+
+  /** \brief my place in the tree of a group */
+  struct Tree {
+    int view;
+    /** \brief -1 if I am the root */
+    int parent;
+    std::vector<int> children;
+  };
+
+  /**
+   * \brief return my place in the current tree of a group
+   */
+  Tree GetTree(int group);
+
+  /**
+   * \brief arrive at the parent or pass the barrier if all children arrived.
+   * the caller holds mu_
+   * \param out the messages to send after unlocking
+   */
+  void Check(int group, Group* state, std::vector<Message>* out);
+
+  /**
+   * \brief pass the current barrier and release the children. the caller
+   * holds mu_
+   */
+  void Pass(const Tree& tree, int group, Group* state,
+            std::vector<Message>* out);
+
+  /**
+   * \brief a BARRIER message, an arrival if request is true, otherwise a
+   * release
+   */
+  static Message Make(int recver, int group, int gen, int view, bool request);
+
+  const Node& my_node_;
+  SendFunc send_;
+  DeadFunc is_dead_;
+  int fanout_;
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::unordered_map<int, Group> groups_;
+};
+
+}  // namespace ps
@@ -0,0 +1,113 @@
+#pragma once
+#include <unordered_map>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include "ps/internal/tcp_transport.h"
+
+struct io_uring_sqe;
+
+namespace ps {
+
+/**
+ * \brief the transport based on io_uring, on the wire it is the same as
+ * \ref TCPTransport
+ *
+ * A single I/O thread owns the ring. \ref SendMsg only frames a message and
+ * queues it. The I/O thread then submits the sends to all peers and the reads
+ * from all connections with one io_uring_enter, and gathers the messages
+ * queued for the same peer into one sendmsg. Headers are read into buffers
+ * registered to the kernel, while bodies are read into buffers from \ref
+ * BufferPool directly.
+ *
+ * As a send completes later than \ref SendMsg returns, the requests failing
+ * then are passed to the error handle of the transport.
+ */
+class UringTransport : public TCPTransport {
+ public:
+  UringTransport();
+  ~UringTransport() override;
+
+  int Bind(const Node& node, int max_retry) override;
+  int SendMsg(const Message& msg) override;
+  int RecvMsg(Message* msg) override;
+  void Stop() override;
+
+ private:
+  struct Ring;
+  struct Request;
+  struct Sender;
+  struct Reader;
+
+  /**
+   * \brief the loop of the I/O thread
+   */
+  void Polling();
+
+  /**
+   * \brief move the requests queued by \ref SendMsg into the senders
+   */
+  void TakeRequests();
+
+  /**
+   * \brief handle a completion
+   */
+  void Complete(uint64_t user_data, int res);
+
+  /** \brief the submissions */
+  void PostAccept();
+  void PostWakeup();
+  void PostRead(Reader* reader);
+  void PostSend(Sender* sender);
+
+  /**
+   * \brief called when a send to a peer is done
+   */
+  void Sent(Sender* sender, int res);
+
+  /**
+   * \brief close the connection of a sender after a send failed, and fail
+   * the messages queued, the requests among them are passed to the error
+   * handle. the later sends to the peer return -1
+   */
+  void Fail(Sender* sender);
+
+  /**
+   * \brief get a submission entry, submit the queued ones if the ring is full
+   */
+  struct io_uring_sqe* GetSqe();
+
+  std::unique_ptr<Ring> ring_;
+  std::unique_ptr<std::thread> io_thread_;
+  int event_fd_ = -1;
+  uint64_t event_buf_ = 0;
+  std::atomic<bool> exit_{false};
+  /** \brief the I/O thread is waiting for completions */
+  std::atomic<bool> sleeping_{false};
+
+  /** \brief the buffers registered to the kernel, one slot per connection */
+  char* slots_ = nullptr;
+  int num_slots_ = 0;
+  bool registered_ = false;
+  std::vector<int> free_slots_;
+
+  /** \brief the requests queued by SendMsg and the recycled ones */
+  std::mutex send_mu_;
+  std::vector<Request*> submitted_;
+  std::vector<Request*> free_;
+
+  /** \brief only accessed by the I/O thread */
+  std::unordered_map<Peer*, std::unique_ptr<Sender>> senders_;
+  std::unordered_map<int, std::unique_ptr<Reader>> readers_;
+  std::vector<Request*> done_;
+  int busy_senders_ = 0;
+
+  /** \brief protects received_ */
+  std::mutex recv_mu_;
+  std::condition_variable recv_cond_;
+  bool stopped_ = false;
+  DISALLOW_COPY_AND_ASSIGN(UringTransport);
+};
+}  // namespace ps
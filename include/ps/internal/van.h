@@ -1,19 +1,33 @@
 #pragma once
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include <string>
 #include <thread>
 #include <memory>
 #include <atomic>
+#include <vector>
 #include "ps/base.h"
 
 #include "ps/internal/message.h"
 #include "ps/internal/node.pb.h"
+#include "ps/internal/transport.h"
+#include "ps/internal/shm_transport.h"
+#include "ps/internal/priority_queue.h"
+#include "ps/internal/coalescer.h"
+#include "ps/internal/async_sender.h"
+#include "ps/internal/peer_map.h"
+#include "ps/internal/tree_barrier.h"
 
 namespace ps {
 
 /**
  * \brief Van sends messages to remote nodes
+ *
+ * It manages the nodes and moves the messages through a \ref Transport
+ * engine, which is chosen by the environment variable `DMLC_PS_VAN_TYPE`.
  */
 class Van {
  public:
@@ -40,6 +54,11 @@ class Van {
 
   /**
    * \brief send a message, thread-safe
+   *
+   * If `DMLC_PS_ASYNC_SEND` is set, a data message is only queued, and a
+   * request failed to send later is answered by a local response with
+   * `meta.error` set.
+   *
    * \return the number of bytes sent. -1 if failed
    */
   int Send(const Message& msg) {
@@ -47,6 +66,14 @@ class Van {
     return Send_(msg);
   }
 
+  /**
+   * \brief block until all alive nodes in a group reached the barrier
+   */
+  void Barrier(int group) {
+    CHECK(ready_) << "call Start() first";
+    barrier_->Wait(group);
+  }
+
   /**
    * \brief return my node
    */
@@ -70,10 +97,14 @@ class Van {
   int Send_(const Message& msg);
 
   /**
-   * return the node id given the received identity
-   * \return -1 if not find
+   * \brief send a message by the calling thread
    */
-  int GetNodeID(const char* buf, size_t size);
+  int SendNow(const Message& msg);
+
+  /**
+   * \brief give the customer a failed response if msg is a request
+   */
+  void ReportError(const Message& msg);
 
   /**
    * \brief connect to a node
@@ -81,23 +112,93 @@ class Van {
   void Connect(const Node& node);
 
   /**
-   * \brief receive a packge
-   * \return the number of bytes received. -1 if failed
+   * \brief connect to nodes in parallel, or only remember them if
+   * `DMLC_PS_LAZY_CONNECT` is set
+   */
+  void Connect(const std::vector<Node>& nodes);
+
+  /**
+   * \brief connect all transports to a node
+   * \return false if failed
+   */
+  bool ConnectNow(const Node& node);
+
+  /**
+   * \brief connect to a node remembered by \ref Connect if not yet
+   * \return false if failed
+   */
+  bool EnsureConnected(int id);
+
+  /**
+   * \brief mark ready and wake up \ref Start
+   */
+  void SetReady();
+
+  /**
+   * thread function for receving from a transport
    */
-  int Recv(Message* msg);
+  void Receiving(Transport* transport);
 
   /**
-   * thread function for receving
+   * thread function for receving from shared memory
    */
-  void Receiving();
+  void ShmReceiving();
 
   /**
-   * thread function for monioring
+   * \brief give a received data message to its customer, or to a dispatching
+   * thread if there are any
+   */
+  void Dispatch(Message* msg);
+
+  /**
+   * \brief decode the meta of a received message. if there are dispatching
+   * threads, only the fields routing a data message are decoded, and the
+   * rest is left to the thread
+   */
+  void ReadMeta(Message* msg);
+
+  /**
+   * thread function for dispatching the data messages of a shard
+   */
+  void Dispatching(int shard);
+
+  /**
+   * thread function sending heartbeats to the scheduler
+   */
+  void Heartbeat();
+
+  /**
+   * thread function of the scheduler finding the nodes without heartbeats,
+   * and telling all nodes about them
    */
   void Monitoring();
 
-  void *context_ = nullptr;
-  void *receiver_ = nullptr;
+  /**
+   * \brief return true if the node is dead. threadsafe
+   */
+  bool IsDead(int id);
+
+  /**
+   * \brief mark a node as dead, and fail the requests waiting for it
+   */
+  void MarkDead(int id);
+
+  /**
+   * \brief remember a request until its response is dispatched
+   */
+  void AddPending(const Message& msg);
+
+  /**
+   * \brief forget the request of a response
+   * \return false if it is not pending, namely the response is made up
+   * already
+   */
+  bool RemovePending(const Message& msg);
+
+  /**
+   * \brief the transport engine
+   */
+  std::unique_ptr<Transport> transport_;
 
   Node scheduler_;
   Node my_node_;
@@ -107,37 +208,122 @@ class Van {
    * whether it is ready for sending
    */
   std::atomic<bool> ready_{false};
+  std::mutex ready_mu_;
+  std::condition_variable ready_cond_;
 
   /**
    * in exiting if true
    */
   std::atomic<bool> exit_{true};
 
-  std::mutex mu_;
+  /**
+   * the number of nodes added, only used by the scheduler
+   */
+  int num_servers_ = 0;
+  int num_workers_ = 0;
+
+  /**
+   * \brief a node to connect to on the first message sent to it
+   */
+  struct Peer {
+    std::mutex mu;
+    Node node;
+    std::atomic<bool> connected{false};
+  };
+  /** \brief whether to connect to the nodes on first sends */
+  bool lazy_connect_ = false;
+  PeerMap<Peer> peers_;
+  /** \brief serializes adding peers */
+  std::mutex peers_mu_;
+
+  /**
+   * the thread for receiving messages
+   */
+  std::unique_ptr<std::thread> receiver_thread_;
 
-  size_t send_bytes_ = 0;
-  size_t recv_bytes_ = 0;
+  std::unique_ptr<TreeBarrier> barrier_;
 
-int num_servers_ = 0;
-int num_workers_ = 0;
+  /**
+   * \brief the transport for control messages, nullptr if they go through
+   * transport_
+   */
+  std::unique_ptr<Transport> control_;
 
   /**
-   * \brief node_id to the socket for sending data to this node
+   * the thread for receiving control messages
    */
-  std::unordered_map<int, void *> senders_;
+  std::unique_ptr<std::thread> control_receiver_thread_;
 
   /**
-   * the thread for monitoering node liveness
+   * \brief the shared-memory transport for data messages to the nodes on the
+   * same machine, nullptr if disabled
    */
-  std::unique_ptr<std::thread> monitor_thread_;
+  std::unique_ptr<ShmTransport> shm_;
 
   /**
-   * the thread for receiving messages
+   * the thread for receiving messages from shared memory
    */
+  std::unique_ptr<std::thread> shm_receiver_thread_;
 
-  std::vector<int> barrier_count_;
+  /**
+   * \brief packs the small messages to the same node, nullptr if disabled
+   */
+  std::unique_ptr<Coalescer> coalescer_;
 
-  std::unique_ptr<std::thread> receiver_thread_;
+  /**
+   * \brief sends the data messages by background threads, nullptr if disabled
+   */
+  std::unique_ptr<AsyncSender> async_sender_;
+
+  /**
+   * \brief the data messages waiting for the dispatching threads, one queue
+   * per thread. messages are sharded by (sender, customer), so that those of
+   * the same priority keep their order
+   */
+  std::vector<std::unique_ptr<ThreadsafePriorityQueue>> dispatch_queues_;
+
+  /**
+   * the threads for dispatching, empty if dispatched by the receiving threads
+   */
+  std::vector<std::unique_ptr<std::thread>> dispatch_threads_;
+
+  /**
+   * \brief the interval of heartbeats, 0 if disabled
+   */
+  std::chrono::seconds heartbeat_interval_{0};
+  /**
+   * \brief a node is dead if no heartbeat for this long
+   */
+  std::chrono::seconds heartbeat_timeout_{0};
+
+  /**
+   * the thread for \ref Heartbeat, or \ref Monitoring on the scheduler
+   */
+  std::unique_ptr<std::thread> heartbeat_thread_;
+  std::mutex heartbeat_mu_;
+  std::condition_variable heartbeat_cond_;
+  /**
+   * \brief the time of the last heartbeat of each alive node, only used by the
+   * scheduler
+   */
+  std::unordered_map<int, std::chrono::steady_clock::time_point> heartbeats_;
+
+  std::mutex dead_mu_;
+  std::unordered_set<int> dead_nodes_;
+  /** \brief whether dead_nodes_ is not empty */
+  std::atomic<bool> has_dead_{false};
+
+  /**
+   * \brief the requests sent to a node and waiting for responses
+   */
+  struct Pending {
+    std::mutex mu;
+    /** \brief (customer_id << 32 | timestamp) => simple_app */
+    std::unordered_map<uint64_t, bool> reqs;
+  };
+  PeerMap<Pending> pending_;
+  /** \brief protects the creation of pending_ */
+  std::mutex pending_mu_;
   DISALLOW_COPY_AND_ASSIGN(Van);
 };
 }  // namespace ps
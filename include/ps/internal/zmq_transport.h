@@ -0,0 +1,55 @@
+#pragma once
+#include <mutex>
+#include <memory>
+#include <thread>
+#include "ps/internal/transport.h"
+#include "ps/internal/peer_map.h"
+
+namespace ps {
+
+/**
+ * \brief the transport based on ZeroMQ
+ *
+ * a node receives from a ROUTER socket, and sends to each remote node via a
+ * DEALER socket whose identity is "ps" + my node id
+ */
+class ZMQTransport : public Transport {
+ public:
+  ZMQTransport();
+  ~ZMQTransport() override { }
+
+  int Bind(const Node& node, int max_retry) override;
+  bool Connect(const Node& node, int my_id) override;
+  int SendMsg(const Message& msg) override;
+  int RecvMsg(Message* msg) override;
+  void Stop() override;
+
+ private:
+  /**
+   * return the node id given the received identity
+   * \return -1 if not find
+   */
+  int GetNodeID(const char* buf, size_t size);
+
+  /**
+   * \brief the socket for sending data to a node. a zmq socket must not be
+   * used by two threads at the same time
+   */
+  struct Sender {
+    void *socket = nullptr;
+    std::mutex mu;
+  };
+
+  void *context_ = nullptr;
+  void *receiver_ = nullptr;
+
+  /** \brief serializes Connect and Stop */
+  std::mutex mu_;
+
+  /**
+   * \brief node_id to the socket for sending data to this node
+   */
+  PeerMap<Sender> senders_;
+  DISALLOW_COPY_AND_ASSIGN(ZMQTransport);
+};
+}  // namespace ps
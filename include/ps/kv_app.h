@@ -1,5 +1,6 @@
 #include "ps/base.h"
 #include "ps/simple_app.h"
+#include "ps/future.h"
 namespace ps {
 
 /**
@@ -63,6 +64,7 @@ class KVWorker : public SimpleApp {
     using namespace std::placeholders;
     slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
     obj_ = new Customer(app_id, std::bind(&KVWorker<Val>::Process, this, _1));
+    slots_ = std::unique_ptr<Slot[]>(new Slot[obj_->num_slots()]);
   }
 
   /** \brief deconstructor */
@@ -139,7 +141,7 @@ class KVWorker : public SimpleApp {
            std::vector<int>* lens = nullptr,
            int cmd = 0,
            const Callback& cb = nullptr) {
-    return Pull_(SArray<Key>(keys), vals, lens, cmd, cb);
+    return Pull_(SArray<Key>(keys), vals, lens, cmd, cb, Future());
   }
 
   /**
@@ -152,6 +154,9 @@ class KVWorker : public SimpleApp {
    *   // now vals is ready for use
    * \endcode
    *
+   * If some servers could not be reached, it still returns, and \ref Failed
+   * returns true while vals is left untouched.
+   *
    * \param timestamp the timestamp returned by the push or pull
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
@@ -169,14 +174,7 @@ class KVWorker : public SimpleApp {
             const SArray<int>& lens = {},
             int cmd = 0,
             const Callback& cb = nullptr) {
-    int ts = obj_->NewRequest(kServerGroup);
-    AddCallback(ts, cb);
-    KVPairs<Val> kvs;
-    kvs.keys = keys;
-    kvs.vals = vals;
-    kvs.lens = lens;
-    Send(ts, true, cmd, kvs);
-    return ts;
+    return Push_(keys, vals, lens, cmd, cb, Future());
   }
 
   /**
@@ -192,7 +190,60 @@ class KVWorker : public SimpleApp {
             SArray<int>* lens = nullptr,
             int cmd = 0,
             const Callback& cb = nullptr) {
-    return Pull_(keys, vals, lens, cmd, cb);
+    return Pull_(keys, vals, lens, cmd, cb, Future());
+  }
+
+  /**
+   * \brief \ref Push returning a future instead of the timestamp
+   *
+   * The future is finished once the push is finished, and is failed if some
+   * servers could not be reached. See \ref Future for chaining and awaiting.
+   */
+  Future PushAsync(const std::vector<Key>& keys,
+                   const std::vector<Val>& vals,
+                   const std::vector<int>& lens = {},
+                   int cmd = 0) {
+    return ZPushAsync(SArray<Key>(keys), SArray<Val>(vals), SArray<int>(lens),
+                      cmd);
+  }
+
+  /**
+   * \brief \ref Pull returning a future instead of the timestamp
+   *
+   * \a vals (and \a lens) is filled before the future is finished, and is
+   * left untouched if the future is failed.
+   */
+  Future PullAsync(const std::vector<Key>& keys,
+                   std::vector<Val>* vals,
+                   std::vector<int>* lens = nullptr,
+                   int cmd = 0) {
+    Future future = Future::Create();
+    Pull_(SArray<Key>(keys), vals, lens, cmd, nullptr, future);
+    return future;
+  }
+
+  /**
+   * \brief \ref ZPush returning a future instead of the timestamp
+   */
+  Future ZPushAsync(const SArray<Key>& keys,
+                    const SArray<Val>& vals,
+                    const SArray<int>& lens = {},
+                    int cmd = 0) {
+    Future future = Future::Create();
+    Push_(keys, vals, lens, cmd, nullptr, future);
+    return future;
+  }
+
+  /**
+   * \brief \ref ZPull returning a future instead of the timestamp
+   */
+  Future ZPullAsync(const SArray<Key>& keys,
+                    SArray<Val>* vals,
+                    SArray<int>* lens = nullptr,
+                    int cmd = 0) {
+    Future future = Future::Create();
+    Pull_(keys, vals, lens, cmd, nullptr, future);
+    return future;
   }
 
   using SlicedKVs = std::vector<std::pair<bool, KVPairs<Val>>>;
@@ -215,25 +266,63 @@ class KVWorker : public SimpleApp {
   }
 
  private:
+  /**
+   * \brief the state of a request, in the slot of the request ring of \ref
+   * Customer. a new request reuses a slot only after the request there
+   * finished, and the callback runs before that, so a slot is touched by one
+   * request at a time
+   */
+  struct Slot {
+    /** \brief the received kvs of a pull */
+    std::vector<KVPairs<Val>> kvs;
+    Callback cb;
+    /** \brief finished after the callback if valid */
+    Future future;
+  };
+
+  /**
+   * \brief internal push
+   */
+  int Push_(const SArray<Key>& keys, const SArray<Val>& vals,
+            const SArray<int>& lens, int cmd, const Callback& cb,
+            const Future& future) {
+    int ts = obj_->NewRequest(kServerGroup);
+    AddCallback(ts, cb, future);
+    KVPairs<Val> kvs;
+    kvs.keys = keys;
+    kvs.vals = vals;
+    kvs.lens = lens;
+    Send(ts, true, cmd, kvs);
+    return ts;
+  }
+
   /**
    * \brief internal pull, C/D can be either SArray or std::vector
    */
   template <typename C, typename D>
   int Pull_(const SArray<Key>& keys, C* vals, D* lens,
-            int cmd, const Callback& cb);
+            int cmd, const Callback& cb, const Future& future);
+
+  /** \brief return the slot of a request */
+  Slot& GetSlot(int timestamp) {
+    return slots_[timestamp & (obj_->num_slots() - 1)];
+  }
+
   /**
-   * \brief add a callback for a request. threadsafe.
-   * @param cb callback
+   * \brief add a callback and a future for a request. not threadsafe for the
+   * same timestamp, but it is called only by the thread making the request
    * @param timestamp the timestamp of the request
+   * @param cb callback
+   * @param future finished after the callback if valid
    */
-  void AddCallback(int timestamp, const Callback& cb) {
-    if (!cb) return;
-    std::lock_guard<std::mutex> lk(mu_);
-    callbacks_[timestamp] = cb;
+  void AddCallback(int timestamp, const Callback& cb, const Future& future) {
+    Slot& slot = GetSlot(timestamp);
+    slot.cb = cb;
+    slot.future = future;
   }
 
   /**
-   * \brief run and delete the callback
+   * \brief run and delete the callback, then finish the future
    * \param timestamp the timestamp of the callback
    */
   void RunCallback(int timestamp);
@@ -244,18 +333,16 @@ class KVWorker : public SimpleApp {
    * @param cmd command
    */
   void Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs);
-  /** \brief internal receive handle */
-  void Process(const Message& msg);
+  /** \brief internal receive handle, moving the data out of msg */
+  void Process(Message& msg);
   /** \brief default kv slicer */
   void DefaultSlicer(const KVPairs<Val>& send,
                      const std::vector<Range>& ranges,
                      SlicedKVs* sliced);
 
-  /** \brief data buffer for received kvs for each timestamp */
-  std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
-  /** \brief callbacks for each timestamp */
-  std::unordered_map<int, Callback> callbacks_;
-  /** \brief lock */
+  /** \brief the state of the requests, one slot for each of \ref Customer */
+  std::unique_ptr<Slot[]> slots_;
+  /** \brief lock for appending the received kvs */
   std::mutex mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
@@ -271,6 +358,8 @@ struct KVMeta {
   int sender;
   /** \brief the associated timestamp */
   int timestamp;
+  /** \brief the codec the response asked to use */
+  int compression;
 };
 
 /**
@@ -279,13 +368,41 @@ struct KVMeta {
 template <typename Val>
 class KVServer : public SimpleApp {
  public:
+  /**
+   * \brief how the requests are spread over the handler threads
+   */
+  enum Dispatch {
+    /**
+     * \brief by the first key. the key range of this server is split evenly
+     * among the threads, so the requests starting in the same part run in
+     * order
+     */
+    kByKey,
+    /** \brief by the sender, so the requests of a worker run in order */
+    kBySender
+  };
+
   /**
    * \brief constructor
+   *
+   * With more than one thread, the request handle is called concurrently
+   * for the requests of different threads, so it must be threadsafe, such as
+   * locking the keys it updates. \ref Response can be called from any
+   * thread, also later than the handle returns.
+   *
    * \param app_id the app id, should match with \ref KVWorker's id
+   * \param num_threads the number of threads calling the request handle, read
+   * from `DMLC_PS_SERVER_THREADS` (default 1) if 0
+   * \param dispatch how the requests are spread over the threads
    */
-  KVServer(int app_id) : SimpleApp() {
+  KVServer(int app_id, int num_threads = 0, Dispatch dispatch = kByKey)
+      : SimpleApp(), dispatch_(dispatch) {
     using namespace std::placeholders;
-    obj_ = new Customer(app_id, std::bind(&KVServer<Val>::Process, this, _1));
+    num_threads_ = num_threads ? num_threads
+        : GetEnv("DMLC_PS_SERVER_THREADS", 1);
+    obj_ = new Customer(app_id, std::bind(&KVServer<Val>::Process, this, _1),
+                        num_threads_,
+                        std::bind(&KVServer<Val>::Shard, this, _1));
   }
 
   /** \brief deconstructor */
@@ -300,9 +417,15 @@ class KVServer : public SimpleApp {
   using ReqHandle = std::function<void(const KVMeta& req_meta,
                                        const KVPairs<Val>& req_data,
                                        KVServer* server)>;
+  /**
+   * \brief set the request handle. the requests received before wait for it
+   */
   void set_request_handle(const ReqHandle& request_handle) {
     CHECK(request_handle) << "invalid request handle";
+    std::lock_guard<std::mutex> lk(handle_mu_);
     request_handle_ = request_handle;
+    has_handle_ = true;
+    handle_cond_.notify_all();
   }
 
   /**
@@ -313,15 +436,25 @@ class KVServer : public SimpleApp {
   void Response(const KVMeta& req, const KVPairs<Val>& res = KVPairs<Val>());
 
  private:
-  /** \brief internal receive handle */
-  void Process(const Message& msg);
+  /** \brief internal receive handle, moving the data out of msg */
+  void Process(Message& msg);
+  /** \brief return the handler thread of a request */
+  int Shard(const Message& msg);
   /** \brief request handle */
   ReqHandle request_handle_;
+  std::atomic<bool> has_handle_{false};
+  std::mutex handle_mu_;
+  std::condition_variable handle_cond_;
+  int num_threads_;
+  Dispatch dispatch_;
 };
 
 
 /**
  * \brief an example handle adding pushed kv into store
+ *
+ * It is not threadsafe, so it is for the servers of one handler thread, or
+ * for the requests of the same keys always going to the same thread.
  */
 template <typename Val>
 struct KVServerDefaultHandle {
@@ -351,7 +484,7 @@ struct KVServerDefaultHandle {
 ///////////////////////////////////////////////////////////////////////////////
 
 template <typename Val>
-void KVServer<Val>::Process(const Message& msg) {
+void KVServer<Val>::Process(Message& msg) {
   if (msg.meta.simple_app()) {
     SimpleApp::Process(msg); return;
   }
@@ -360,22 +493,41 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.push = msg.meta.push();
   meta.sender = msg.sender;
   meta.timestamp = msg.meta.timestamp();
+  meta.compression = msg.meta.compression();
   KVPairs<Val> data;
   int n = msg.data.size();
   if (n) {
     CHECK_GE(n, 2);
-    data.keys = msg.data[0];
-    data.vals = msg.data[1];
+    data.keys = std::move(msg.data[0]);
+    data.vals = std::move(msg.data[1]);
     if (n > 2) {
       CHECK_EQ(n, 3);
-      data.lens = msg.data[2];
+      data.lens = std::move(msg.data[2]);
       CHECK_EQ(data.lens.size(), data.keys.size());
     }
   }
-  CHECK(request_handle_);
+  if (!has_handle_) {
+    // the app is just made, and the handle is being set
+    std::unique_lock<std::mutex> lk(handle_mu_);
+    handle_cond_.wait(lk, [this] { return has_handle_.load(); });
+  }
   request_handle_(meta, data, this);
 }
 
+template <typename Val>
+int KVServer<Val>::Shard(const Message& msg) {
+  if (dispatch_ == kBySender || msg.meta.simple_app() || msg.data.empty() ||
+      msg.data[0].size() < sizeof(Key)) {
+    return msg.sender;
+  }
+  Key key = SArray<Key>(msg.data[0])[0];
+  auto* po = Postoffice::Get();
+  const Range& range = po->GetServerKeyRanges()[po->my_rank()];
+  uint64_t width = range.size() / num_threads_ + 1;
+  // a user slicer may send keys out of the range
+  return static_cast<int>(((key - range.begin()) / width) % num_threads_);
+}
+
 template <typename Val>
 void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   Message msg;
@@ -384,6 +536,10 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   msg.meta.set_push(req.push);
   msg.meta.set_head(req.cmd);
   msg.meta.set_timestamp(req.timestamp);
+  // the worker is waiting for it
+  msg.meta.set_priority(kHighPriority);
+  int compression = req.compression ? req.compression : compression_;
+  if (compression) msg.meta.set_compression(compression);
   if (res.keys.size()) {
     msg.AddData(res.keys);
     msg.AddData(res.vals);
@@ -463,10 +619,11 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
   for (size_t i = 0; i < sliced.size(); ++i) {
     if (!sliced[i].first) ++ skipped;
   }
-  obj_->AddResponse(timestamp, skipped);
   if ((size_t)skipped == sliced.size()) {
+    // run it before the request finishes, so the slot is not reused meanwhile
     RunCallback(timestamp);
   }
+  obj_->AddResponse(timestamp, skipped);
 
   for (size_t i = 0; i < sliced.size(); ++i) {
     const auto& s = sliced[i];
@@ -477,6 +634,9 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
     msg.meta.set_push(push);
     msg.meta.set_head(cmd);
     msg.meta.set_timestamp(timestamp);
+    if (compression_) msg.meta.set_compression(compression_);
+    // a pull blocks the worker, let it pass the bulk pushes
+    if (!push) msg.meta.set_priority(kHighPriority);
     const auto& kvs = s.second;
     if (kvs.keys.size()) {
       msg.AddData(kvs.keys);
@@ -492,23 +652,23 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
 
 
 template <typename Val>
-void KVWorker<Val>::Process(const Message& msg) {
+void KVWorker<Val>::Process(Message& msg) {
   if (msg.meta.simple_app()) {
     SimpleApp::Process(msg); return;
   }
 
   // store the data for pulling
   int ts = msg.meta.timestamp();
-  if (!msg.meta.push() && msg.data.size()) {
+  if (!msg.meta.push() && msg.data.size() && !msg.meta.error()) {
     CHECK_GE(msg.data.size(), (size_t)2);
     KVPairs<Val> kvs;
-    kvs.keys = msg.data[0];
-    kvs.vals = msg.data[1];
+    kvs.keys = std::move(msg.data[0]);
+    kvs.vals = std::move(msg.data[1]);
     if (msg.data.size() > (size_t)2) {
-      kvs.lens = msg.data[2];
+      kvs.lens = std::move(msg.data[2]);
     }
     mu_.lock();
-    recv_kvs_[ts].push_back(kvs);
+    GetSlot(ts).kvs.push_back(std::move(kvs));
     mu_.unlock();
   }
 
@@ -519,29 +679,31 @@ void KVWorker<Val>::Process(const Message& msg) {
 }
 template <typename Val>
 void KVWorker<Val>::RunCallback(int timestamp) {
-  mu_.lock();
-  auto it = callbacks_.find(timestamp);
-  if (it != callbacks_.end()) {
-    mu_.unlock();
-
-    CHECK(it->second);
-    it->second();
-
-    mu_.lock();
-    callbacks_.erase(it);
-  }
-  mu_.unlock();
+  Slot& slot = GetSlot(timestamp);
+  Callback cb;
+  cb.swap(slot.cb);
+  Future future;
+  std::swap(future, slot.future);
+  if (cb) cb();
+  if (future.valid()) future.Finish(obj_->HasFailed(timestamp));
 }
 
 template <typename Val>
 template <typename C, typename D>
 int KVWorker<Val>::Pull_(
-    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb) {
+    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb,
+    const Future& future) {
   int ts = obj_->NewRequest(kServerGroup);
   AddCallback(ts, [this, ts, keys, vals, lens, cb]() mutable {
-      mu_.lock();
-      auto& kvs = recv_kvs_[ts];
-      mu_.unlock();
+      // cleared before returning, keeping the capacity for the next request
+      auto& kvs = GetSlot(ts).kvs;
+
+      // some servers are unreachable, leave vals untouched
+      if (obj_->HasFailed(ts)) {
+        kvs.clear();
+        if (cb) cb();
+        return;
+      }
 
       // do check
       size_t total_key = 0, total_val = 0;
@@ -584,12 +746,9 @@ int KVWorker<Val>::Pull_(
           p_lens += s.lens.size();
         }
       }
-
-      mu_.lock();
-      recv_kvs_.erase(ts);
-      mu_.unlock();
+      kvs.clear();
       if (cb) cb();
-    });
+    }, future);
 
   KVPairs<Val> kvs; kvs.keys = keys;
   Send(ts, false, cmd, kvs);
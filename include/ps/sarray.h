@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <sstream>
+#include <utility>
 #include "ps/internal/utils.h"
 #include "ps/range.h"
 namespace ps {
@@ -23,6 +24,24 @@ class SArray {
   /** \brief empty deconstrcutor */
   ~SArray() { }
 
+  /** \brief copy, namely share the data */
+  SArray(const SArray& arr) = default;
+  SArray& operator=(const SArray& arr) = default;
+  /**
+   * \brief move, which does not touch the reference count. arr is left
+   * empty
+   */
+  SArray(SArray&& arr) { *this = std::move(arr); }
+  SArray& operator=(SArray&& arr) {
+    if (this == &arr) return *this;
+    size_ = arr.size_;
+    capacity_ = arr.capacity_;
+    ptr_ = std::move(arr.ptr_);
+    arr.size_ = 0;
+    arr.capacity_ = 0;
+    return *this;
+  }
+
   /**
    * \brief Create an array with length n with initialized value
    * \param size the length
@@ -57,6 +76,35 @@ class SArray {
     ptr_ = std::shared_ptr<V>(arr.ptr(), reinterpret_cast<V*>(arr.data()));
   }
 
+  /**
+   * \brief construct by moving from another SArray, which is left empty
+   *
+   * \tparam W the value type of the source array
+   * \param arr the source array
+   */
+  template <typename W>
+  explicit SArray(SArray<W>&& arr) { *this = std::move(arr); }
+
+  /**
+   * \brief assign by moving from another SArray, which is left empty. it
+   * saves the atomic updates of the reference count if the aliasing move of
+   * shared_ptr (C++20) is available
+   */
+  template <typename W> void operator=(SArray<W>&& arr) {
+    size_ = arr.size() * sizeof(W) / sizeof(V);
+    CHECK_EQ(size_ * sizeof(V), arr.size() * sizeof(W)) << "cannot be divided";
+    capacity_ = arr.capacity() * sizeof(W) / sizeof(V);
+    V* data = reinterpret_cast<V*>(arr.data());
+#if __cplusplus >= 202002L
+    ptr_ = std::shared_ptr<V>(std::move(arr.ptr_), data);
+#else
+    ptr_ = std::shared_ptr<V>(arr.ptr_, data);
+    arr.ptr_.reset();
+#endif
+    arr.size_ = 0;
+    arr.capacity_ = 0;
+  }
+
   /**
    * \brief construct from a c-array
    *
@@ -122,6 +170,15 @@ class SArray {
     size_ = size; capacity_ = size; ptr_.reset(data, del);
   }
 
+  /**
+   * @brief Reset the current data pointer with a deleter, and an allocator
+   * for the reference count
+   */
+  template <typename Deleter, typename Alloc>
+  void reset(V* data, size_t size, Deleter del, Alloc alloc) {
+    size_ = size; capacity_ = size; ptr_.reset(data, del, alloc);
+  }
+
 
   /**
    * @brief Resizes the array to size elements
@@ -221,6 +278,7 @@ class SArray {
   }
 
  private:
+  template <typename W> friend class SArray;
   size_t size_ = 0;
   size_t capacity_ = 0;
   std::shared_ptr<V> ptr_;
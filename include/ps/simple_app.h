@@ -52,6 +52,14 @@ class SimpleApp {
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief return true if a request could not be sent to some receivers
+   *
+   * It is valid once \ref Wait returns, or in the callback of the request.
+   * \param timestamp
+   */
+  bool Failed(int timestamp) { return obj_->HasFailed(timestamp); }
+
 
   /**
    * \brief send back a response for a request
@@ -86,6 +94,18 @@ class SimpleApp {
     response_handle_ = response_handle;
   }
 
+  /**
+   * \brief set the codec compressing the data sent through the network
+   *
+   * A request also asks the remote node to compress its response with the
+   * same codec. Frames smaller than `DMLC_PS_COMPRESS_THRESHOLD` are not
+   * compressed.
+   * \param compression the codec, \ref NO_COMPRESSION in default
+   */
+  void set_compression(Compression compression) {
+    compression_ = compression;
+  }
+
   /**
    * \brief returns the customer
    */
@@ -99,12 +119,15 @@ class SimpleApp {
     response_handle_ = [](const SimpleData& recved, SimpleApp* app) { };
   }
 
-  /** \brief process a received message */
-  void Process(const Message& msg);
+  /** \brief process a received message, moving its body out */
+  void Process(Message& msg);
 
   /** \brief ps internal object */
   Customer* obj_;
 
+  /** \brief the codec of the data sent */
+  Compression compression_ = NO_COMPRESSION;
+
  private:
   /** \brief request handle */
   Handle request_handle_;
@@ -129,6 +152,7 @@ int SimpleApp::Request(int req_head, const std::string& req_body, int recv_id) {
   msg.meta.set_request(true);
   msg.meta.set_simple_app(true);
   msg.meta.set_customer_id(obj_->id());
+  msg.meta.set_priority(kHighPriority);
 
   // send
   for (int r : Postoffice::Get()->GetNodeIDs(recv_id)) {
@@ -147,6 +171,7 @@ void SimpleApp::Response(const SimpleData& req, const std::string& res_body) {
   msg.meta.set_request(false);
   msg.meta.set_simple_app(true);
   msg.meta.set_customer_id(obj_->id());
+  msg.meta.set_priority(kHighPriority);
   msg.recver = req.sender;
 
   // send
@@ -154,11 +179,11 @@ void SimpleApp::Response(const SimpleData& req, const std::string& res_body) {
 }
 
 
-void SimpleApp::Process(const Message& msg) {
+void SimpleApp::Process(Message& msg) {
   SimpleData recv;
   recv.sender    = msg.sender;
   recv.head      = msg.meta.head();
-  recv.body      = msg.meta.body();
+  recv.body      = std::move(*msg.meta.mutable_body());
   recv.timestamp = msg.meta.timestamp();
   if (msg.meta.request()) {
     CHECK(request_handle_);
@@ -0,0 +1,100 @@
+#include "ps/internal/async_sender.h"
+#include "ps/internal/meta_codec.h"
+
+namespace ps {
+
+AsyncSender::AsyncSender(const SendFunc& send, const ErrorFunc& on_error,
+                         int num_threads, size_t capacity)
+    : send_(send), on_error_(on_error), capacity_(capacity) {
+  CHECK_GT(num_threads, 0);
+  CHECK_GT(capacity, (size_t)0);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(new std::thread(&AsyncSender::Sending, this));
+  }
+}
+
+int AsyncSender::Send(const Message& msg) {
+  auto queue = queues_.Find(msg.recver);
+  if (!queue) {
+    std::lock_guard<std::mutex> lk(mu_);
+    queue = queues_.Find(msg.recver);
+    if (!queue) {
+      queue = std::make_shared<Queue>();
+      queues_.Put(msg.recver, queue);
+    }
+  }
+
+  int send_bytes = MetaCodec::Size(msg.meta);
+  for (const auto& d : msg.data) send_bytes += d.size();
+
+  bool schedule;
+  {
+    std::unique_lock<std::mutex> lk(queue->mu);
+    queue->not_full.wait(lk, [this, &queue] {
+        return queue->msgs.size() < capacity_;
+      });
+    queue->msgs.Push(msg);
+    schedule = !queue->scheduled;
+    queue->scheduled = true;
+  }
+  if (schedule) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (exit_) return -1;
+    ready_.push_back(queue);
+    cond_.notify_one();
+  }
+  return send_bytes;
+}
+
+void AsyncSender::Sending() {
+  while (true) {
+    std::shared_ptr<Queue> queue;
+    {
+      std::unique_lock<std::mutex> lk(mu_);
+      cond_.wait(lk, [this] { return exit_ || !ready_.empty(); });
+      if (ready_.empty()) break;
+      queue = ready_.front();
+      ready_.pop_front();
+    }
+
+    // pop one at a time, so that a later message of higher priority can
+    // still go first
+    for (int i = 0; i < kMaxBatch; ++i) {
+      Message msg;
+      {
+        std::lock_guard<std::mutex> lk(queue->mu);
+        if (queue->msgs.empty()) break;
+        queue->msgs.Pop(&msg);
+      }
+      queue->not_full.notify_one();
+      if (send_(msg) == -1) on_error_(msg);
+    }
+
+    // no other thread touches this queue until it is scheduled again
+    bool more;
+    {
+      std::lock_guard<std::mutex> lk(queue->mu);
+      more = !queue->msgs.empty();
+      queue->scheduled = more;
+    }
+    if (more) {
+      std::lock_guard<std::mutex> lk(mu_);
+      ready_.push_back(queue);
+      cond_.notify_one();
+    }
+  }
+}
+
+void AsyncSender::Stop() {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (exit_) return;
+    exit_ = true;
+    cond_.notify_all();
+  }
+  // the threads exit once all queues are drained
+  for (auto& thread : threads_) thread->join();
+  threads_.clear();
+}
+
+}  // namespace ps
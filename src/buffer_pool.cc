@@ -0,0 +1,144 @@
+#include "ps/internal/buffer_pool.h"
+#include <sys/mman.h>
+#include "ps/internal/utils.h"
+
+namespace ps {
+
+BufferPool::BufferPool() {
+  huge_pages_ = GetEnv("DMLC_PS_HUGE_PAGES", 1);
+}
+
+SArray<char> BufferPool::Alloc(size_t size) {
+  int cls = 0;
+  while (cls < kNumClasses && ((size_t)1 << (cls + kMinShift)) < size) ++cls;
+
+  SArray<char> buf;
+  if (cls == kNumClasses) {
+    buf.reset(new char[size], size, [](char* data) { delete [] data; });
+    return buf;
+  }
+
+  char* data = nullptr;
+  auto& c = classes_[cls];
+  {
+    std::lock_guard<std::mutex> lk(c.mu);
+    if (c.free.empty()) {
+      size_t bytes = (size_t)1 << (cls + kMinShift);
+      int shift = cls + kMinShift;
+      if (huge_pages_ && shift >= kHugeShift && shift < kSlabShift) {
+        // carve a new slab, whose buffers are never unmapped
+        size_t slab = (size_t)1 << kSlabShift;
+        char* base = CHECK_NOTNULL(Map(slab));
+        for (size_t pos = bytes; pos < slab; pos += bytes) {
+          c.free.push_back(base + pos);
+        }
+        data = base;
+      } else if (huge_pages_ && shift >= kHugeShift) {
+        data = CHECK_NOTNULL(Map(bytes));
+      } else {
+        data = new char[bytes];
+      }
+      misses_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      data = c.free.back();
+      c.free.pop_back();
+      hits_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  Wrap(data, size, [this, cls](char* data) { Free(data, cls); }, &buf);
+  return buf;
+}
+
+void BufferPool::Free(char* buf, int cls) {
+  auto& c = classes_[cls];
+  int shift = cls + kMinShift;
+  bool mapped = huge_pages_ && shift >= kHugeShift;
+  {
+    std::lock_guard<std::mutex> lk(c.mu);
+    if ((mapped && shift < kSlabShift) ||
+        (c.free.size() + 1) << shift <= kMaxFreeBytes) {
+      c.free.push_back(buf);
+      return;
+    }
+  }
+  if (mapped) {
+    munmap(buf, (size_t)1 << shift);
+    mapped_bytes_ -= (size_t)1 << shift;
+  } else {
+    delete [] buf;
+  }
+}
+
+char* BufferPool::Map(size_t size) {
+  if (huge_pages_ == 2) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      mapped_bytes_ += size;
+      return static_cast<char*>(p);
+    }
+    // no huge pages reserved, fall back to transparent ones
+    static bool warned = false;
+    if (!warned) {
+      warned = true;
+      LOG(WARNING) << "failed to map explicit huge pages, errno " << errno;
+    }
+  }
+  // map one page more to align the start to a huge page
+  size_t page = (size_t)1 << kSlabShift;
+  void* p = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return nullptr;
+  uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+  uintptr_t start = (begin + page - 1) & ~(page - 1);
+  if (start > begin) munmap(p, start - begin);
+  size_t tail = begin + size + page - (start + size);
+  if (tail) munmap(reinterpret_cast<char*>(start + size), tail);
+  char* data = reinterpret_cast<char*>(start);
+#ifdef MADV_HUGEPAGE
+  madvise(data, size, MADV_HUGEPAGE);
+#endif
+  mapped_bytes_ += size;
+  return data;
+}
+
+void* BufferPool::AllocBlock(size_t size) {
+  if (size > kMaxBlock) return ::operator new(size);
+  size_t i = (size + kBlockAlign - 1) / kBlockAlign - 1;
+  auto& c = blocks_[i];
+  {
+    std::lock_guard<std::mutex> lk(c.mu);
+    if (!c.free.empty()) {
+      void* block = c.free.back();
+      c.free.pop_back();
+      block_hits_.fetch_add(1, std::memory_order_relaxed);
+      return block;
+    }
+  }
+  block_misses_.fetch_add(1, std::memory_order_relaxed);
+  return ::operator new((i + 1) * kBlockAlign);
+}
+
+void BufferPool::FreeBlock(void* block, size_t size) {
+  if (size <= kMaxBlock) {
+    auto& c = blocks_[(size + kBlockAlign - 1) / kBlockAlign - 1];
+    std::lock_guard<std::mutex> lk(c.mu);
+    if (c.free.size() < kMaxFreeBlocks) {
+      c.free.push_back(static_cast<char*>(block));
+      return;
+    }
+  }
+  ::operator delete(block);
+}
+
+BufferPool::Stats BufferPool::GetStats() const {
+  Stats stats;
+  stats.hits = hits_.load(std::memory_order_relaxed);
+  stats.misses = misses_.load(std::memory_order_relaxed);
+  stats.block_hits = block_hits_.load(std::memory_order_relaxed);
+  stats.block_misses = block_misses_.load(std::memory_order_relaxed);
+  stats.mapped_bytes = mapped_bytes_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+}  // namespace ps
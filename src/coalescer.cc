@@ -0,0 +1,191 @@
+#include "ps/internal/coalescer.h"
+#include <algorithm>
+#include "ps/internal/buffer_pool.h"
+#include "ps/internal/meta_codec.h"
+
+namespace ps {
+
+namespace {
+
+/** \brief a message in a batch, followed by the data sizes, the meta and
+ * the data, the latter two padded to 8 bytes */
+struct BatchRecord {
+  uint32_t meta_size;
+  uint32_t num_data;
+};
+
+inline size_t Pad(size_t size) { return (size + 7) & ~(size_t)7; }
+
+}  // namespace
+
+Coalescer::Coalescer(const SendFunc& send, const ErrorFunc& on_error,
+                     size_t max_bytes, int max_delay_us)
+    : send_(send), on_error_(on_error), max_bytes_(max_bytes),
+      max_delay_(max_delay_us) {
+  thread_ = std::unique_ptr<std::thread>(
+      new std::thread(&Coalescer::Flushing, this));
+}
+
+std::shared_ptr<Coalescer::Batch> Coalescer::GetBatch(int recver) {
+  auto batch = batches_.Find(recver);
+  if (batch) return batch;
+  std::lock_guard<std::mutex> lk(mu_);
+  batch = batches_.Find(recver);
+  if (batch) return batch;
+  batch = std::make_shared<Batch>();
+  batch->recver = recver;
+  batches_.Put(recver, batch);
+  all_.push_back(batch);
+  return batch;
+}
+
+int Coalescer::Send(const Message& msg) {
+  auto batch = GetBatch(msg.recver);
+  std::lock_guard<std::mutex> lk(batch->mu);
+
+  int meta_size = MetaCodec::Size(msg.meta);
+  size_t n = msg.data.size();
+  size_t size = sizeof(BatchRecord) + n * sizeof(uint64_t) + Pad(meta_size);
+  for (const auto& d : msg.data) size += Pad(d.size());
+  if (msg.meta.has_control() || size > max_bytes_ || stopped_) {
+    if (batch->count) Flush(batch.get());
+    return send_(msg);
+  }
+
+  if (batch->used + size > max_bytes_) Flush(batch.get());
+  if (batch->count == 0) {
+    if (batch->buf.empty()) batch->buf = BufferPool::Get()->Alloc(max_bytes_);
+    batch->first = std::chrono::steady_clock::now();
+    if (num_pending_++ == 0) {
+      std::lock_guard<std::mutex> lk(mu_);
+      cond_.notify_one();
+    }
+  }
+
+  char* p = batch->buf.data() + batch->used;
+  BatchRecord rec;
+  rec.meta_size = meta_size;
+  rec.num_data = n;
+  memcpy(p, &rec, sizeof(rec));
+  uint64_t* sizes = reinterpret_cast<uint64_t*>(p + sizeof(rec));
+  p = reinterpret_cast<char*>(sizes + n);
+  MetaCodec::Encode(msg.meta, meta_size, p);
+  p += Pad(meta_size);
+  int send_bytes = meta_size;
+  for (size_t i = 0; i < n; ++i) {
+    sizes[i] = msg.data[i].size();
+    memcpy(p, msg.data[i].data(), sizes[i]);
+    p += Pad(sizes[i]);
+    send_bytes += sizes[i];
+  }
+  batch->used += size;
+  ++batch->count;
+  if (batch->used == max_bytes_) Flush(batch.get());
+  return send_bytes;
+}
+
+void Coalescer::Flush(Batch* batch) {
+  if (batch->count == 0) return;
+  Message msg;
+  msg.recver = batch->recver;
+  msg.meta.set_batch(true);
+  msg.data.push_back(batch->buf.segment(0, batch->used));
+  // the buffer is still referenced by msg, start a new one
+  batch->buf = SArray<char>();
+  batch->used = 0;
+  batch->count = 0;
+  --num_pending_;
+  if (send_(msg) == -1) {
+    LOG(WARNING) << "failed to send a batch to node " << batch->recver;
+    // Send returned for them already, so they are answered here
+    Fail(msg, on_error_);
+  }
+}
+
+void Coalescer::Flushing() {
+  std::unique_lock<std::mutex> lk(mu_);
+  while (true) {
+    cond_.wait(lk, [this] { return exit_ || num_pending_ > 0; });
+    if (exit_) break;
+    auto batches = all_;
+    lk.unlock();
+
+    // flush the batches waited too long, and sleep until the next one is due
+    auto now = std::chrono::steady_clock::now();
+    auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(max_delay_);
+    for (auto& batch : batches) {
+      std::lock_guard<std::mutex> blk(batch->mu);
+      if (batch->count == 0) continue;
+      auto waited = now - batch->first;
+      if (waited >= max_delay_) {
+        Flush(batch.get());
+      } else {
+        wait = std::min(wait, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            max_delay_ - waited));
+      }
+    }
+
+    lk.lock();
+    cond_.wait_for(lk, wait, [this] { return exit_; });
+  }
+}
+
+void Coalescer::Stop() {
+  if (stopped_.exchange(true)) return;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    exit_ = true;
+    cond_.notify_all();
+  }
+  thread_->join();
+  std::vector<std::shared_ptr<Batch>> batches;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    batches = all_;
+  }
+  for (auto& batch : batches) {
+    std::lock_guard<std::mutex> blk(batch->mu);
+    Flush(batch.get());
+  }
+}
+
+void Coalescer::Unpack(const Message& batch, std::vector<Message>* msgs) {
+  CHECK_EQ(batch.data.size(), (size_t)1);
+  const SArray<char>& buf = batch.data[0];
+  size_t pos = 0;
+  while (pos < buf.size()) {
+    BatchRecord rec;
+    CHECK_LE(pos + sizeof(rec), buf.size()) << "corrupted batch";
+    memcpy(&rec, buf.data() + pos, sizeof(rec));
+    CHECK_LE(pos + sizeof(rec) + rec.num_data * sizeof(uint64_t), buf.size())
+        << "corrupted batch";
+    std::vector<uint64_t> sizes(rec.num_data);
+    memcpy(sizes.data(), buf.data() + pos + sizeof(rec),
+           rec.num_data * sizeof(uint64_t));
+    pos += sizeof(rec) + rec.num_data * sizeof(uint64_t);
+
+    msgs->emplace_back();
+    Message* msg = &msgs->back();
+    msg->sender = batch.sender;
+    msg->recver = batch.recver;
+    msg->raw_meta = buf.segment(pos, pos + rec.meta_size);
+    pos += Pad(rec.meta_size);
+    for (uint64_t size : sizes) {
+      // zero-copy, the data share the batch
+      msg->data.push_back(buf.segment(pos, pos + size));
+      pos += Pad(size);
+    }
+    CHECK_LE(pos, buf.size()) << "corrupted batch";
+  }
+}
+
+void Coalescer::Fail(const Message& batch, const ErrorFunc& on_error) {
+  std::vector<Message> msgs;
+  Unpack(batch, &msgs);
+  for (auto& msg : msgs) {
+    MetaCodec::Decode(&msg);
+    if (msg.meta.request()) on_error(msg);
+  }
+}
+
+}  // namespace ps
@@ -0,0 +1,263 @@
+#include "ps/internal/compressor.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "ps/internal/buffer_pool.h"
+
+namespace ps {
+
+namespace {
+
+const int kMinMatch = 4;
+/** \brief the last bytes are always literals, as in LZ4 */
+const size_t kLastLiterals = 5;
+const int kHashBits = 13;
+const size_t kMaxOffset = 65535;
+
+inline uint32_t Load32(const char* p) {
+  uint32_t v; memcpy(&v, p, sizeof(v)); return v;
+}
+
+inline uint32_t Hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+/** \brief write a length of 15 or more after the token */
+inline char* PutLength(size_t len, char* p) {
+  for (; len >= 255; len -= 255) *p++ = (char)255;
+  *p++ = (char)len;
+  return p;
+}
+
+inline bool GetLength(const char** p, const char* end, size_t* len) {
+  uint8_t b;
+  do {
+    if (*p >= end) return false;
+    b = (uint8_t)*(*p)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+inline char* PutSequence(const char* lit, size_t num_lit, char* p) {
+  *p++ = (char)(std::min(num_lit, (size_t)15) << 4);
+  if (num_lit >= 15) p = PutLength(num_lit - 15, p);
+  memcpy(p, lit, num_lit);
+  return p + num_lit;
+}
+
+template <typename T>
+void ShuffleT(const char* src, size_t n, char* dst) {
+  T prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    T v; memcpy(&v, src + i * sizeof(T), sizeof(T));
+    T d = v ^ prev;
+    prev = v;
+    for (size_t b = 0; b < sizeof(T); ++b) {
+      dst[b * n + i] = (char)(d >> (b * 8));
+    }
+  }
+}
+
+template <typename T>
+void UnshuffleT(const char* src, size_t n, char* dst) {
+  T prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    T d = 0;
+    for (size_t b = 0; b < sizeof(T); ++b) {
+      d |= (T)(uint8_t)src[b * n + i] << (b * 8);
+    }
+    prev ^= d;
+    memcpy(dst + i * sizeof(T), &prev, sizeof(T));
+  }
+}
+
+/** \brief the value size FLOAT_SHUFFLE uses for data[i], 0 if none */
+inline int ElemSize(const MetaMessage& meta, size_t i) {
+  if (meta.compression() != FLOAT_SHUFFLE ||
+      i >= (size_t)meta.data_type_size()) {
+    return 0;
+  }
+  if (meta.data_type(i) == FLOAT) return 4;
+  if (meta.data_type(i) == DOUBLE) return 8;
+  return 0;
+}
+
+}  // namespace
+
+size_t Compressor::LZCompress(const char* src, size_t size, char* dst) {
+  char* p = dst;
+  size_t anchor = 0;
+  if (size > kLastLiterals + kMinMatch + 3) {
+    std::vector<uint32_t> table(1 << kHashBits, 0);
+    const size_t limit = size - kLastLiterals - kMinMatch;
+    size_t pos = 0;
+    int misses = 0;
+    while (pos < limit) {
+      uint32_t seq = Load32(src + pos);
+      uint32_t& slot = table[Hash(seq)];
+      // slot stores position + 1, 0 means empty
+      size_t ref = slot;
+      slot = pos + 1;
+      if (ref == 0 || pos - (ref - 1) > kMaxOffset ||
+          Load32(src + ref - 1) != seq) {
+        // skip faster over incompressible data
+        pos += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+      --ref;
+      size_t len = kMinMatch;
+      const size_t max_len = size - kLastLiterals - pos;
+      // compare 8 bytes at a time
+      while (len + 8 <= max_len) {
+        uint64_t a, b;
+        memcpy(&a, src + ref + len, 8);
+        memcpy(&b, src + pos + len, 8);
+        if (a != b) {
+          len += __builtin_ctzll(a ^ b) >> 3;
+          break;
+        }
+        len += 8;
+      }
+      if (len + 8 > max_len) {
+        while (len < max_len && src[ref + len] == src[pos + len]) ++len;
+      }
+
+      char* token = p;
+      p = PutSequence(src + anchor, pos - anchor, p);
+      uint16_t offset = pos - ref;
+      memcpy(p, &offset, 2);
+      p += 2;
+      size_t ml = len - kMinMatch;
+      *token |= (char)std::min(ml, (size_t)15);
+      if (ml >= 15) p = PutLength(ml - 15, p);
+      pos += len;
+      anchor = pos;
+    }
+  }
+  p = PutSequence(src + anchor, size - anchor, p);
+  return p - dst;
+}
+
+bool Compressor::LZDecompress(const char* src, size_t size,
+                              char* dst, size_t raw_size) {
+  const char* p = src;
+  const char* end = src + size;
+  size_t pos = 0;
+  while (p < end) {
+    uint8_t token = (uint8_t)*p++;
+    size_t num_lit = token >> 4;
+    if (num_lit == 15 && !GetLength(&p, end, &num_lit)) return false;
+    if (num_lit > (size_t)(end - p) || num_lit > raw_size - pos) return false;
+    memcpy(dst + pos, p, num_lit);
+    p += num_lit;
+    pos += num_lit;
+    if (p == end) break;
+
+    if (end - p < 2) return false;
+    uint16_t offset;
+    memcpy(&offset, p, 2);
+    p += 2;
+    size_t len = token & 15;
+    if (len == 15 && !GetLength(&p, end, &len)) return false;
+    len += kMinMatch;
+    if (offset == 0 || offset > pos || len > raw_size - pos) return false;
+    // the match may overlap with itself
+    const char* from = dst + pos - offset;
+    char* to = dst + pos;
+    if (offset >= len) {
+      memcpy(to, from, len);
+    } else {
+      for (size_t i = 0; i < len; ++i) to[i] = from[i];
+    }
+    pos += len;
+  }
+  return pos == raw_size;
+}
+
+void Compressor::Shuffle(const char* src, size_t size, int elem_size,
+                         char* dst) {
+  size_t n = size / elem_size;
+  if (elem_size == 4) {
+    ShuffleT<uint32_t>(src, n, dst);
+  } else {
+    CHECK_EQ(elem_size, 8);
+    ShuffleT<uint64_t>(src, n, dst);
+  }
+  memcpy(dst + n * elem_size, src + n * elem_size, size - n * elem_size);
+}
+
+void Compressor::Unshuffle(const char* src, size_t size, int elem_size,
+                           char* dst) {
+  size_t n = size / elem_size;
+  if (elem_size == 4) {
+    UnshuffleT<uint32_t>(src, n, dst);
+  } else {
+    CHECK_EQ(elem_size, 8);
+    UnshuffleT<uint64_t>(src, n, dst);
+  }
+  memcpy(dst + n * elem_size, src + n * elem_size, size - n * elem_size);
+}
+
+void Compressor::Compress(Message* msg) {
+  static const size_t threshold = GetEnv("DMLC_PS_COMPRESS_THRESHOLD", 4096);
+  int codec = msg->meta.compression();
+  if (codec == NO_COMPRESSION) return;
+  CHECK(codec == LZ || codec == FLOAT_SHUFFLE) << "unknown codec " << codec;
+  uint32_t compressed = 0;
+  thread_local std::vector<char> shuffled;
+  size_t n = std::min(msg->data.size(), (size_t)32);
+  for (size_t i = 0; i < n; ++i) {
+    const SArray<char>& raw = msg->data[i];
+    if (raw.size() < threshold) continue;
+    const char* src = raw.data();
+    int elem_size = ElemSize(msg->meta, i);
+    if (elem_size) {
+      shuffled.resize(raw.size());
+      Shuffle(raw.data(), raw.size(), elem_size, shuffled.data());
+      src = shuffled.data();
+    }
+    SArray<char> buf = BufferPool::Get()->Alloc(
+        sizeof(uint64_t) + LZBound(raw.size()));
+    uint64_t raw_size = raw.size();
+    memcpy(buf.data(), &raw_size, sizeof(raw_size));
+    size_t size = LZCompress(src, raw.size(), buf.data() + sizeof(raw_size));
+    size += sizeof(raw_size);
+    // not worth the decompression
+    if (size > raw.size() - raw.size() / 8) continue;
+    msg->data[i] = buf.segment(0, size);
+    compressed |= 1U << i;
+  }
+  if (compressed) msg->meta.set_compressed(compressed);
+}
+
+void Compressor::Decompress(Message* msg) {
+  uint32_t compressed = msg->meta.compressed();
+  if (!compressed) return;
+  thread_local std::vector<char> shuffled;
+  for (size_t i = 0; i < msg->data.size() && i < 32; ++i) {
+    if (!(compressed & (1U << i))) continue;
+    const SArray<char>& frame = msg->data[i];
+    uint64_t raw_size;
+    CHECK_GE(frame.size(), sizeof(raw_size));
+    memcpy(&raw_size, frame.data(), sizeof(raw_size));
+    const char* src = frame.data() + sizeof(raw_size);
+    size_t size = frame.size() - sizeof(raw_size);
+    SArray<char> raw = BufferPool::Get()->Alloc(raw_size);
+    int elem_size = ElemSize(msg->meta, i);
+    if (elem_size) {
+      shuffled.resize(raw_size);
+      CHECK(LZDecompress(src, size, shuffled.data(), raw_size))
+          << "corrupted data from node " << msg->sender;
+      Unshuffle(shuffled.data(), raw_size, elem_size, raw.data());
+    } else {
+      CHECK(LZDecompress(src, size, raw.data(), raw_size))
+          << "corrupted data from node " << msg->sender;
+    }
+    msg->data[i] = raw;
+  }
+  msg->meta.clear_compressed();
+}
+
+}  // namespace ps
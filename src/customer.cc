@@ -1,60 +1,144 @@
 #include "ps/internal/customer.h"
+#include <chrono>
 #include "ps/internal/postoffice.h"
+#include "ps/internal/futex.h"
 namespace ps {
 
+thread_local const Customer* Customer::receiving_ = nullptr;
 
-Customer::Customer(int id, const Customer::RecvHandle& recv_handle)
-    : id_(id), recv_handle_(recv_handle) {
+namespace {
+int64_t NowNanoSec() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}  // namespace
+
+Customer::Customer(int id, const Customer::RecvHandle& recv_handle,
+                   int num_threads, const Customer::ShardFunc& shard)
+    : id_(id), recv_handle_(recv_handle), shard_(shard) {
+  CHECK_GE(num_threads, 1);
+  CHECK(num_threads == 1 || shard_) << "no shard function for the threads";
+  int size = 1;
+  int max_requests = GetEnv("DMLC_PS_MAX_REQUESTS", 1 << 16);
+  CHECK(max_requests > 0 && max_requests <= (1 << 30)) << max_requests;
+  while (size < max_requests) size <<= 1;
+  tracker_ = std::unique_ptr<Request[]>(new Request[size]);
+  mask_ = size - 1;
+  metrics_ = Postoffice::Get()->metrics()->GetCustomer(id);
+  for (int i = 0; i < num_threads; ++i) {
+    recv_queues_.emplace_back(new ThreadsafePriorityQueue());
+  }
+  // the messages received before are passed to the queues
   Postoffice::Get()->AddCustomer(this);
-  recv_thread_ = std::unique_ptr<std::thread>(new std::thread(&Customer::Receiving, this));
+  for (auto& queue : recv_queues_) {
+    recv_threads_.emplace_back(&Customer::Receiving, this, queue.get());
+  }
 }
 
 Customer::~Customer() {
   Postoffice::Get()->RemoveCustomer(this);
   Message msg;
   msg.meta.mutable_control()->set_cmd(Control::TERMINATE);
-  recv_queue_.Push(msg);
-  recv_thread_->join();
+  for (auto& queue : recv_queues_) queue->Push(msg);
+  for (auto& thread : recv_threads_) thread.join();
 }
 
 int Customer::NewRequest(int recver) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
   int num = Postoffice::Get()->GetNodeIDs(recver).size();
-  tracker_.push_back(std::make_pair(num, 0));
-  return tracker_.size() - 1;
+  int64_t n;
+  {
+    std::lock_guard<std::mutex> lk(tracker_mu_);
+    n = next_++;
+  }
+  int timestamp = n & 0x7fffffff;
+  // the request using the slot before, -1 if none
+  int last = n <= mask_ ? -1 : (n - mask_ - 1) & 0x7fffffff;
+  Request* req = &tracker_[timestamp & mask_];
+  while (req->made.load() != last) {
+    // the request before is not put into the slot yet, which only happens if
+    // more than num_slots() requests are being made at once
+    std::this_thread::yield();
+  }
+  if (last != -1 &&
+      req->num_response.load() < (uint32_t)req->num_expected.load()) {
+    CHECK(receiving_ != this)
+        << "a receiving thread of customer " << id_ << " would wait for "
+        << "request " << last << ", whose responses it may have to process. "
+        << "DMLC_PS_MAX_REQUESTS=" << num_slots() << " requests are not "
+        << "finished";
+    WaitRequest(last);
+  }
+  // the late readers of the last request find the slot reused first
+  req->timestamp = timestamp;
+  req->num_expected = num;
+  req->failed = false;
+  req->num_response = 0;
+  req->start = NowNanoSec();
+  req->made = timestamp;
+  return timestamp;
 }
 
 void Customer::WaitRequest(int timestamp) {
-  std::unique_lock<std::mutex> lk(tracker_mu_);
-  tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
-    });
+  Request* req = &tracker_[timestamp & mask_];
+  while (true) {
+    uint32_t num = req->num_response.load();
+    if (req->timestamp.load() != timestamp ||
+        num >= (uint32_t)req->num_expected.load()) {
+      return;
+    }
+    // a response added after announcing the waiting changes the word, so
+    // the futex returns at once
+    req->waiting = 1;
+    FutexWait(&req->num_response, num);
+  }
 }
 
 int Customer::NumResponse(int timestamp) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
-  return tracker_[timestamp].second;
+  Request* req = Find(timestamp);
+  if (!req) return 0;
+  int num = req->num_response.load();
+  return req->timestamp.load() == timestamp ? num : 0;
 }
 
 void Customer::AddResponse(int timestamp, int num) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
-  tracker_[timestamp].second += num;
+  Request* req = Find(timestamp);
+  if (!req) return;
+  // read before finishing it, then the slot may be reused
+  int64_t start = req->start.load();
+  uint32_t total = req->num_response.fetch_add(num) + num;
+  uint32_t expected = req->num_expected.load();
+  if (total >= expected && total - num < expected) {
+    metrics_->latency.Record(NowNanoSec() - start);
+  }
+  if (total >= expected && req->waiting.exchange(0)) {
+    FutexWake(&req->num_response);
+  }
 }
 
-void Customer::Receiving() {
+bool Customer::HasFailed(int timestamp) {
+  Request* req = Find(timestamp);
+  if (!req) return false;
+  bool failed = req->failed.load();
+  return req->timestamp.load() == timestamp && failed;
+}
+
+void Customer::Receiving(ThreadsafePriorityQueue* queue) {
+  receiving_ = this;
   while (true) {
     Message recv;
-    recv_queue_.WaitAndPop(&recv);
+    queue->WaitAndPop(&recv);
     if (recv.meta.has_control() &&
         recv.meta.control().cmd() == Control::TERMINATE) {
       break;
     }
-    recv_handle_(recv);
-    if (!recv.meta.request()) {
-      std::lock_guard<std::mutex> lk(tracker_mu_);
-      tracker_[recv.meta.timestamp()].second ++;
-      tracker_cond_.notify_all();
+    metrics_->queue_depth.fetch_sub(1, std::memory_order_relaxed);
+    if (recv.meta.error()) {
+      // mark it before the handle, so callbacks can check it
+      Request* req = Find(recv.meta.timestamp());
+      if (req) req->failed = true;
     }
+    recv_handle_(recv);
+    if (!recv.meta.request()) AddResponse(recv.meta.timestamp());
   }
 }
 
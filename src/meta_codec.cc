@@ -0,0 +1,149 @@
+#include "ps/internal/meta_codec.h"
+#include "ps/internal/meta_pool.h"
+
+namespace ps {
+
+namespace {
+
+/** \brief set the fields of meta in the fixed layout */
+void DecodeFixed(const PackedMeta& packed, MetaMessage* meta) {
+  uint16_t flags = packed.flags;
+  if (flags & PackedMeta::kRequest) meta->set_request(true);
+  if (flags & PackedMeta::kHasPush) meta->set_push(flags & PackedMeta::kPush);
+  if (flags & PackedMeta::kSimpleApp) meta->set_simple_app(true);
+  if (flags & PackedMeta::kBatch) meta->set_batch(true);
+  if (flags & PackedMeta::kHasHead) meta->set_head(packed.head);
+  if (flags & PackedMeta::kHasCustomerID) {
+    meta->set_customer_id(packed.customer_id);
+  }
+  if (flags & PackedMeta::kHasTimestamp) meta->set_timestamp(packed.timestamp);
+}
+
+}  // namespace
+
+bool MetaCodec::Compact(const MetaMessage& meta) {
+  if (meta.has_control()) return false;
+  if (meta.data_type_size() > UINT8_MAX) return false;
+  if ((uint32_t)meta.compression() > UINT8_MAX) return false;
+  for (int i = 0; i < meta.data_type_size(); ++i) {
+    if ((uint32_t)meta.data_type(i) > UINT8_MAX) return false;
+  }
+  return true;
+}
+
+int MetaCodec::Size(const MetaMessage& meta) {
+  if (!Compact(meta)) return meta.ByteSize();
+  int size = sizeof(PackedMeta) + meta.data_type_size() + meta.body().size();
+  if (meta.has_compression()) size += 1 + sizeof(uint32_t);
+  if (meta.priority()) size += sizeof(int32_t);
+  return size;
+}
+
+void MetaCodec::Encode(const MetaMessage& meta, int size, char* buf) {
+  if (!Compact(meta)) {
+    // ByteSize has been called by Size
+    meta.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(buf));
+    return;
+  }
+  PackedMeta packed;
+  packed.magic = 0;
+  packed.num_data = meta.data_type_size();
+  packed.flags = 0;
+  if (meta.request()) packed.flags |= PackedMeta::kRequest;
+  if (meta.push()) packed.flags |= PackedMeta::kPush;
+  if (meta.simple_app()) packed.flags |= PackedMeta::kSimpleApp;
+  if (meta.has_head()) packed.flags |= PackedMeta::kHasHead;
+  if (meta.has_customer_id()) packed.flags |= PackedMeta::kHasCustomerID;
+  if (meta.has_timestamp()) packed.flags |= PackedMeta::kHasTimestamp;
+  if (meta.has_push()) packed.flags |= PackedMeta::kHasPush;
+  if (meta.has_body()) packed.flags |= PackedMeta::kHasBody;
+  if (meta.batch()) packed.flags |= PackedMeta::kBatch;
+  if (meta.has_compression()) packed.flags |= PackedMeta::kHasCompression;
+  if (meta.priority()) packed.flags |= PackedMeta::kHasPriority;
+  packed.head = meta.head();
+  packed.customer_id = meta.customer_id();
+  packed.timestamp = meta.timestamp();
+  packed.body_size = meta.body().size();
+  memcpy(buf, &packed, sizeof(packed));
+  char* p = buf + sizeof(packed);
+  for (int i = 0; i < packed.num_data; ++i) p[i] = meta.data_type(i);
+  p += packed.num_data;
+  if (meta.has_compression()) {
+    *p++ = meta.compression();
+    uint32_t compressed = meta.compressed();
+    memcpy(p, &compressed, sizeof(compressed));
+    p += sizeof(compressed);
+  }
+  if (meta.priority()) {
+    int32_t priority = meta.priority();
+    memcpy(p, &priority, sizeof(priority));
+    p += sizeof(priority);
+  }
+  memcpy(p, meta.body().data(), packed.body_size);
+}
+
+bool MetaCodec::Decode(const char* buf, int size, MetaMessage* meta) {
+  if (!meta->data_type().Capacity()) {
+    meta->Clear();
+    MetaPool::Acquire(meta);
+  }
+  if (size == 0 || buf[0] != 0) return meta->ParseFromArray(buf, size);
+  if ((size_t)size < sizeof(PackedMeta)) return false;
+  PackedMeta packed;
+  memcpy(&packed, buf, sizeof(packed));
+  uint16_t flags = packed.flags;
+  size_t extra = flags & PackedMeta::kHasCompression ? 1 + sizeof(uint32_t) : 0;
+  if (flags & PackedMeta::kHasPriority) extra += sizeof(int32_t);
+  if (sizeof(packed) + packed.num_data + extra + packed.body_size !=
+      (size_t)size) {
+    return false;
+  }
+  meta->Clear();
+  DecodeFixed(packed, meta);
+  const char* p = buf + sizeof(packed);
+  auto types = meta->mutable_data_type();
+  types->Reserve(packed.num_data);
+  for (int i = 0; i < packed.num_data; ++i) types->Add((uint8_t)p[i]);
+  p += packed.num_data;
+  if (flags & PackedMeta::kHasCompression) {
+    meta->set_compression((uint8_t)*p++);
+    uint32_t compressed;
+    memcpy(&compressed, p, sizeof(compressed));
+    if (compressed) meta->set_compressed(compressed);
+    p += sizeof(compressed);
+  }
+  if (flags & PackedMeta::kHasPriority) {
+    int32_t priority;
+    memcpy(&priority, p, sizeof(priority));
+    meta->set_priority(priority);
+    p += sizeof(priority);
+  }
+  if (flags & PackedMeta::kHasBody) meta->set_body(p, packed.body_size);
+  return true;
+}
+
+void MetaCodec::Decode(Message* msg) {
+  CHECK(Decode(msg->raw_meta.data(), msg->raw_meta.size(), &msg->meta))
+      << "failed to parse string from " << msg->sender
+      << ". size " << msg->raw_meta.size();
+  msg->raw_meta.clear();
+}
+
+bool MetaCodec::Peek(const char* buf, int size, MetaMessage* meta) {
+  if ((size_t)size < sizeof(PackedMeta) || buf[0] != 0) return false;
+  PackedMeta packed;
+  memcpy(&packed, buf, sizeof(packed));
+  meta->Clear();
+  DecodeFixed(packed, meta);
+  if (packed.flags & PackedMeta::kHasPriority) {
+    size_t pos = sizeof(packed) + packed.num_data;
+    if (packed.flags & PackedMeta::kHasCompression) pos += 1 + sizeof(uint32_t);
+    int32_t priority;
+    if (pos + sizeof(priority) > (size_t)size) return false;
+    memcpy(&priority, buf + pos, sizeof(priority));
+    meta->set_priority(priority);
+  }
+  return true;
+}
+
+}  // namespace ps
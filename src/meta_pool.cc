@@ -0,0 +1,179 @@
+#include "ps/internal/meta_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace ps {
+namespace {
+
+/** \brief the counters of a thread, only written by it */
+struct Counters {
+  std::atomic<uint64_t> hits{0}, misses{0}, releases{0}, drops{0};
+
+  void Add(const Counters& other) {
+    hits += other.hits.load();
+    misses += other.misses.load();
+    releases += other.releases.load();
+    drops += other.drops.load();
+  }
+};
+
+inline void Inc(std::atomic<uint64_t>* counter, uint64_t n = 1) {
+  counter->store(counter->load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+}
+
+}  // namespace
+
+struct MetaPool::Depot {
+  std::mutex mu;
+  /** \brief the full magazines */
+  std::vector<std::vector<MetaMessage>> full;
+  /** \brief the empty magazines, keeping their capacity */
+  std::vector<std::vector<MetaMessage>> spare;
+  /** \brief the caches alive */
+  std::vector<Cache*> caches;
+  /** \brief the counters of the exited threads */
+  Counters exited;
+};
+
+struct MetaPool::Cache {
+  Cache() {
+    metas.reserve(2 * kMagazine);
+    Depot* depot = GetDepot();
+    std::lock_guard<std::mutex> lk(depot->mu);
+    depot->caches.push_back(this);
+  }
+  ~Cache() {
+    Depot* depot = GetDepot();
+    std::lock_guard<std::mutex> lk(depot->mu);
+    depot->exited.Add(counters);
+    auto& caches = depot->caches;
+    caches.erase(std::find(caches.begin(), caches.end(), this));
+  }
+  /** \brief at most 2 magazines, the last one is used first */
+  std::vector<MetaMessage> metas;
+  Counters counters;
+};
+
+MetaPool::Cache* MetaPool::GetCache() {
+  // messages may still be destroyed by this thread after its cache is, such
+  // as by static destructors
+  static thread_local bool exited = false;
+  struct Holder {
+    Cache cache;
+    ~Holder() { exited = true; }
+  };
+  if (exited) return nullptr;
+  static thread_local Holder holder;
+  return &holder.cache;
+}
+
+MetaPool::Depot* MetaPool::GetDepot() {
+  static Depot* depot = new Depot();
+  return depot;
+}
+
+void MetaPool::Acquire(MetaMessage* meta) {
+  Cache* cache = GetCache();
+  if (!cache) return;
+  if (cache->metas.empty() && !Refill(cache)) {
+    Inc(&cache->counters.misses);
+    return;
+  }
+  // swapping two messages without arena only swaps pointers
+  meta->Swap(&cache->metas.back());
+  cache->metas.pop_back();
+  Inc(&cache->counters.hits);
+}
+
+void MetaPool::AcquireDataTypes(MetaMessage* meta) {
+  Cache* cache = GetCache();
+  if (!cache) return;
+  if (cache->metas.empty() && !Refill(cache)) {
+    Inc(&cache->counters.misses);
+    return;
+  }
+  // the rest of the recycled meta is freed, which is little for app messages
+  meta->mutable_data_type()->Swap(cache->metas.back().mutable_data_type());
+  cache->metas.pop_back();
+  Inc(&cache->counters.hits);
+}
+
+void MetaPool::Release(MetaMessage* meta) {
+  Cache* cache = GetCache();
+  if (!cache) return;
+  if (cache->metas.size() == 2 * kMagazine) Spill(cache);
+  meta->Clear();
+  cache->metas.emplace_back();
+  cache->metas.back().Swap(meta);
+  Inc(&cache->counters.releases);
+}
+
+bool MetaPool::Refill(Cache* cache) {
+  Depot* depot = GetDepot();
+  std::vector<MetaMessage> magazine;
+  {
+    std::lock_guard<std::mutex> lk(depot->mu);
+    if (depot->full.empty()) return false;
+    magazine.swap(depot->full.back());
+    depot->full.pop_back();
+  }
+  for (auto& meta : magazine) {
+    cache->metas.emplace_back();
+    cache->metas.back().Swap(&meta);
+  }
+  magazine.clear();
+  std::lock_guard<std::mutex> lk(depot->mu);
+  depot->spare.push_back(std::move(magazine));
+  return true;
+}
+
+void MetaPool::Spill(Cache* cache) {
+  Depot* depot = GetDepot();
+  auto& metas = cache->metas;
+  auto begin = metas.end() - kMagazine;
+  std::vector<MetaMessage> magazine;
+  bool full = false;
+  {
+    std::lock_guard<std::mutex> lk(depot->mu);
+    full = depot->full.size() >= kMaxMagazines;
+    if (!full && !depot->spare.empty()) {
+      magazine.swap(depot->spare.back());
+      depot->spare.pop_back();
+    }
+  }
+  if (full) {
+    Inc(&cache->counters.drops, kMagazine);
+    metas.erase(begin, metas.end());
+    return;
+  }
+  // allocates only until the magazines in use are all made
+  magazine.reserve(kMagazine);
+  for (auto it = begin; it != metas.end(); ++it) {
+    magazine.emplace_back();
+    magazine.back().Swap(&*it);
+  }
+  metas.erase(begin, metas.end());
+  std::lock_guard<std::mutex> lk(depot->mu);
+  depot->full.push_back(std::move(magazine));
+}
+
+MetaPool::Stats MetaPool::GetStats() {
+  Depot* depot = GetDepot();
+  Counters sum;
+  {
+    std::lock_guard<std::mutex> lk(depot->mu);
+    sum.Add(depot->exited);
+    for (Cache* cache : depot->caches) sum.Add(cache->counters);
+  }
+  Stats stats;
+  stats.hits = sum.hits.load();
+  stats.misses = sum.misses.load();
+  stats.releases = sum.releases.load();
+  stats.drops = sum.drops.load();
+  return stats;
+}
+
+}  // namespace ps
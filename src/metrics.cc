@@ -0,0 +1,216 @@
+#include "ps/internal/metrics.h"
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "ps/internal/postoffice.h"
+#include "ps/internal/utils.h"
+
+namespace ps {
+
+uint64_t LatencyHistogram::Quantile(double q) const {
+  uint64_t total = 0;
+  for (const auto& count : counts_) {
+    total += count.load(std::memory_order_relaxed);
+  }
+  if (total == 0) return 0;
+  // the rank of the value, from 1
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * total + 0.5));
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) return std::min(UpperBound(i), max());
+  }
+  return max();
+}
+
+namespace {
+
+void CopyTraffic(const Metrics::Traffic& sent, const Metrics::Traffic& recv,
+                 Metrics::Snapshot::TrafficStats* stats) {
+  stats->sent_bytes = sent.bytes.load(std::memory_order_relaxed);
+  stats->sent_messages = sent.messages.load(std::memory_order_relaxed);
+  stats->recv_bytes = recv.bytes.load(std::memory_order_relaxed);
+  stats->recv_messages = recv.messages.load(std::memory_order_relaxed);
+}
+
+/** \brief the labels of a peer node, its role and rank are from its id */
+std::string PeerLabels(int node_id) {
+  std::stringstream ss;
+  ss << "peer=\"" << node_id << "\",role=\"";
+  if (node_id == kScheduler) {
+    ss << "scheduler\"";
+  } else {
+    ss << (node_id % 2 ? "worker" : "server") << "\",rank=\""
+       << Postoffice::IDtoRank(node_id) << "\"";
+  }
+  return ss.str();
+}
+
+typedef std::vector<std::pair<std::string, Metrics::Snapshot::TrafficStats>>
+    TrafficRows;
+
+/**
+ * \brief write the counters of bytes and messages of each row
+ * \param prefix the prefix of the names
+ * \param of what the counters are kept for, in the help
+ * \param rows the labels and the counters
+ */
+void WriteTraffic(const std::string& prefix, const std::string& of,
+                  const TrafficRows& rows, std::stringstream* ss) {
+  *ss << "# HELP " << prefix << "_bytes_total bytes sent or received "
+      << of << "\n# TYPE " << prefix << "_bytes_total counter\n";
+  for (const auto& row : rows) {
+    *ss << prefix << "_bytes_total{" << row.first << ",direction=\"sent\"} "
+        << row.second.sent_bytes << "\n"
+        << prefix << "_bytes_total{" << row.first << ",direction=\"recv\"} "
+        << row.second.recv_bytes << "\n";
+  }
+  *ss << "# HELP " << prefix << "_messages_total messages sent or received "
+      << of << "\n# TYPE " << prefix << "_messages_total counter\n";
+  for (const auto& row : rows) {
+    *ss << prefix << "_messages_total{" << row.first << ",direction=\"sent\"} "
+        << row.second.sent_messages << "\n"
+        << prefix << "_messages_total{" << row.first << ",direction=\"recv\"} "
+        << row.second.recv_messages << "\n";
+  }
+}
+
+}  // namespace
+
+Metrics::Snapshot Metrics::GetSnapshot() const {
+  std::vector<int> peer_ids, customer_ids;
+  Snapshot snapshot;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    peer_ids = peer_ids_;
+    customer_ids = customer_ids_;
+    snapshot.node_id = node_id_;
+  }
+  std::sort(peer_ids.begin(), peer_ids.end());
+  std::sort(customer_ids.begin(), customer_ids.end());
+  for (int id : peer_ids) {
+    auto peer = peers_.Find(id);
+    Snapshot::PeerStats stats;
+    stats.node_id = id;
+    CopyTraffic(peer->sent, peer->recv, &stats);
+    snapshot.peers.push_back(stats);
+  }
+  for (int id : customer_ids) {
+    auto customer = customers_.Find(id);
+    Snapshot::CustomerStats stats;
+    stats.customer_id = id;
+    CopyTraffic(customer->sent, customer->recv, &stats);
+    stats.queue_depth = customer->queue_depth.load(std::memory_order_relaxed);
+    const auto& latency = customer->latency;
+    stats.num_requests = latency.count();
+    stats.latency_sum = latency.sum();
+    stats.latency_p50 = latency.Quantile(0.5);
+    stats.latency_p90 = latency.Quantile(0.9);
+    stats.latency_p99 = latency.Quantile(0.99);
+    stats.latency_max = latency.max();
+    snapshot.customers.push_back(stats);
+  }
+  return snapshot;
+}
+
+std::string Metrics::ToPrometheus() const {
+  Snapshot snapshot = GetSnapshot();
+  std::string node = "node=\"" + std::to_string(snapshot.node_id) + "\"";
+  std::stringstream ss;
+  TrafficRows peers, customers;
+  for (const auto& p : snapshot.peers) {
+    peers.emplace_back(node + "," + PeerLabels(p.node_id), p);
+  }
+  for (const auto& c : snapshot.customers) {
+    customers.emplace_back(
+        node + ",customer=\"" + std::to_string(c.customer_id) + "\"", c);
+  }
+  WriteTraffic("ps_peer", "per peer node", peers, &ss);
+  WriteTraffic("ps_customer", "per customer", customers, &ss);
+
+  ss << "# HELP ps_customer_queue_depth messages waiting for the receiving "
+     << "threads of a customer\n"
+     << "# TYPE ps_customer_queue_depth gauge\n";
+  for (const auto& c : snapshot.customers) {
+    ss << "ps_customer_queue_depth{" << node << ",customer=\""
+       << c.customer_id << "\"} " << c.queue_depth << "\n";
+  }
+
+  ss << "# HELP ps_request_latency_seconds time from sending a request to "
+     << "its last response\n"
+     << "# TYPE ps_request_latency_seconds summary\n";
+  for (const auto& c : snapshot.customers) {
+    std::string labels = node + ",customer=\"" +
+                         std::to_string(c.customer_id) + "\"";
+    std::pair<const char*, uint64_t> quantiles[] = {
+      {"0.5", c.latency_p50}, {"0.9", c.latency_p90}, {"0.99", c.latency_p99},
+      {"1", c.latency_max}};
+    for (const auto& q : quantiles) {
+      ss << "ps_request_latency_seconds{" << labels << ",quantile=\""
+         << q.first << "\"} " << q.second / 1e9 << "\n";
+    }
+    ss << "ps_request_latency_seconds_sum{" << labels << "} "
+       << c.latency_sum / 1e9 << "\n"
+       << "ps_request_latency_seconds_count{" << labels << "} "
+       << c.num_requests << "\n";
+  }
+  return ss.str();
+}
+
+void Metrics::StartDump(int node_id) {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    node_id_ = node_id;
+  }
+  const char* file = getenv("DMLC_PS_METRICS_FILE");
+  if (!file || !*file || dump_thread_) return;
+  dump_file_ = file;
+  size_t pos = dump_file_.find("%i");
+  if (pos != std::string::npos) {
+    dump_file_.replace(pos, 2, std::to_string(node_id));
+  }
+  dump_interval_ = std::chrono::seconds(
+      std::max(1, GetEnv("DMLC_PS_METRICS_INTERVAL", 10)));
+  dump_exit_ = false;
+  dump_thread_ = std::unique_ptr<std::thread>(
+      new std::thread(&Metrics::Dumping, this));
+}
+
+void Metrics::StopDump() {
+  if (!dump_thread_) return;
+  {
+    std::lock_guard<std::mutex> lk(dump_mu_);
+    dump_exit_ = true;
+    dump_cond_.notify_all();
+  }
+  dump_thread_->join();
+  dump_thread_.reset();
+  Dump();
+}
+
+void Metrics::Dumping() {
+  std::unique_lock<std::mutex> lk(dump_mu_);
+  while (!dump_cond_.wait_for(lk, dump_interval_,
+                              [this] { return dump_exit_; })) {
+    Dump();
+  }
+}
+
+void Metrics::Dump() {
+  std::string tmp = dump_file_ + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if (!out) {
+      LOG(WARNING) << "failed to write " << tmp;
+      return;
+    }
+    out << ToPrometheus();
+  }
+  // so a reader never sees a file half written
+  if (rename(tmp.c_str(), dump_file_.c_str()) != 0) {
+    LOG(WARNING) << "failed to rename " << tmp << " to " << dump_file_;
+  }
+}
+
+}  // namespace ps
@@ -4,12 +4,19 @@
 
 namespace ps {
 Postoffice::Postoffice() : van_(new Van()) {
+  for (auto& customer : customers_) customer = nullptr;
   num_workers_ = atoi(CHECK_NOTNULL(getenv("DMLC_NUM_WORKER")));
   num_servers_ = atoi(CHECK_NOTNULL(getenv("DMLC_NUM_SERVER")));
   std::string role(CHECK_NOTNULL(getenv("DMLC_ROLE")));
   is_worker_ = role == "worker";
   is_server_ = role == "server";
   is_scheduler_ = role == "scheduler";
+  // built once, so the receiving threads read them without locking
+  for (int i = 0; i < num_servers_; ++i) {
+    server_key_ranges_.push_back(Range(
+        kMaxKey / num_servers_ * i,
+        kMaxKey / num_servers_ * (i+1)));
+  }
 }
 
 void Postoffice::Start(const char* argv0) {
@@ -46,6 +53,7 @@ void Postoffice::Start(const char* argv0) {
 
   // start van
   van_->Start();
+  metrics_.StartDump(van_->my_node().id());
 
   // do a barrier here
   Barrier(kWorkerGroup + kServerGroup + kScheduler);
@@ -54,6 +62,7 @@ void Postoffice::Start(const char* argv0) {
 void Postoffice::Finalize() {
   Barrier(kWorkerGroup + kServerGroup + kScheduler);
   van_->Stop();
+  metrics_.StopDump();
   if (exit_callback_) exit_callback_();
 }
 
@@ -61,34 +70,56 @@ void Postoffice::Finalize() {
 void Postoffice::AddCustomer(Customer* customer) {
   std::lock_guard<std::mutex> lk(mu_);
   int id = CHECK_NOTNULL(customer)->id();
-  CHECK_EQ(customers_.count(id), (size_t)0) << "id " << id << " already exists";
-  customers_[id] = customer;
+  CHECK(id >= 0 && id < kMaxCustomers) << "invalid customer id " << id;
+  CHECK(customers_[id].load() == nullptr) << "id " << id << " already exists";
+  // the messages delivered meanwhile wait for the lock, so they stay behind
+  // the pending ones
+  auto it = pending_.find(id);
+  if (it != pending_.end()) {
+    for (auto& msg : it->second) customer->Accept(std::move(msg));
+    pending_.erase(it);
+  }
+  customers_[id].store(customer, std::memory_order_release);
 }
 
 
 void Postoffice::RemoveCustomer(Customer* customer) {
   std::lock_guard<std::mutex> lk(mu_);
   int id = CHECK_NOTNULL(customer)->id();
-  customers_.erase(id);
+  customers_[id].store(nullptr);
 }
 
 
 Customer* Postoffice::GetCustomer(int id, int timeout) const {
-  Customer* obj = nullptr;
-  for (int i = 0; i < timeout*1000+1; ++i) {
-    {
-      std::lock_guard<std::mutex> lk(mu_);
-      const auto it = customers_.find(id);
-      if (it != customers_.end()) {
-        obj = it->second;
-        break;
-      }
-    }
+  if (id < 0 || id >= kMaxCustomers) return nullptr;
+  Customer* obj = customers_[id].load(std::memory_order_acquire);
+  for (int i = 0; !obj && i < timeout * 1000; ++i) {
     usleep(1000);
+    obj = customers_[id].load(std::memory_order_acquire);
   }
   return obj;
 }
 
+void Postoffice::Deliver(Message* msg) {
+  int id = msg->meta.customer_id();
+  CHECK(id >= 0 && id < kMaxCustomers) << "invalid customer id " << id;
+  Customer* obj = customers_[id].load(std::memory_order_acquire);
+  if (!obj) {
+    std::lock_guard<std::mutex> lk(mu_);
+    obj = customers_[id].load();
+    if (!obj) {
+      auto& pending = pending_[id];
+      if (pending.empty()) {
+        LOG(WARNING) << "app " << id << " is not added yet, keeping the "
+                     << "messages to it until then";
+      }
+      pending.push_back(std::move(*msg));
+      return;
+    }
+  }
+  obj->Accept(std::move(*msg));
+}
+
 void Postoffice::Barrier(int node_group) {
   if (GetNodeIDs(node_group).size() <= 1) return;
   auto role = van_->my_node().role();
@@ -100,39 +131,10 @@ void Postoffice::Barrier(int node_group) {
     CHECK(node_group & kServerGroup);
   }
 
-  std::unique_lock<std::mutex> ulk(barrier_mu_);
-  barrier_done_ = false;
-  Message req;
-  req.recver = kScheduler;
-  req.meta.set_request(true);
-  req.meta.mutable_control()->set_cmd(Control::BARRIER);
-  req.meta.mutable_control()->set_barrier_group(node_group);
-  CHECK_GT(van_->Send(req), 0);
-
-  barrier_cond_.wait(ulk, [this] {
-      return barrier_done_;
-    });
+  van_->Barrier(node_group);
 }
 
 const std::vector<Range>& Postoffice::GetServerKeyRanges() {
-  if (server_key_ranges_.empty()) {
-    for (int i = 0; i < num_servers_; ++i) {
-      server_key_ranges_.push_back(Range(
-          kMaxKey / num_servers_ * i,
-          kMaxKey / num_servers_ * (i+1)));
-    }
-  }
   return server_key_ranges_;
 }
-
-void Postoffice::Manage(const Message& recv) {
-  CHECK(recv.meta.has_control());
-  const auto& ctrl = recv.meta.control();
-  if (ctrl.cmd() == Control::BARRIER && !recv.meta.request()) {
-    barrier_mu_.lock();
-    barrier_done_ = true;
-    barrier_mu_.unlock();
-    barrier_cond_.notify_all();
-  }
-}
 }  // namespace ps
@@ -0,0 +1,451 @@
+#include "ps/internal/shm_transport.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include "ps/sarray.h"
+#include "ps/internal/buffer_pool.h"
+#include "ps/internal/futex.h"
+#include "ps/internal/meta_codec.h"
+#include "ps/internal/postoffice.h"
+
+namespace ps {
+
+/** \brief the header of an inbox */
+struct ShmInbox {
+  uint32_t magic;
+  uint32_t num_channels;
+  uint64_t arena_size;
+  /** \brief increased by senders on every record */
+  std::atomic<uint32_t> doorbell;
+  /** \brief 1 if the receiver may be waiting on the doorbell */
+  std::atomic<uint32_t> sleeping;
+};
+
+/** \brief the header of a channel, followed by the arena */
+struct ShmChannel {
+  /** \brief kFree or kClaimed */
+  std::atomic<uint32_t> state;
+  /** \brief the node id of the sender */
+  std::atomic<int32_t> owner;
+  /**
+   * \brief the data messages the sender received from the node of this inbox
+   * through other transports
+   */
+  std::atomic<uint64_t> net_received;
+  /** \brief bytes published by the sender */
+  alignas(64) std::atomic<uint64_t> head;
+  /** \brief bytes consumed by the receiver */
+  alignas(64) std::atomic<uint64_t> tail;
+  /** \brief bytes recycled by the sender, only accessed by the sender */
+  alignas(64) uint64_t reclaimed;
+};
+
+/**
+ * \brief a message in the arena, followed by the data sizes, the meta and the
+ * data frames
+ */
+struct ShmRecord {
+  /** \brief set to 1 by the receiver once the record can be recycled */
+  std::atomic<uint32_t> released;
+  /** \brief the number of data frames, kPadding for a wrap-around record */
+  uint32_t num_data;
+  /** \brief the total bytes of this record */
+  uint64_t size;
+  uint32_t meta_size;
+  /** \brief the sender's node id */
+  int32_t sender;
+};
+
+namespace {
+
+const uint32_t kShmMagic = 0x70736d31;
+const uint32_t kFree = 0;
+const uint32_t kClaimed = 1;
+const uint32_t kPadding = UINT32_MAX;
+const size_t kAlign = 64;
+const size_t kInboxSize = 64;
+const size_t kChannelHeaderSize = 256;
+
+static_assert(sizeof(ShmInbox) <= kInboxSize, "inbox header too large");
+static_assert(sizeof(ShmChannel) <= kChannelHeaderSize, "channel header too large");
+
+inline size_t AlignUp(size_t x, size_t a) { return (x + a - 1) / a * a; }
+
+inline char* Arena(ShmChannel* channel) {
+  return reinterpret_cast<char*>(channel) + kChannelHeaderSize;
+}
+
+inline ShmChannel* GetChannel(ShmInbox* inbox, int i) {
+  return reinterpret_cast<ShmChannel*>(
+      reinterpret_cast<char*>(inbox) + kInboxSize +
+      i * (kChannelHeaderSize + inbox->arena_size));
+}
+
+/** \brief the position of a record in the arena */
+inline ShmRecord* GetRecord(ShmChannel* channel, uint64_t pos,
+                            uint64_t arena_size) {
+  return reinterpret_cast<ShmRecord*>(Arena(channel) + pos % arena_size);
+}
+
+}  // namespace
+
+int ShmTransport::Bind(const Node& node, int max_retry) {
+  int num_channels = Postoffice::Get()->num_servers() +
+                     Postoffice::Get()->num_workers() + 1;
+  size_t arena_size = (size_t)GetEnv("DMLC_PS_SHM_SIZE", 8) << 20;
+  CHECK_GT(arena_size, (size_t)0);
+  CHECK_GT(num_channels, 0);
+  length_ = kInboxSize + num_channels * (kChannelHeaderSize + arena_size);
+
+  // a stale inbox could be left by a crashed node using the given port, while
+  // a random port may be used by a live node
+  int port = node.port();
+  if (port) {
+    shm_unlink(InboxName(port).c_str());
+  } else {
+    port = RandomPort();
+  }
+  name_ = InboxName(port);
+  int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  for (int i = 1; fd < 0 && errno == EEXIST && !node.port() && i < max_retry;
+       ++i) {
+    name_ = InboxName(port = RandomPort());
+    fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    LOG(WARNING) << "failed to create " << name_ << ": " << strerror(errno);
+    return -1;
+  }
+  if (ftruncate(fd, length_) != 0) {
+    LOG(WARNING) << "failed to resize " << name_ << ": " << strerror(errno);
+    close(fd); shm_unlink(name_.c_str());
+    return -1;
+  }
+  base_ = mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base_ == MAP_FAILED) {
+    LOG(WARNING) << "failed to map " << name_ << ": " << strerror(errno);
+    base_ = nullptr; shm_unlink(name_.c_str());
+    return -1;
+  }
+
+  inbox_ = static_cast<ShmInbox*>(base_);
+  inbox_->num_channels = num_channels;
+  inbox_->arena_size = arena_size;
+  inbox_->doorbell.store(0);
+  inbox_->sleeping.store(0);
+  for (int i = 0; i < num_channels; ++i) {
+    ShmChannel* channel = GetChannel(inbox_, i);
+    channel->head.store(0);
+    channel->tail.store(0);
+    channel->reclaimed = 0;
+    channel->owner.store(Message::kInvalidNode);
+    channel->net_received.store(0);
+    channel->state.store(kFree);
+    channels_.push_back(channel);
+  }
+  // publish the inbox only after it is initialized
+  std::atomic_thread_fence(std::memory_order_release);
+  inbox_->magic = kShmMagic;
+  return port;
+}
+
+bool ShmTransport::Attach(Peer* peer) {
+  int fd = shm_open(peer->name.c_str(), O_RDWR, 0600);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < kInboxSize) {
+    close(fd); return false;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  auto inbox = static_cast<ShmInbox*>(base);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (inbox->magic != kShmMagic) {
+    munmap(base, st.st_size);
+    return false;
+  }
+
+  // claim a free channel, we are then its only producer
+  for (uint32_t i = 0; i < inbox->num_channels; ++i) {
+    ShmChannel* channel = GetChannel(inbox, i);
+    uint32_t expected = kFree;
+    if (channel->state.load() == kFree &&
+        channel->state.compare_exchange_strong(expected, kClaimed)) {
+      channel->owner.store(peer->my_id);
+      peer->base = base;
+      peer->length = st.st_size;
+      peer->inbox = inbox;
+      peer->channel = channel;
+      peer->attached.store(true, std::memory_order_release);
+      return true;
+    }
+  }
+  LOG(WARNING) << "no free channel in " << peer->name;
+  munmap(base, st.st_size);
+  return false;
+}
+
+bool ShmTransport::Connect(const Node& node, int my_id) {
+  auto existing = peers_.Find(node.id());
+  if (existing) {
+    std::lock_guard<std::mutex> plk(existing->mu);
+    existing->my_id = my_id;
+    if (existing->channel) {
+      existing->channel->owner.store(my_id);
+      return true;
+    }
+    return !existing->retried && Attach(existing.get());
+  }
+
+  // the remote node may be still creating its inbox
+  auto peer = std::make_shared<Peer>();
+  peer->id = node.id();
+  peer->name = InboxName(node.port());
+  peer->my_id = my_id;
+  bool attached = Attach(peer.get());
+  for (int i = 0; !attached && i < connect_timeout_ * 1000; ++i) {
+    usleep(1000);
+    attached = Attach(peer.get());
+  }
+
+  // attached without the lock, so that other nodes are attached meanwhile
+  std::lock_guard<std::mutex> lk(mu_);
+  existing = peers_.Find(node.id());
+  if (existing) {
+    if (attached) {
+      peer->channel->state.store(kFree);
+      munmap(peer->base, peer->length);
+    }
+    std::lock_guard<std::mutex> plk(existing->mu);
+    existing->my_id = my_id;
+    if (existing->channel) existing->channel->owner.store(my_id);
+    return existing->channel != nullptr;
+  }
+  // kept if not attached, so that the first message tries again
+  peers_.Put(node.id(), peer);
+  return attached;
+}
+
+void ShmTransport::Reclaim(Peer* peer) {
+  ShmChannel* channel = peer->channel;
+  const uint64_t arena_size = peer->inbox->arena_size;
+  uint64_t head = channel->head.load(std::memory_order_relaxed);
+  while (channel->reclaimed < head) {
+    auto rec = GetRecord(channel, channel->reclaimed, arena_size);
+    if (!rec->released.load(std::memory_order_acquire)) break;
+    channel->reclaimed += rec->size;
+  }
+}
+
+bool ShmTransport::Drained(Peer* peer) {
+  if (!peer->back) {
+    // the peer counts the messages it received in its channel of my inbox
+    for (ShmChannel* channel : channels_) {
+      if (channel->state.load() == kClaimed &&
+          channel->owner.load() == peer->id) {
+        peer->back = channel;
+        break;
+      }
+    }
+    if (!peer->back) return false;
+  }
+  if (peer->back->net_received.load(std::memory_order_acquire) !=
+      peer->refused) {
+    return false;
+  }
+  Reclaim(peer);
+  return peer->channel->reclaimed ==
+         peer->channel->head.load(std::memory_order_relaxed);
+}
+
+void ShmTransport::CountReceived(int sender) {
+  auto peer = peers_.Find(sender);
+  if (!peer || !peer->attached.load(std::memory_order_acquire)) return;
+  peer->channel->net_received.fetch_add(1, std::memory_order_release);
+}
+
+char* ShmTransport::Reserve(Peer* peer, size_t size, uint64_t* head) {
+  ShmChannel* channel = peer->channel;
+  const uint64_t arena_size = peer->inbox->arena_size;
+  uint64_t begin = channel->head.load(std::memory_order_relaxed);
+  size_t skip = arena_size - begin % arena_size;
+  if (skip >= size) skip = 0;
+  bool fit = size <= arena_size;
+
+  for (int spin = 0; ; ++spin) {
+    Reclaim(peer);
+    if (fit && begin + skip + size - channel->reclaimed <= arena_size) break;
+
+    // the message is too large or the receiver keeps holding the arena. give
+    // up once the receiver has consumed everything sent before
+    if ((!fit || spin > 1000) &&
+        channel->tail.load(std::memory_order_acquire) == begin) {
+      return nullptr;
+    }
+    if (exit_) return nullptr;
+    if (spin < 100) {
+      std::this_thread::yield();
+    } else {
+      usleep(50);
+    }
+  }
+
+  if (skip) {
+    // a record cannot cross the end of the arena
+    auto pad = GetRecord(channel, begin, arena_size);
+    pad->released.store(0, std::memory_order_relaxed);
+    pad->num_data = kPadding;
+    pad->size = skip;
+  }
+  auto rec = GetRecord(channel, begin + skip, arena_size);
+  rec->released.store(0, std::memory_order_relaxed);
+  rec->size = size;
+  *head = begin + skip + size;
+  return reinterpret_cast<char*>(rec);
+}
+
+int ShmTransport::SendMsg(const Message& msg) {
+  auto peer = peers_.Find(msg.recver);
+  if (!peer) return -1;
+
+  int meta_size = MetaCodec::Size(msg.meta);
+  size_t n = msg.data.size();
+  size_t size = AlignUp(sizeof(ShmRecord) + n * sizeof(uint64_t) + meta_size,
+                        sizeof(uint64_t));
+  for (const auto& d : msg.data) size += AlignUp(d.size(), sizeof(uint64_t));
+  size = AlignUp(size, kAlign);
+
+  std::lock_guard<std::mutex> lk(peer->mu);
+  if (exit_) return -1;
+  if (!peer->channel) {
+    // the inbox was missing when connecting. only the first message tries
+    // again, the later ones would pass those sent by another transport
+    bool first = !peer->retried;
+    peer->retried = true;
+    if (!first || !Attach(peer.get())) return -1;
+  }
+  // the messages refused are sent by another transport, so the channel is
+  // used again only after the receiver has got them all
+  if (peer->disabled && !Drained(peer.get())) {
+    ++peer->refused;
+    return -1;
+  }
+  peer->disabled = false;
+  uint64_t head;
+  char* buf = Reserve(peer.get(), size, &head);
+  if (!buf) {
+    if (!exit_) {
+      if (!peer->refused) {
+        LOG(WARNING) << "shared memory to node " << msg.recver << " is full"
+                     << ", fall back to the network until it drains."
+                     << " consider increasing DMLC_PS_SHM_SIZE";
+      }
+      peer->disabled = true;
+      ++peer->refused;
+    }
+    return -1;
+  }
+  auto rec = reinterpret_cast<ShmRecord*>(buf);
+  rec->num_data = n;
+  rec->meta_size = meta_size;
+  rec->sender = peer->my_id;
+  uint64_t* sizes = reinterpret_cast<uint64_t*>(buf + sizeof(ShmRecord));
+  char* p = reinterpret_cast<char*>(sizes + n);
+  MetaCodec::Encode(msg.meta, meta_size, p);
+  p = buf + AlignUp(p + meta_size - buf, sizeof(uint64_t));
+  int send_bytes = meta_size;
+  for (size_t i = 0; i < n; ++i) {
+    sizes[i] = msg.data[i].size();
+    memcpy(p, msg.data[i].data(), sizes[i]);
+    p += AlignUp(sizes[i], sizeof(uint64_t));
+    send_bytes += sizes[i];
+  }
+
+  // publish, then ring the doorbell
+  peer->channel->head.store(head, std::memory_order_release);
+  ShmInbox* inbox = peer->inbox;
+  inbox->doorbell.fetch_add(1);
+  if (inbox->sleeping.load()) FutexWake(&inbox->doorbell);
+  return send_bytes;
+}
+
+void ShmTransport::CommitRecv() {
+  if (!last_channel_) return;
+  last_channel_->tail.store(
+      last_channel_->tail.load(std::memory_order_relaxed) + last_size_,
+      std::memory_order_release);
+  last_channel_ = nullptr;
+}
+
+int ShmTransport::RecvMsg(Message* msg) {
+  msg->data.clear();
+  // the previous message has been handled by the caller now
+  CommitRecv();
+  const uint64_t arena_size = inbox_->arena_size;
+  while (true) {
+    uint32_t seen = inbox_->doorbell.load();
+    for (size_t k = 0; k < channels_.size(); ++k) {
+      ShmChannel* channel = channels_[(next_channel_ + k) % channels_.size()];
+      if (channel->state.load(std::memory_order_relaxed) != kClaimed) continue;
+      uint64_t tail = channel->tail.load(std::memory_order_relaxed);
+      if (tail == channel->head.load(std::memory_order_acquire)) continue;
+
+      auto rec = GetRecord(channel, tail, arena_size);
+      if (rec->num_data == kPadding) {
+        rec->released.store(1, std::memory_order_release);
+        channel->tail.store(tail + rec->size, std::memory_order_release);
+        --k; continue;
+      }
+      next_channel_ = (next_channel_ + k + 1) % channels_.size();
+      last_channel_ = channel;
+      last_size_ = rec->size;
+
+      char* buf = reinterpret_cast<char*>(rec);
+      uint64_t* sizes = reinterpret_cast<uint64_t*>(buf + sizeof(ShmRecord));
+      char* p = reinterpret_cast<char*>(sizes + rec->num_data);
+      msg->sender = rec->sender;
+      int recv_bytes = rec->meta_size;
+
+      // zero-copy, the record is recycled once the meta and all data frames
+      // are released
+      SArray<char> record;
+      BufferPool::Get()->Wrap(buf, rec->size, [](char* data) {
+          reinterpret_cast<ShmRecord*>(data)->released.store(
+              1, std::memory_order_release);
+        }, &record);
+      msg->raw_meta = record.segment(p - buf, p - buf + rec->meta_size);
+      size_t pos = AlignUp(p + rec->meta_size - buf, sizeof(uint64_t));
+      for (uint32_t i = 0; i < rec->num_data; ++i) {
+        msg->data.push_back(record.segment(pos, pos + sizes[i]));
+        pos += AlignUp(sizes[i], sizeof(uint64_t));
+        recv_bytes += sizes[i];
+      }
+      return recv_bytes;
+    }
+    if (exit_) return -1;
+    inbox_->sleeping.store(1);
+    FutexWait(&inbox_->doorbell, seen, 100);
+    inbox_->sleeping.store(0);
+  }
+}
+
+void ShmTransport::Stop() {
+  if (exit_.exchange(true)) return;
+  std::lock_guard<std::mutex> lk(mu_);
+  for (auto& peer : peers_.Clear()) {
+    std::lock_guard<std::mutex> plk(peer->mu);
+    if (peer->base) munmap(peer->base, peer->length);
+  }
+  if (base_) {
+    // wake up the receiving thread. the inbox stays mapped since received
+    // data may still be referenced
+    FutexWake(&inbox_->doorbell);
+    shm_unlink(name_.c_str());
+  }
+}
+
+}  // namespace ps
@@ -0,0 +1,404 @@
+#include "ps/internal/tcp_transport.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <climits>
+#include "ps/internal/buffer_pool.h"
+#include "ps/internal/meta_codec.h"
+
+namespace ps {
+
+namespace {
+
+/** \brief the fixed header of a message, followed by the data sizes */
+struct TCPHeader {
+  uint32_t magic;
+  int32_t sender;
+  uint32_t meta_size;
+  uint32_t num_data;
+};
+
+const uint32_t kTCPMagic = 0x70737463;
+const size_t kStagingSize = 64 << 10;
+const int kMaxEvents = 64;
+const char kPadding[8] = {0};
+
+inline size_t Pad(size_t size) { return (size + 7) & ~(size_t)7; }
+
+void SetNoDelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+}  // namespace
+
+int TCPTransport::Listen(int port, int max_retry) {
+  for (int i = 0; i < max_retry; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_GE(fd, 0) << "create socket failed: " << strerror(errno);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        listen(fd, SOMAXCONN) == 0 &&
+        getsockname(fd, (struct sockaddr*)&addr, &len) == 0) {
+      // the port picked by the system if 0 is given
+      port = ntohs(addr.sin_port);
+      listen_fd_ = fd;
+      break;
+    }
+    close(fd);
+    port = RandomPort();
+  }
+  if (listen_fd_ == -1) {
+    LOG(WARNING) << "bind failed after " << max_retry << " retries";
+    return -1;
+  }
+  fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+  return port;
+}
+
+int TCPTransport::Bind(const Node& node, int max_retry) {
+  int port = Listen(node.port(), max_retry);
+  if (port == -1) return -1;
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  CHECK_GE(epoll_fd_, 0) << "create epoll failed: " << strerror(errno);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd_;
+  CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev), 0);
+  return port;
+}
+
+bool TCPTransport::Connect(const Node& node, int my_id) {
+  auto existing = peers_.Find(node.id());
+  if (existing) {
+    std::lock_guard<std::mutex> plk(existing->mu);
+    existing->my_id = my_id;
+    return true;
+  }
+
+  struct addrinfo hints, *res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  std::string port = std::to_string(node.port());
+  int err = getaddrinfo(node.hostname().c_str(), port.c_str(), &hints, &res);
+  if (err != 0) {
+    LOG(WARNING) << "failed to resolve " << node.hostname() << ": "
+                 << gai_strerror(err);
+    return false;
+  }
+
+  // the remote node may not be listening yet
+  int fd = -1;
+  for (int i = 0; i < 6000 && fd == -1; ++i) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_GE(fd, 0) << "create socket failed: " << strerror(errno)
+                    << ". it often can be solved by \"sudo ulimit -n 65536\""
+                    << " or edit /etc/security/limits.conf";
+    if (connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+      close(fd); fd = -1;
+      usleep(10000);
+    }
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    LOG(WARNING) << "connect to " << node.hostname() << ":" << port
+                 << " failed: " << strerror(errno);
+    return false;
+  }
+  SetNoDelay(fd);
+
+  // connected without the lock, so that other nodes are connected meanwhile
+  std::lock_guard<std::mutex> lk(mu_);
+  existing = peers_.Find(node.id());
+  if (existing) {
+    close(fd);
+    std::lock_guard<std::mutex> plk(existing->mu);
+    existing->my_id = my_id;
+    return true;
+  }
+  auto peer = std::make_shared<Peer>();
+  peer->fd = fd;
+  peer->my_id = my_id;
+  peers_.Put(node.id(), peer);
+  return true;
+}
+
+int TCPTransport::Pack(const Message& msg, int my_id, SendBuffer* buf) {
+  int meta_size = MetaCodec::Size(msg.meta);
+  buf->meta.resize(meta_size);
+  MetaCodec::Encode(msg.meta, meta_size, &buf->meta[0]);
+
+  size_t n = msg.data.size();
+  auto& head = buf->head;
+  head.resize(sizeof(TCPHeader) / sizeof(uint64_t) + n);
+  auto hdr = reinterpret_cast<TCPHeader*>(head.data());
+  hdr->magic = kTCPMagic;
+  hdr->sender = my_id;
+  hdr->meta_size = meta_size;
+  hdr->num_data = n;
+
+  auto& iov = buf->iov;
+  iov.clear();
+  auto add = [&iov](const void* data, size_t size) {
+    if (size == 0) return;
+    struct iovec v;
+    v.iov_base = const_cast<void*>(data);
+    v.iov_len = size;
+    iov.push_back(v);
+  };
+  add(head.data(), head.size() * sizeof(uint64_t));
+  add(buf->meta.data(), meta_size);
+  add(kPadding, Pad(meta_size) - meta_size);
+  int send_bytes = meta_size;
+  for (size_t i = 0; i < n; ++i) {
+    size_t size = msg.data[i].size();
+    head[sizeof(TCPHeader) / sizeof(uint64_t) + i] = size;
+    add(msg.data[i].data(), size);
+    add(kPadding, Pad(size) - size);
+    send_bytes += size;
+  }
+  return send_bytes;
+}
+
+int TCPTransport::SendMsg(const Message& msg) {
+  auto peer = peers_.Find(msg.recver);
+  if (!peer) {
+    LOG(WARNING) << "there is no socket to node " << msg.recver;
+    return -1;
+  }
+
+  // reused by every message sent from this thread
+  thread_local SendBuffer buf;
+  int send_bytes = Pack(msg, Message::kInvalidNode, &buf);
+
+  std::lock_guard<std::mutex> lk(peer->mu);
+  if (peer->fd == -1) return -1;
+  reinterpret_cast<TCPHeader*>(buf.head.data())->sender = peer->my_id;
+  auto& iov = buf.iov;
+  size_t i = 0;
+  while (i < iov.size()) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov.data() + i;
+    mh.msg_iovlen = std::min(iov.size() - i, (size_t)IOV_MAX);
+    ssize_t sent = sendmsg(peer->fd, &mh, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to send message to node [" << msg.recver
+                   << "] errno: " << errno << " " << strerror(errno);
+      // a frame may be sent partly, the peer would misread whatever follows
+      // it, so the connection is closed and later sends to it return -1
+      close(peer->fd);
+      peer->fd = -1;
+      return -1;
+    }
+    // skip the bytes sent
+    while (sent > 0) {
+      if ((size_t)sent >= iov[i].iov_len) {
+        sent -= iov[i].iov_len; ++i;
+      } else {
+        iov[i].iov_base = (char*)iov[i].iov_base + sent;
+        iov[i].iov_len -= sent;
+        sent = 0;
+      }
+    }
+  }
+  return send_bytes;
+}
+
+int TCPTransport::RecvMsg(Message* msg) {
+  struct epoll_event events[kMaxEvents];
+  while (received_.empty()) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to receive message. errno: "
+                   << errno << " " << strerror(errno);
+      return -1;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd_) {
+        Accept();
+        continue;
+      }
+      auto it = conns_.find(fd);
+      if (it == conns_.end()) continue;
+      if (!Read(it->second.get())) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns_.erase(it);
+      }
+    }
+  }
+  return PopReceived(msg);
+}
+
+int TCPTransport::PopReceived(Message* msg) {
+  auto& front = received_.front();
+  *msg = std::move(front.first);
+  int recv_bytes = front.second;
+  received_.pop_front();
+  return recv_bytes;
+}
+
+void TCPTransport::Accept() {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    SetNoDelay(fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev), 0);
+    std::unique_ptr<Conn> conn(new Conn());
+    conn->fd = fd;
+    conn->buffer.resize(kStagingSize);
+    conn->staging = conn->buffer.data();
+    conn->capacity = kStagingSize;
+    conns_[fd] = std::move(conn);
+  }
+}
+
+bool TCPTransport::Read(Conn* conn) {
+  char* dst;
+  size_t len;
+  Consume(conn, 0, &dst, &len);
+  while (true) {
+    ssize_t r = read(conn->fd, dst, len);
+    if (r == 0) return false;
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      LOG(WARNING) << "failed to read. errno: " << errno << " " << strerror(errno);
+      return false;
+    }
+    Consume(conn, r, &dst, &len);
+  }
+}
+
+void TCPTransport::Consume(Conn* conn, size_t bytes, char** dst, size_t* len) {
+  if (conn->in_body) {
+    conn->filled += bytes;
+  } else {
+    conn->end += bytes;
+  }
+  while (true) {
+    if (conn->in_body) {
+      // use the staged bytes first, then read the rest into the body directly
+      size_t left = conn->body.size() - conn->filled;
+      size_t staged = std::min(left, conn->end - conn->begin);
+      memcpy(conn->body.data() + conn->filled,
+             conn->staging + conn->begin, staged);
+      conn->begin += staged;
+      conn->filled += staged;
+      left -= staged;
+      if (left == 0) {
+        Finish(conn);
+        continue;
+      }
+      *dst = conn->body.data() + conn->filled;
+      *len = left;
+      return;
+    }
+    if (ParseHeader(conn)) continue;
+    // need more bytes for a header
+    if (conn->begin == conn->end) {
+      conn->begin = conn->end = 0;
+    } else if (conn->begin > 0) {
+      memmove(conn->staging, conn->staging + conn->begin,
+              conn->end - conn->begin);
+      conn->end -= conn->begin;
+      conn->begin = 0;
+    }
+    *dst = conn->staging + conn->end;
+    *len = conn->capacity - conn->end;
+    return;
+  }
+}
+
+bool TCPTransport::ParseHeader(Conn* conn) {
+  size_t avail = conn->end - conn->begin;
+  if (avail < sizeof(TCPHeader)) return false;
+  TCPHeader hdr;
+  memcpy(&hdr, conn->staging + conn->begin, sizeof(hdr));
+  CHECK_EQ(hdr.magic, kTCPMagic) << "corrupted message";
+  size_t head_size = sizeof(TCPHeader) + hdr.num_data * sizeof(uint64_t);
+  if (head_size > conn->capacity) {
+    // too many data frames for the staging buffer, move to a larger one
+    std::vector<char> grown(head_size);
+    memcpy(grown.data(), conn->staging + conn->begin, avail);
+    conn->buffer.swap(grown);
+    conn->staging = conn->buffer.data();
+    conn->capacity = head_size;
+    conn->begin = 0;
+    conn->end = avail;
+  }
+  if (avail < head_size) return false;
+
+  conn->sender = hdr.sender;
+  conn->meta_size = hdr.meta_size;
+  conn->data_size.resize(hdr.num_data);
+  memcpy(conn->data_size.data(),
+         conn->staging + conn->begin + sizeof(TCPHeader),
+         hdr.num_data * sizeof(uint64_t));
+  conn->begin += head_size;
+
+  size_t total = Pad(hdr.meta_size);
+  for (uint64_t size : conn->data_size) total += Pad(size);
+  conn->body = BufferPool::Get()->Alloc(total);
+  conn->filled = 0;
+  conn->in_body = true;
+  return true;
+}
+
+void TCPTransport::Finish(Conn* conn) {
+  received_.emplace_back();
+  Message* msg = &received_.back().first;
+  msg->sender = conn->sender;
+  // zero-copy, the meta and the data frames share the body
+  msg->raw_meta = conn->body.segment(0, conn->meta_size);
+  size_t pos = Pad(conn->meta_size);
+  int recv_bytes = conn->meta_size;
+  for (uint64_t size : conn->data_size) {
+    msg->data.push_back(conn->body.segment(pos, pos + size));
+    pos += Pad(size);
+    recv_bytes += size;
+  }
+  received_.back().second = recv_bytes;
+  conn->body = SArray<char>();
+  conn->in_body = false;
+}
+
+void TCPTransport::Stop() {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& peer : peers_.Clear()) {
+      std::lock_guard<std::mutex> plk(peer->mu);
+      if (peer->fd != -1) close(peer->fd);
+      peer->fd = -1;
+    }
+  }
+  for (auto& it : conns_) close(it.first);
+  conns_.clear();
+  if (listen_fd_ != -1) close(listen_fd_);
+  if (epoll_fd_ != -1) close(epoll_fd_);
+}
+
+}  // namespace ps
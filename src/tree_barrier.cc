@@ -0,0 +1,128 @@
+#include "ps/internal/tree_barrier.h"
+#include <algorithm>
+#include "ps/internal/postoffice.h"
+
+namespace ps {
+
+TreeBarrier::TreeBarrier(const Node& my_node, const SendFunc& send,
+                         const DeadFunc& is_dead, int fanout)
+    : my_node_(my_node), send_(send), is_dead_(is_dead), fanout_(fanout) {
+  CHECK_GT(fanout_, 0);
+}
+
+void TreeBarrier::Wait(int group) {
+  std::vector<Message> out;
+  std::unique_lock<std::mutex> lk(mu_);
+  auto& state = groups_[group];
+  int gen = ++state.gen;
+  state.arrived_view = -1;
+  Check(group, &state, &out);
+  lk.unlock();
+  for (const auto& msg : out) send_(msg);
+  lk.lock();
+  cond_.wait(lk, [&state, gen] { return state.done >= gen; });
+}
+
+void TreeBarrier::Process(const Message& msg) {
+  const auto& ctrl = msg.meta.control();
+  CHECK(ctrl.has_barrier_group());
+  int group = ctrl.barrier_group();
+  int gen = ctrl.barrier_gen();
+  std::vector<Message> out;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& state = groups_[group];
+    if (msg.meta.request()) {
+      if (gen <= state.done) {
+        // a node whose parent died asks again
+        out.push_back(Make(msg.sender, group, gen, 0, false));
+      } else {
+        state.arrived[std::make_pair(gen, ctrl.barrier_view())].insert(
+            msg.sender);
+        Check(group, &state, &out);
+      }
+    } else if (gen == state.gen && gen > state.done) {
+      Pass(GetTree(group), group, &state, &out);
+    }
+  }
+  for (const auto& m : out) send_(m);
+}
+
+void TreeBarrier::Update() {
+  std::vector<Message> out;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& it : groups_) Check(it.first, &it.second, &out);
+  }
+  for (const auto& msg : out) send_(msg);
+}
+
+TreeBarrier::Tree TreeBarrier::GetTree(int group) {
+  const auto& ids = Postoffice::Get()->GetNodeIDs(group);
+  std::vector<int> alive;
+  for (int id : ids) {
+    if (!is_dead_(id)) alive.push_back(id);
+  }
+  Tree tree;
+  tree.view = ids.size() - alive.size();
+  tree.parent = -1;
+  // nothing to wait for if the others think I am dead
+  auto it = std::find(alive.begin(), alive.end(), my_node_.id());
+  if (it == alive.end()) return tree;
+  size_t i = it - alive.begin();
+  if (i > 0) tree.parent = alive[(i - 1) / fanout_];
+  for (size_t c = i * fanout_ + 1;
+       c <= i * fanout_ + fanout_ && c < alive.size(); ++c) {
+    tree.children.push_back(alive[c]);
+  }
+  return tree;
+}
+
+void TreeBarrier::Check(int group, Group* state, std::vector<Message>* out) {
+  Tree tree = GetTree(group);
+  // a new parent may still wait for the barrier passed last
+  if (state->done > 0 && tree.parent != -1 && state->done_view != tree.view) {
+    out->push_back(Make(tree.parent, group, state->done, tree.view, true));
+    state->done_view = tree.view;
+  }
+  if (state->gen == state->done) return;
+
+  const auto& arrived = state->arrived[std::make_pair(state->gen, tree.view)];
+  for (int child : tree.children) {
+    if (!arrived.count(child)) return;
+  }
+  if (tree.parent == -1) {
+    Pass(tree, group, state, out);
+  } else if (state->arrived_view != tree.view) {
+    out->push_back(Make(tree.parent, group, state->gen, tree.view, true));
+    state->arrived_view = tree.view;
+  }
+}
+
+void TreeBarrier::Pass(const Tree& tree, int group, Group* state,
+                       std::vector<Message>* out) {
+  state->done = state->gen;
+  state->done_view = tree.view;
+  for (int child : tree.children) {
+    out->push_back(Make(child, group, state->done, tree.view, false));
+  }
+  auto& arrived = state->arrived;
+  arrived.erase(arrived.begin(),
+                arrived.lower_bound(std::make_pair(state->done + 1, 0)));
+  cond_.notify_all();
+}
+
+Message TreeBarrier::Make(int recver, int group, int gen, int view,
+                          bool request) {
+  Message msg;
+  msg.recver = recver;
+  msg.meta.set_request(request);
+  auto ctrl = msg.meta.mutable_control();
+  ctrl->set_cmd(Control::BARRIER);
+  ctrl->set_barrier_group(group);
+  ctrl->set_barrier_gen(gen);
+  ctrl->set_barrier_view(view);
+  return msg;
+}
+
+}  // namespace ps
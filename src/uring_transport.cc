@@ -0,0 +1,591 @@
+#include "ps/internal/uring_transport.h"
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <climits>
+#include <algorithm>
+#include <deque>
+#include "ps/internal/postoffice.h"
+
+namespace ps {
+
+namespace {
+
+const unsigned kRingEntries = 1024;
+/** \brief the size of a registered buffer, must hold a header */
+const size_t kSlotSize = 16 << 10;
+/** \brief registered memory is locked, keep it small */
+const int kMaxSlots = 256;
+/** \brief how long to flush the pending sends in Stop, in nanoseconds */
+const long long kFlushTimeout = 1000000000LL;
+
+/** \brief the kind of an operation, stored in the top byte of user_data */
+enum OpKind { kRead = 1, kSend, kAccept, kWakeup, kTimeout };
+
+inline uint64_t Tag(OpKind kind, void* ptr) {
+  return ((uint64_t)kind << 56) | (uint64_t)(uintptr_t)ptr;
+}
+
+}  // namespace
+
+/**
+ * \brief the submission and completion queues mapped from the kernel
+ */
+struct UringTransport::Ring {
+  int fd = -1;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  /** \brief the entries filled but not submitted yet */
+  unsigned sq_local_tail = 0;
+  unsigned to_submit = 0;
+
+  void* sq_ptr = MAP_FAILED;
+  size_t sq_size = 0;
+  void* cq_ptr = MAP_FAILED;
+  size_t cq_size = 0;
+  size_t sqes_size = 0;
+
+  ~Ring() {
+    if (sqes_size) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (fd != -1) close(fd);
+  }
+
+  /** \return false if io_uring is not supported */
+  bool Init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return false;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) return false;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ptr = sq_ptr;
+    } else {
+      cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED) return false;
+    }
+    size_t size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) return false;
+    sqes = (struct io_uring_sqe*)ptr;
+    sqes_size = size;
+
+    char* sq = (char*)sq_ptr;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+    char* cq = (char*)cq_ptr;
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return true;
+  }
+
+  /** \return nullptr if the submission queue is full */
+  struct io_uring_sqe* Get() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= sq_entries) return nullptr;
+    unsigned idx = sq_local_tail & sq_mask;
+    sq_array[idx] = idx;
+    ++sq_local_tail;
+    ++to_submit;
+    struct io_uring_sqe* sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  /**
+   * \brief submit the filled entries and wait for min_complete completions
+   */
+  int Enter(unsigned min_complete) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (r > 0) to_submit -= r;
+    return r;
+  }
+};
+
+/** \brief a message to send */
+struct UringTransport::Request {
+  std::shared_ptr<Peer> peer;
+  SendBuffer buf;
+  /**
+   * \brief whether it is a data request or a batch of them, to report if it
+   * fails
+   */
+  bool report = false;
+  /** \brief the fields of the request read by the error handle */
+  Message head;
+  /** \brief keeps the data referenced by buf.iov alive */
+  std::vector<SArray<char>> data;
+  /** \brief the first iovec not sent yet */
+  size_t next = 0;
+};
+
+/** \brief the sends to a peer, one sendmsg in flight at a time */
+struct UringTransport::Sender {
+  std::shared_ptr<Peer> peer;
+  std::deque<Request*> queue;
+  bool busy = false;
+  struct msghdr mh;
+  std::vector<struct iovec> iov;
+};
+
+/** \brief an incoming connection with a read in flight */
+struct UringTransport::Reader : public TCPTransport::Conn {
+  /** \brief the registered buffer used as staging, -1 if none */
+  int slot = -1;
+  char* dst = nullptr;
+  size_t len = 0;
+};
+
+UringTransport::UringTransport() { }
+
+UringTransport::~UringTransport() {
+  Stop();
+}
+
+int UringTransport::Bind(const Node& node, int max_retry) {
+  int port = Listen(node.port(), max_retry);
+  if (port == -1) return -1;
+
+  ring_ = std::unique_ptr<Ring>(new Ring());
+  CHECK(ring_->Init(kRingEntries))
+      << "failed to setup io_uring: " << strerror(errno)
+      << ". it requires linux 5.6 or later";
+  event_fd_ = eventfd(0, EFD_CLOEXEC);
+  CHECK_GE(event_fd_, 0) << "create eventfd failed: " << strerror(errno);
+
+  // one registered buffer for each remote node
+  num_slots_ = std::min(kMaxSlots, Postoffice::Get()->num_servers() +
+                        Postoffice::Get()->num_workers() + 1);
+  slots_ = (char*)mmap(0, num_slots_ * kSlotSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(slots_ != MAP_FAILED) << "failed to allocate " << num_slots_ * kSlotSize
+                              << " bytes: " << strerror(errno);
+  std::vector<struct iovec> iov(num_slots_);
+  for (int i = 0; i < num_slots_; ++i) {
+    iov[i].iov_base = slots_ + i * kSlotSize;
+    iov[i].iov_len = kSlotSize;
+    free_slots_.push_back(num_slots_ - 1 - i);
+  }
+  registered_ = syscall(__NR_io_uring_register, ring_->fd,
+                        IORING_REGISTER_BUFFERS, iov.data(), num_slots_) == 0;
+  if (!registered_) {
+    LOG(WARNING) << "failed to register buffers: " << strerror(errno)
+                 << ". try to increase \"ulimit -l\"";
+  }
+
+  io_thread_ = std::unique_ptr<std::thread>(
+      new std::thread(&UringTransport::Polling, this));
+  return port;
+}
+
+int UringTransport::SendMsg(const Message& msg) {
+  if (exit_) return -1;
+  auto peer = peers_.Find(msg.recver);
+  if (!peer) {
+    LOG(WARNING) << "there is no socket to node " << msg.recver;
+    return -1;
+  }
+  int my_id;
+  {
+    // closed by a failed send, the frames after it would be misread
+    std::lock_guard<std::mutex> lk(peer->mu);
+    if (peer->fd == -1) return -1;
+    my_id = peer->my_id;
+  }
+
+  Request* req = nullptr;
+  {
+    std::lock_guard<std::mutex> lk(send_mu_);
+    if (!free_.empty()) {
+      req = free_.back();
+      free_.pop_back();
+    }
+  }
+  if (!req) req = new Request();
+  int send_bytes = Pack(msg, my_id, &req->buf);
+  req->data = msg.data;
+  req->peer = peer;
+  req->next = 0;
+  req->report = !msg.meta.has_control() &&
+                (msg.meta.request() || msg.meta.batch());
+  if (req->report) {
+    auto& head = req->head;
+    head.meta.Clear();
+    head.recver = msg.recver;
+    if (msg.meta.batch()) {
+      // the requests packed are read from the data when it fails
+      head.meta.set_batch(true);
+    } else {
+      head.meta.set_request(true);
+      head.meta.set_customer_id(msg.meta.customer_id());
+      head.meta.set_timestamp(msg.meta.timestamp());
+      head.meta.set_simple_app(msg.meta.simple_app());
+      if (msg.meta.has_push()) head.meta.set_push(msg.meta.push());
+      if (msg.meta.has_head()) head.meta.set_head(msg.meta.head());
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(send_mu_);
+    submitted_.push_back(req);
+  }
+  if (sleeping_.exchange(false)) {
+    uint64_t one = 1;
+    CHECK_EQ(write(event_fd_, &one, sizeof(one)), (ssize_t)sizeof(one));
+  }
+  return send_bytes;
+}
+
+int UringTransport::RecvMsg(Message* msg) {
+  std::unique_lock<std::mutex> lk(recv_mu_);
+  recv_cond_.wait(lk, [this] { return !received_.empty() || stopped_; });
+  if (received_.empty()) return -1;
+  return PopReceived(msg);
+}
+
+void UringTransport::Polling() {
+  PostAccept();
+  PostWakeup();
+  bool flushing = false;
+  struct __kernel_timespec ts;
+  ts.tv_sec = kFlushTimeout / 1000000000LL;
+  ts.tv_nsec = kFlushTimeout % 1000000000LL;
+  while (true) {
+    TakeRequests();
+    if (exit_) {
+      if (busy_senders_ == 0) break;
+      if (!flushing) {
+        // give the pending sends a while, the peers may be gone
+        struct io_uring_sqe* sqe = GetSqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t)&ts;
+        sqe->len = 1;
+        sqe->user_data = Tag(kTimeout, nullptr);
+        flushing = true;
+      }
+    }
+
+    // sleep only if SendMsg will wake us up
+    sleeping_ = true;
+    bool empty;
+    {
+      std::lock_guard<std::mutex> lk(send_mu_);
+      empty = submitted_.empty();
+    }
+    if (!empty) sleeping_ = false;
+    int r = ring_->Enter(empty ? 1 : 0);
+    sleeping_ = false;
+    if (r < 0 && errno != EINTR && errno != EBUSY) {
+      LOG(WARNING) << "io_uring_enter failed: " << strerror(errno);
+      break;
+    }
+
+    // reap the completions
+    unsigned head = *ring_->cq_head;
+    unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+    bool timeout = false;
+    for (; head != tail; ++head) {
+      struct io_uring_cqe* cqe = &ring_->cqes[head & ring_->cq_mask];
+      if ((cqe->user_data >> 56) == kTimeout) timeout = true;
+      Complete(cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+    if (timeout) {
+      LOG(WARNING) << busy_senders_ << " peers did not receive all messages";
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lk(recv_mu_);
+  stopped_ = true;
+  recv_cond_.notify_all();
+}
+
+void UringTransport::TakeRequests() {
+  std::vector<Request*> reqs;
+  {
+    std::lock_guard<std::mutex> lk(send_mu_);
+    reqs.swap(submitted_);
+    for (Request* req : done_) {
+      if (free_.size() < kRingEntries) {
+        free_.push_back(req);
+      } else {
+        delete req;
+      }
+    }
+  }
+  done_.clear();
+  for (Request* req : reqs) {
+    auto& sender = senders_[req->peer.get()];
+    if (!sender) {
+      sender = std::unique_ptr<Sender>(new Sender());
+      sender->peer = req->peer;
+    }
+    sender->queue.push_back(req);
+  }
+  for (Request* req : reqs) {
+    Sender* sender = senders_[req->peer.get()].get();
+    if (!sender->busy) PostSend(sender);
+  }
+}
+
+void UringTransport::Complete(uint64_t user_data, int res) {
+  OpKind kind = (OpKind)(user_data >> 56);
+  void* ptr = (void*)(uintptr_t)(user_data & ((1ULL << 56) - 1));
+  switch (kind) {
+    case kRead: {
+      Reader* reader = static_cast<Reader*>(ptr);
+      if (res == -EINTR || res == -EAGAIN) {
+        PostRead(reader);
+        return;
+      }
+      if (res <= 0) {
+        if (res < 0 && res != -ECONNRESET && !exit_) {
+          LOG(WARNING) << "failed to read: " << strerror(-res);
+        }
+        if (reader->slot != -1) free_slots_.push_back(reader->slot);
+        close(reader->fd);
+        readers_.erase(reader->fd);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lk(recv_mu_);
+        size_t num = received_.size();
+        Consume(reader, res, &reader->dst, &reader->len);
+        if (received_.size() > num) recv_cond_.notify_one();
+      }
+      PostRead(reader);
+      return;
+    }
+    case kSend:
+      Sent(static_cast<Sender*>(ptr), res);
+      return;
+    case kAccept: {
+      if (res >= 0) {
+        int one = 1;
+        setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::unique_ptr<Reader> reader(new Reader());
+        reader->fd = res;
+        if (!free_slots_.empty()) {
+          reader->slot = free_slots_.back();
+          free_slots_.pop_back();
+          reader->staging = slots_ + reader->slot * kSlotSize;
+          reader->capacity = kSlotSize;
+        } else {
+          reader->buffer.resize(kSlotSize);
+          reader->staging = reader->buffer.data();
+          reader->capacity = kSlotSize;
+        }
+        Consume(reader.get(), 0, &reader->dst, &reader->len);
+        PostRead(reader.get());
+        readers_[res] = std::move(reader);
+      } else if (!exit_) {
+        LOG(WARNING) << "failed to accept: " << strerror(-res);
+      }
+      if (!exit_) PostAccept();
+      return;
+    }
+    case kWakeup:
+      if (!exit_) PostWakeup();
+      return;
+    default:
+      return;
+  }
+}
+
+struct io_uring_sqe* UringTransport::GetSqe() {
+  struct io_uring_sqe* sqe;
+  while ((sqe = ring_->Get()) == nullptr) {
+    if (ring_->Enter(0) < 0 && errno != EINTR && errno != EBUSY) {
+      LOG(FATAL) << "io_uring_enter failed: " << strerror(errno);
+    }
+  }
+  return sqe;
+}
+
+void UringTransport::PostAccept() {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd_;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = Tag(kAccept, nullptr);
+}
+
+void UringTransport::PostWakeup() {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = event_fd_;
+  sqe->addr = (uint64_t)(uintptr_t)&event_buf_;
+  sqe->len = sizeof(event_buf_);
+  sqe->user_data = Tag(kWakeup, nullptr);
+}
+
+void UringTransport::PostRead(Reader* reader) {
+  struct io_uring_sqe* sqe = GetSqe();
+  // the header and the small messages land in the registered buffer, unless
+  // a large header moved the staging out of it
+  bool fixed = false;
+  if (registered_ && reader->slot != -1) {
+    char* slot = slots_ + reader->slot * kSlotSize;
+    fixed = reader->dst >= slot && reader->dst < slot + kSlotSize;
+  }
+  sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = reader->fd;
+  sqe->addr = (uint64_t)(uintptr_t)reader->dst;
+  sqe->len = std::min(reader->len, (size_t)INT_MAX);
+  if (fixed) sqe->buf_index = reader->slot;
+  sqe->user_data = Tag(kRead, reader);
+}
+
+void UringTransport::PostSend(Sender* sender) {
+  // gather the messages queued for this peer
+  sender->iov.clear();
+  for (Request* req : sender->queue) {
+    auto& iov = req->buf.iov;
+    for (size_t i = req->next; i < iov.size(); ++i) {
+      if (sender->iov.size() == IOV_MAX) break;
+      sender->iov.push_back(iov[i]);
+    }
+    if (sender->iov.size() == IOV_MAX) break;
+  }
+  memset(&sender->mh, 0, sizeof(sender->mh));
+  sender->mh.msg_iov = sender->iov.data();
+  sender->mh.msg_iovlen = sender->iov.size();
+
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sender->peer->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&sender->mh;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = Tag(kSend, sender);
+  if (!sender->busy) ++busy_senders_;
+  sender->busy = true;
+}
+
+void UringTransport::Sent(Sender* sender, int res) {
+  if (res == -EINTR || res == -EAGAIN) {
+    PostSend(sender);
+    return;
+  }
+  if (res < 0) {
+    LOG(WARNING) << "failed to send " << sender->queue.size()
+                 << " messages: " << strerror(-res);
+    Fail(sender);
+  }
+  // skip the bytes sent
+  size_t sent = res < 0 ? 0 : res;
+  while (sent > 0) {
+    Request* req = sender->queue.front();
+    auto& iov = req->buf.iov[req->next];
+    if (sent >= iov.iov_len) {
+      sent -= iov.iov_len;
+      if (++req->next == req->buf.iov.size()) {
+        req->data.clear();
+        req->peer.reset();
+        done_.push_back(req);
+        sender->queue.pop_front();
+      }
+    } else {
+      iov.iov_base = (char*)iov.iov_base + sent;
+      iov.iov_len -= sent;
+      sent = 0;
+    }
+  }
+  if (sender->queue.empty()) {
+    sender->busy = false;
+    --busy_senders_;
+  } else {
+    PostSend(sender);
+  }
+}
+
+void UringTransport::Fail(Sender* sender) {
+  {
+    // a frame may be sent partly, so nothing more can go through it
+    std::lock_guard<std::mutex> lk(sender->peer->mu);
+    if (sender->peer->fd != -1) {
+      close(sender->peer->fd);
+      sender->peer->fd = -1;
+    }
+  }
+  for (Request* req : sender->queue) {
+    // answered locally, so the waiters of the requests are not blocked
+    if (req->report && error_handle_ && !exit_) {
+      if (req->head.meta.batch()) req->head.data = req->data;
+      error_handle_(req->head);
+      req->head.data.clear();
+    }
+    req->data.clear();
+    req->peer.reset();
+    done_.push_back(req);
+  }
+  sender->queue.clear();
+}
+
+void UringTransport::Stop() {
+  if (io_thread_) {
+    // flush the pending sends
+    exit_ = true;
+    uint64_t one = 1;
+    CHECK_EQ(write(event_fd_, &one, sizeof(one)), (ssize_t)sizeof(one));
+    io_thread_->join();
+    io_thread_.reset();
+  }
+  // closing the ring cancels the reads in flight
+  ring_.reset();
+  for (auto& it : readers_) close(it.first);
+  readers_.clear();
+  for (auto& it : senders_) {
+    for (Request* req : it.second->queue) delete req;
+  }
+  senders_.clear();
+  for (Request* req : submitted_) delete req;
+  submitted_.clear();
+  for (Request* req : done_) delete req;
+  done_.clear();
+  for (Request* req : free_) delete req;
+  free_.clear();
+  if (slots_) {
+    munmap(slots_, num_slots_ * kSlotSize);
+    slots_ = nullptr;
+  }
+  if (event_fd_ != -1) {
+    close(event_fd_);
+    event_fd_ = -1;
+  }
+  TCPTransport::Stop();
+  listen_fd_ = -1;
+}
+
+}  // namespace ps
@@ -1,17 +1,39 @@
 #include "ps/internal/van.h"
-#include <zmq.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <netinet/in.h>
+#include <algorithm>
+#include <random>
 #include "ps/base.h"
 #include "ps/sarray.h"
 #include "ps/internal/postoffice.h"
 #include "ps/internal/customer.h"
 #include "ps/internal/meta_message.pb.h"
+#include "ps/internal/compressor.h"
+#include "ps/internal/meta_codec.h"
+#include "ps/internal/zmq_transport.h"
+#include "ps/internal/shm_transport.h"
+#include "ps/internal/tcp_transport.h"
+#include "ps/internal/uring_transport.h"
 
 namespace ps {
 
+Transport* Transport::Create(const std::string& type) {
+  if (type == "zmq") {
+    return new ZMQTransport();
+  } else if (type == "tcp") {
+    return new TCPTransport();
+  } else if (type == "uring") {
+    return new UringTransport();
+  } else if (type == "shm") {
+    // the other nodes may not have created their inboxes yet
+    return new ShmTransport(60);
+  }
+  LOG(FATAL) << "unsupported van type: " << type;
+  return nullptr;
+}
+
 /**
  * \brief return the IP address for given interface eth0, eth1, ...
  */
@@ -73,52 +95,113 @@ void GetAvailableInterfaceAndIP(
   return;
 }
 
+int Transport::RandomPort() {
+  static thread_local std::mt19937 gen(std::random_device{}());
+  return std::uniform_int_distribution<int>(10000, 49999)(gen);
+}
+
+/** \brief the fixed part of a node in a packed node list */
+struct PackedNode {
+  int32_t id;
+  uint16_t port;
+  /** \brief 0 if there is no control port */
+  uint16_t control_port;
+  uint8_t role;
+  /** \brief 0 if the hostname is packed as 4 bytes of IPv4 address */
+  uint8_t hostname_size;
+} __attribute__((packed));
+
 /**
- * \brief return an available port on local machine
- *
- * only support IPv4
- * \return 0 on failure
+ * \brief append a node to a packed node list, which is about half the size of
+ * the protobuf nodes. so the lists can also be concatenated
  */
-unsigned short GetAvailablePort() {
-  struct sockaddr_in addr;
-  addr.sin_port = htons(0); // have system pick up a random port available for me
-  addr.sin_family = AF_INET; // IPV4
-  addr.sin_addr.s_addr = htonl(INADDR_ANY); // set our addr to any interface
-
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (0 != bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in))) {
-    perror("bind():");
-    return 0;
+void PackNode(const Node& node, std::string* buf) {
+  CHECK(node.port() >= 0 && node.port() <= 65535) << node.port();
+  CHECK(node.control_port() >= 0 && node.control_port() <= 65535);
+  PackedNode packed;
+  packed.id = node.id();
+  packed.port = node.port();
+  packed.control_port = node.control_port();
+  packed.role = node.role();
+  // only an address printed back the same way is packed
+  const auto& hostname = node.hostname();
+  struct in_addr addr;
+  char printed[INET_ADDRSTRLEN];
+  bool ipv4 = inet_pton(AF_INET, hostname.c_str(), &addr) == 1 &&
+              inet_ntop(AF_INET, &addr, printed, sizeof(printed)) &&
+              hostname == printed;
+  CHECK(ipv4 || (!hostname.empty() && hostname.size() < 256)) << hostname;
+  packed.hostname_size = ipv4 ? 0 : hostname.size();
+  buf->append(reinterpret_cast<char*>(&packed), sizeof(packed));
+  if (ipv4) {
+    buf->append(reinterpret_cast<char*>(&addr), sizeof(addr));
+  } else {
+    buf->append(hostname);
   }
+}
 
-  socklen_t addr_len = sizeof(struct sockaddr_in);
-  if (0 != getsockname(sock, (struct sockaddr*)&addr, &addr_len)) {
-    perror("getsockname():");
-    return 0;
+/**
+ * \brief decode a packed node list
+ */
+void UnpackNodes(const std::string& buf, std::vector<Node>* nodes) {
+  nodes->clear();
+  size_t pos = 0;
+  while (pos < buf.size()) {
+    PackedNode packed;
+    CHECK_LE(pos + sizeof(packed), buf.size()) << "bad packed nodes";
+    memcpy(&packed, buf.data() + pos, sizeof(packed));
+    pos += sizeof(packed);
+    Node node;
+    node.set_id(packed.id);
+    node.set_port(packed.port);
+    if (packed.control_port) node.set_control_port(packed.control_port);
+    node.set_role(static_cast<Node::Role>(packed.role));
+    if (packed.hostname_size) {
+      CHECK_LE(pos + packed.hostname_size, buf.size()) << "bad packed nodes";
+      node.set_hostname(buf.substr(pos, packed.hostname_size));
+      pos += packed.hostname_size;
+    } else {
+      struct in_addr addr;
+      CHECK_LE(pos + sizeof(addr), buf.size()) << "bad packed nodes";
+      memcpy(&addr, buf.data() + pos, sizeof(addr));
+      pos += sizeof(addr);
+      char printed[INET_ADDRSTRLEN];
+      node.set_hostname(inet_ntop(AF_INET, &addr, printed, sizeof(printed)));
+    }
+    nodes->push_back(node);
   }
-
-  unsigned short ret_port = ntohs(addr.sin_port);
-  close(sock);
-  return ret_port;
 }
 
 void Van::Start() {
-  // start zmq
-  context_ = zmq_ctx_new();
-  CHECK(context_ != NULL) << "create 0mq context failed";
-  zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
-  // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
+  const char* type = getenv("DMLC_PS_VAN_TYPE");
+  std::string van_type = type ? type : "zmq";
+  transport_ = std::unique_ptr<Transport>(Transport::Create(van_type));
+  // the requests failing after they were sent are answered locally
+  transport_->set_error_handle(
+      [this](const Message& msg) { ReportError(msg); });
+  // control messages use their own connections and receiving thread, so
+  // they never wait behind bulk data
+  if (GetEnv("DMLC_PS_CONTROL_CHANNEL", 1)) {
+    control_ = std::unique_ptr<Transport>(Transport::Create(van_type));
+  }
 
-  // get scheduler info
+  // get scheduler info. the root port is for control messages, the port for
+  // data is known after the scheduler adds the nodes
+  int root_port = atoi(CHECK_NOTNULL(getenv("DMLC_PS_ROOT_PORT")));
   scheduler_.set_hostname(std::string(CHECK_NOTNULL(getenv("DMLC_PS_ROOT_URI"))));
-  scheduler_.set_port(atoi(CHECK_NOTNULL(getenv("DMLC_PS_ROOT_PORT"))));
+  if (control_) {
+    scheduler_.set_control_port(root_port);
+  } else {
+    scheduler_.set_port(root_port);
+  }
   scheduler_.set_role(Node::SCHEDULER);
   scheduler_.set_id(kScheduler);
   is_scheduler_ = Postoffice::Get()->is_scheduler();
 
-  // get my node info
+  // get my node info. a port of 0 is picked when binding
   if (is_scheduler_) {
     my_node_ = scheduler_;
+    if (control_) my_node_.set_port(0);
   } else {
     auto role = is_scheduler_ ? Node::SCHEDULER :
                 (Postoffice::Get()->is_worker() ? Node::WORKER : Node::SERVER);
@@ -131,50 +214,100 @@ void Van::Start() {
     } else {
       GetAvailableInterfaceAndIP(&interface, &ip);
     }
-    int port = GetAvailablePort();
     CHECK(!ip.empty()) << "failed to get ip";
     CHECK(!interface.empty()) << "failed to get the interface";
-    CHECK(port) << "failed to get a port";
     my_node_.set_role(role);
     my_node_.set_hostname(ip);
-    my_node_.set_port(port);
+    my_node_.set_port(0);
+    if (control_) my_node_.set_control_port(0);
     // cannot determine my id now, the scheduler will assign it later
   }
 
-  // bind. do multiple retries on binding the port. since it's possible that
-  // different nodes on the same machine picked the same port. but no retry for
-  // the scheduler
-  receiver_ = zmq_socket(context_, ZMQ_ROUTER);
-  CHECK(receiver_ != NULL)
-      << "create receiver socket failed: " << zmq_strerror(errno);
+  // bind. the scheduler must listen on the root port, no retry for it. the
+  // other ports are picked by the system, or by retrying random ports for the
+  // engines not on TCP
+  const int kMaxRetry = 40;
+  int port = transport_->Bind(my_node_, my_node_.port() ? 1 : kMaxRetry);
+  CHECK_NE(port, -1) << "bind failed";
+  my_node_.set_port(port);
+  if (control_) {
+    Node node = my_node_;
+    node.set_port(my_node_.control_port());
+    port = control_->Bind(node, node.port() ? 1 : kMaxRetry);
+    CHECK_NE(port, -1) << "bind failed";
+    my_node_.set_control_port(port);
+    // so that the scheduler also connects to its own data port
+    if (is_scheduler_) scheduler_ = my_node_;
+  }
+
+  // messages to the nodes on the same machine go through shared memory
   int local = GetEnv("DMLC_LOCAL", 0);
-  std::string addr = local ? "ipc:///tmp/" : "tcp://*:";
-  int max_retry = is_scheduler_ ? 40 : 1;
-  for (int i = 0; i < max_retry; ++i) {
-    auto address = addr + std::to_string(my_node_.port());
-    if (zmq_bind(receiver_, address.c_str()) == 0) break;
-    CHECK_NE(i, max_retry - 1)
-        << "bind failed after " << max_retry << " retries";
-    srand((int)time(NULL) + my_node_.port());
-    my_node_.set_port(10000 + rand() % 40000);
+  if (van_type != "shm" && GetEnv("DMLC_PS_SHM", local)) {
+    shm_ = std::unique_ptr<ShmTransport>(new ShmTransport());
+    if (shm_->Bind(my_node_, 1) != -1) {
+      shm_receiver_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&Van::ShmReceiving, this));
+    } else {
+      LOG(WARNING) << "failed to create shared memory, use " << van_type;
+      shm_.reset();
+    }
+  }
+
+  // the data messages can be handed to other threads, which decode and
+  // decompress them and pass them to the customers, so the receiving threads
+  // only read the few fields routing them
+  int num_dispatch = GetEnv("DMLC_PS_RECV_THREADS", 0);
+  for (int i = 0; i < num_dispatch; ++i) {
+    dispatch_queues_.emplace_back(new ThreadsafePriorityQueue());
+  }
+  for (int i = 0; i < num_dispatch; ++i) {
+    dispatch_threads_.emplace_back(new std::thread(&Van::Dispatching, this, i));
+  }
+
+  // pack the small messages sent through the network
+  int coalesce_bytes = GetEnv("DMLC_PS_COALESCE_BYTES", 0);
+  if (coalesce_bytes > 0) {
+    coalescer_ = std::unique_ptr<Coalescer>(new Coalescer(
+        [this](const Message& msg) { return transport_->SendMsg(msg); },
+        [this](const Message& msg) { ReportError(msg); }, coalesce_bytes, GetEnv("DMLC_PS_COALESCE_USEC", 100)));
   }
 
+  // the responses of the requests to a dead node are made up, which needs
+  // to track the pending requests, so it is off unless asked for
+  exit_ = false;
+  heartbeat_interval_ = std::chrono::seconds(
+      GetEnv("DMLC_PS_HEARTBEAT_INTERVAL", 0));
+  heartbeat_timeout_ = std::chrono::seconds(
+      GetEnv("DMLC_PS_HEARTBEAT_TIMEOUT", 10));
+
+  // connect to a node on the first message sent to it
+  lazy_connect_ = GetEnv("DMLC_PS_LAZY_CONNECT", 0);
+
+  // send the data messages by background threads
+  int num_senders = GetEnv("DMLC_PS_ASYNC_SEND", 0);
+  if (num_senders > 0) {
+    async_sender_ = std::unique_ptr<AsyncSender>(new AsyncSender(
+        [this](const Message& msg) { return SendNow(msg); },
+        [this](const Message& msg) { ReportError(msg); },
+        num_senders, GetEnv("DMLC_PS_SEND_QUEUE_SIZE", 1024)));
+  }
+
+  // the barriers are passed along trees of the nodes
+  barrier_ = std::unique_ptr<TreeBarrier>(new TreeBarrier(
+      my_node_, [this](const Message& msg) { return Send_(msg); },
+      [this](int id) { return IsDead(id); },
+      GetEnv("DMLC_PS_BARRIER_FANOUT", 8)));
+
   // connect to the scheduler
   Connect(scheduler_);
 
-  // start monitor
-  // if (is_scheduler_) {
-  //   CHECK(!zmq_socket_monitor(receiver_, "inproc://monitor", ZMQ_EVENT_ALL));
-  // } else {
-  //   CHECK(!zmq_socket_monitor(
-  //       senders_[kScheduler], "inproc://monitor", ZMQ_EVENT_ALL));
-  // }
-  // monitor_thread_ = std::unique_ptr<std::thread>(
-  //     new std::thread(&Van::Monitoring, this));
-
   // start receiver
   receiver_thread_ = std::unique_ptr<std::thread>(
-      new std::thread(&Van::Receiving, this));
+      new std::thread(&Van::Receiving, this, transport_.get()));
+  if (control_) {
+    control_receiver_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&Van::Receiving, this, control_.get()));
+  }
 
   if (!is_scheduler_) {
     // let the schduler know myself
@@ -186,310 +319,475 @@ void Van::Start() {
     Send_(msg);
   }
   // wait until ready
-  while(!ready_) usleep(500);
+  {
+    std::unique_lock<std::mutex> lk(ready_mu_);
+    ready_cond_.wait(lk, [this] { return ready_.load(); });
+  }
+
+  // the scheduler watches the heartbeats of the others
+  if (heartbeat_interval_.count()) {
+    heartbeat_thread_ = std::unique_ptr<std::thread>(new std::thread(
+        is_scheduler_ ? &Van::Monitoring : &Van::Heartbeat, this));
+  }
 }
 
 void Van::Stop() {
+  {
+    std::lock_guard<std::mutex> lk(heartbeat_mu_);
+    exit_ = true;
+    heartbeat_cond_.notify_all();
+  }
+  if (heartbeat_thread_) heartbeat_thread_->join();
+  if (async_sender_) async_sender_->Stop();
+  if (coalescer_) coalescer_->Stop();
+
   // stop threads
   Message exit;
   exit.meta.mutable_control()->set_cmd(Control::TERMINATE);
   exit.recver = my_node_.id();
   Send_(exit);
+  if (control_) {
+    control_receiver_thread_->join();
+    transport_->SendMsg(exit);
+  }
   receiver_thread_->join();
-
-  // close sockets
-  for (auto& it : senders_) zmq_close(it.second);
-  zmq_close(receiver_);
-  zmq_ctx_destroy(context_);
+  if (shm_) {
+    shm_->Stop();
+    shm_receiver_thread_->join();
+  }
+  for (auto& queue : dispatch_queues_) queue->Push(exit);
+  for (auto& thread : dispatch_threads_) thread->join();
+  dispatch_threads_.clear();
+  dispatch_queues_.clear();
+
+  // close connections
+  transport_->Stop();
+  if (control_) control_->Stop();
 }
 
 void Van::Connect(const Node& node) {
-  CHECK(node.has_id()) << node.ShortDebugString();
-  CHECK(node.has_port()) << node.ShortDebugString();
-  CHECK(node.has_hostname()) << node.ShortDebugString();
-
-  int id = node.id();
+  Connect(std::vector<Node>{node});
+}
 
-  if (senders_.find(id) != senders_.end()) {
-    zmq_close(senders_[id]);
+void Van::Connect(const std::vector<Node>& nodes) {
+  std::vector<const Node*> todo, later;
+  for (const auto& node : nodes) {
+    CHECK(node.has_id()) << node.ShortDebugString();
+    CHECK(node.has_port() || node.has_control_port()) << node.ShortDebugString();
+    CHECK(node.has_hostname()) << node.ShortDebugString();
+
+    // worker only talks to the other workers in the barriers, so connect to
+    // them on first use. same for server
+    if (lazy_connect_ || ((node.role() == my_node_.role()) &&
+                          (node.id() != my_node_.id()))) {
+      later.push_back(&node);
+    } else {
+      todo.push_back(&node);
+    }
   }
 
-  // worker doesn't need to connect to the other workers. same for server
-  if ((node.role() == my_node_.role()) &&
-      (node.id() != my_node_.id())) {
-    return;
+  if (!later.empty()) {
+    // a node connected already is connected again, which updates my id
+    std::vector<std::pair<int, std::shared_ptr<Peer>>> peers;
+    for (const Node* node : later) {
+      auto peer = std::make_shared<Peer>();
+      peer->node = *node;
+      peers.emplace_back(node->id(), peer);
+    }
+    std::lock_guard<std::mutex> lk(peers_mu_);
+    peers_.Put(peers);
   }
 
-  void *sender = zmq_socket(context_, ZMQ_DEALER);
-  CHECK(sender != NULL)
-      << zmq_strerror(errno)
-      << ". it often can be solved by \"sudo ulimit -n 65536\""
-      << " or edit /etc/security/limits.conf";
-
-  if (my_node_.has_id()) {
-    std::string my_id = "ps" + std::to_string(my_node_.id());
-    zmq_setsockopt(sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
+  // most of the time is waiting for the remote nodes, so connect to them in
+  // parallel
+  const size_t kMaxThreads = 16;
+  std::atomic<size_t> next{0};
+  auto connect = [this, &todo, &next]() {
+    for (size_t i = next++; i < todo.size(); i = next++) {
+      CHECK(ConnectNow(*todo[i]))
+          << "failed to connect to " << todo[i]->ShortDebugString();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(todo.size(), kMaxThreads); ++i) {
+    threads.emplace_back(connect);
   }
+  connect();
+  for (auto& thread : threads) thread.join();
+}
 
-
-  // connect
-  std::string addr = "tcp://" + node.hostname() + ":" + std::to_string(node.port());
-  if (GetEnv("DMLC_LOCAL", 0)) {
-    addr = "ipc:///tmp/" + std::to_string(node.port());
+bool Van::ConnectNow(const Node& node) {
+  int my_id = my_node_.has_id() ? my_node_.id() : Message::kInvalidNode;
+  if (control_ && node.has_control_port()) {
+    Node control = node;
+    control.set_port(node.control_port());
+    if (!control_->Connect(control, my_id)) return false;
   }
-
-  if (zmq_connect(sender, addr.c_str()) != 0) {
-    LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
+  // the data port of the scheduler is unknown until it adds the nodes
+  if (!node.has_port()) return true;
+  if (!transport_->Connect(node, my_id)) return false;
+
+  // data messages to this node can use shared memory once my id is known
+  if (shm_ && my_node_.has_id() &&
+      (GetEnv("DMLC_LOCAL", 0) || node.hostname() == my_node_.hostname())) {
+    shm_->Connect(node, my_id);
   }
-
-  senders_[id] = sender;
+  return true;
 }
 
-/**
- * \brief be smart on freeing recved data
- */
-void FreeData(void *data, void *hint) {
-  if (hint == NULL) {
-    delete [] (char*)data;
-  } else {
-    delete (SArray<char>*)hint;
+bool Van::EnsureConnected(int id) {
+  auto peer = peers_.Find(id);
+  // an unknown node is left to the transport to report
+  if (!peer || peer->connected) return true;
+  std::lock_guard<std::mutex> lk(peer->mu);
+  if (peer->connected) return true;
+  if (!ConnectNow(peer->node)) {
+    LOG(WARNING) << "failed to connect to " << peer->node.ShortDebugString();
+    return false;
   }
+  peer->connected = true;
+  return true;
 }
 
 int Van::Send_(const Message& msg) {
-  std::lock_guard<std::mutex> lk(mu_);
-
-  // find the socket
-  int id = msg.recver;
-  auto it = senders_.find(id);
-  if (it == senders_.end()) {
-    LOG(WARNING) << "there is no socket to node " + id;
-    return -1;
-  }
-  void *socket = it->second;
-
-  // send meta
-  int meta_size = msg.meta.ByteSize();
-  char* meta_buf = new char[meta_size+5];
-  CHECK(msg.meta.SerializeToArray(meta_buf, meta_size))
-      << "failed to serialize " << msg.meta.ShortDebugString();
-
-  int tag = ZMQ_SNDMORE;
-  int n = msg.data.size();
-  if (n == 0) tag = 0;
-  zmq_msg_t meta_msg;
-  zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
-
-  while (true) {
-    if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
-    if (errno == EINTR) continue;
-    LOG(WARNING) << "failed to send message to node [" << id
-                 << "] errno: " << errno << " " << zmq_strerror(errno);
-    return -1;
-  }
-  int send_bytes = meta_size;
-
-  // send data
-  for (int i = 0; i < n; ++i) {
-    zmq_msg_t data_msg;
-    SArray<char>* data = new SArray<char>(msg.data[i]);
-    int data_size = data->size();
-    zmq_msg_init_data(&data_msg, data->data(), data->size(), FreeData, data);
-    if (i == n - 1) tag = 0;
-    while (true) {
-      if (zmq_msg_send(&data_msg, socket, tag) == data_size) break;
-      if (errno == EINTR) continue;
-      LOG(WARNING) << "failed to send message to node [" << id
-                   << "] errno: " << errno << " " << zmq_strerror(errno)
-                   << ". " << i << "/" << n << ": " << msg.meta.ShortDebugString();
+  if (heartbeat_interval_.count() && !msg.meta.has_control()) {
+    if (msg.meta.request()) AddPending(msg);
+    if (IsDead(msg.recver)) {
+      ReportError(msg);
       return -1;
     }
-    send_bytes += data_size;
   }
-  send_bytes_ += send_bytes;
-  return send_bytes;
+  if (async_sender_ && !msg.meta.has_control()) {
+    return async_sender_->Send(msg);
+  }
+  return SendNow(msg);
 }
 
-int Van::GetNodeID(const char* buf, size_t size) {
-  if (size > 2 && buf[0] == 'p' && buf[1] == 's') {
-    int id = 0;
-    size_t i = 2;
-    for (; i < size; ++i) {
-      if (buf[i] >= '0' && buf[i] <= '9') {
-        id = id * 10 + buf[i] - '0';
-      } else {
-        break;
-      }
+int Van::SendNow(const Message& msg) {
+  int send_bytes = -1;
+  if ((lazy_connect_ || msg.meta.has_control()) &&
+      !EnsureConnected(msg.recver)) {
+    ReportError(msg);
+    return -1;
+  }
+  if (msg.meta.has_control()) {
+    if (control_) {
+      send_bytes = control_->SendMsg(msg);
+    } else {
+      send_bytes = coalescer_ ? coalescer_->Send(msg) : transport_->SendMsg(msg);
+    }
+  } else {
+    if (shm_) send_bytes = shm_->SendMsg(msg);
+    if (send_bytes == -1 && msg.meta.compression()) {
+      // only worth it over the network
+      Message compressed = msg;
+      Compressor::Compress(&compressed);
+      send_bytes = coalescer_ ? coalescer_->Send(compressed) :
+                   transport_->SendMsg(compressed);
+    } else if (send_bytes == -1) {
+      send_bytes = coalescer_ ? coalescer_->Send(msg) : transport_->SendMsg(msg);
     }
-    if (i == size) return id;
   }
-  return Message::kInvalidNode;
+  if (send_bytes != -1) {
+    Postoffice::Get()->metrics()->AddSent(msg, send_bytes);
+  } else {
+    ReportError(msg);
+  }
+  return send_bytes;
 }
 
-int Van::Recv(Message* msg) {
-  msg->data.clear();
-  size_t recv_bytes = 0;
-  for (int i = 0; ; ++i) {
-    zmq_msg_t* zmsg = new zmq_msg_t;
-    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
-    while (true) {
-      if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
-      if (errno == EINTR) continue;
-      LOG(WARNING) << "failed to receive message. errno: "
-                   << errno << " " << zmq_strerror(errno);
-      return -1;
-    }
-    char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
-    size_t size = zmq_msg_size(zmsg);
-    recv_bytes += size;
-
-    if (i == 0) {
-      // identify
-      msg->sender = GetNodeID(buf, size);
-      msg->recver = my_node_.id();
-      CHECK(zmq_msg_more(zmsg));
-      zmq_msg_close(zmsg);
-      delete zmsg;
-    } else if (i == 1) {
-      // task
-      CHECK(msg->meta.ParseFromArray(buf, size))
-          << "failed to parse string from " << msg->sender
-          << ". this is " << my_node_.id() << " " << size;
-      zmq_msg_close(zmsg);
-      if (!zmq_msg_more(zmsg)) break;
-      delete zmsg;
-    } else {
-      // zero-copy
-      SArray<char> data;
-      data.reset(buf, size, [zmsg,size](char*) {
-          zmq_msg_close(zmsg);
-          delete zmsg;
-        });
-      msg->data.push_back(data);
-      if (!zmq_msg_more(zmsg)) { break; }
-    }
+void Van::ReportError(const Message& msg) {
+  if (msg.meta.batch()) {
+    // failed after sent by the transport
+    Coalescer::Fail(msg, [this](const Message& req) { ReportError(req); });
+    return;
   }
-  recv_bytes_ += recv_bytes;
-  return recv_bytes;
+  if (msg.meta.has_control() || !msg.meta.request()) return;
+  LOG(WARNING) << "failed to send a request to node " << msg.recver;
+  // answer the request locally, so that its waiters and callbacks are not
+  // blocked forever
+  Message res;
+  res.sender = msg.recver;
+  res.recver = my_node_.id();
+  res.meta.set_request(false);
+  res.meta.set_error(true);
+  res.meta.set_customer_id(msg.meta.customer_id());
+  res.meta.set_timestamp(msg.meta.timestamp());
+  res.meta.set_simple_app(msg.meta.simple_app());
+  if (msg.meta.has_push()) res.meta.set_push(msg.meta.push());
+  if (msg.meta.has_head()) res.meta.set_head(msg.meta.head());
+  Dispatch(&res);
 }
 
-void Van::Receiving() {
-  // for scheduler usage
-  MetaMessage nodes;
+void Van::Receiving(Transport* transport) {
+  // for scheduler usage, the nodes added and packed
+  std::vector<Node> nodes;
+  std::string packed;
+  Metrics* metrics = Postoffice::Get()->metrics();
 
   while (true) {
-    Message msg; CHECK_GE(Recv(&msg), 0);
+    Message msg;
+    int recv_bytes = transport->RecvMsg(&msg);
+    CHECK_GE(recv_bytes, 0);
+    msg.recver = my_node_.id();
+    ReadMeta(&msg);
+    // a batch is counted by the messages in it
+    if (!msg.meta.batch()) metrics->AddRecv(msg, recv_bytes);
     if (msg.meta.has_control()) {
       // do some management
       const auto& ctrl = msg.meta.control();
       if (ctrl.cmd() == Control::TERMINATE) {
         break;
       } else if (ctrl.cmd() == Control::ADD_NODE) {
-        // assign an id
-        if (msg.sender == Message::kInvalidNode) {
-          CHECK(is_scheduler_);
+        if (is_scheduler_) {
+          // assign an id
+          CHECK_EQ(msg.sender, Message::kInvalidNode);
           CHECK_EQ(ctrl.node_size(), 1);
-          auto node = msg.meta.mutable_control()->mutable_node(0);
-          if (node->role() == Node::SERVER) {
-            node->set_id(Postoffice::ServerRankToID(num_servers_));
+          Node node = ctrl.node(0);
+          if (node.role() == Node::SERVER) {
+            node.set_id(Postoffice::ServerRankToID(num_servers_++));
           } else {
-            CHECK_EQ(node->role(), Node::WORKER);
-            node->set_id(Postoffice::WorkerRankToID(num_workers_));
-          }
-          nodes.mutable_control()->add_node()->CopyFrom(*node);
-        }
-
-        // update my id
-        for (int i = 0; i < ctrl.node_size(); ++i) {
-          const auto& node = ctrl.node(i);
-          if (my_node_.hostname() == node.hostname() &&
-              my_node_.port() == node.port()) {
-            my_node_.set_id(node.id());
-            std::string rank = std::to_string(Postoffice::IDtoRank(node.id()));
-            setenv("DMLC_RANK", rank.c_str(), true);
+            CHECK_EQ(node.role(), Node::WORKER);
+            node.set_id(Postoffice::WorkerRankToID(num_workers_++));
           }
-        }
-
-        // connect to these nodes
-        for (int i = 0; i < ctrl.node_size(); ++i) {
-          const auto& node = ctrl.node(i);
-          if (node.role() == Node::SERVER) ++num_servers_;
-          if (node.role() == Node::WORKER) ++num_workers_;
+          PackNode(node, &packed);
+          nodes.push_back(node);
           Connect(node);
-        }
 
-        if (num_servers_ == Postoffice::Get()->num_servers() &&
-            num_workers_ == Postoffice::Get()->num_workers()) {
-          if (is_scheduler_) {
-            nodes.mutable_control()->add_node()->CopyFrom(my_node_);
-            nodes.mutable_control()->set_cmd(Control::ADD_NODE);
-            Message back; back.meta = nodes;
-            for (int r : Postoffice::Get()->GetNodeIDs(
-                     kWorkerGroup + kServerGroup)) {
-              back.recver = r; Send_(back);
+          if (num_servers_ == Postoffice::Get()->num_servers() &&
+              num_workers_ == Postoffice::Get()->num_workers()) {
+            // the nodes are packed once and sent to all
+            PackNode(my_node_, &packed);
+            Message back;
+            back.meta.mutable_control()->set_cmd(Control::ADD_NODE);
+            back.meta.mutable_control()->set_packed_nodes(std::move(packed));
+            for (const auto& added : nodes) {
+              back.recver = added.id();
+              Send_(back);
             }
+            SetReady();
           }
-          ready_ = true;
-        }
-      } else if (ctrl.cmd() == Control::BARRIER) {
-        if (msg.meta.request()) {
-          if (barrier_count_.empty()) {
-            barrier_count_.resize(8,0);
-          }
-          CHECK(ctrl.has_barrier_group());
-          int group = ctrl.barrier_group();
-          ++ barrier_count_[group];
-          if (barrier_count_[group] ==
-              (int)Postoffice::Get()->GetNodeIDs(group).size()) {
-            barrier_count_[group] = 0;
-            Message res;
-            res.meta.set_request(false);
-            res.meta.mutable_control()->set_cmd(Control::BARRIER);
-            for (int r : Postoffice::Get()->GetNodeIDs(group)) {
-              res.recver = r;
-              CHECK_GT(Send_(res), 0);
+        } else {
+          std::vector<Node> received;
+          UnpackNodes(ctrl.packed_nodes(), &received);
+          // update my id
+          for (const auto& node : received) {
+            if (my_node_.hostname() == node.hostname() &&
+                my_node_.port() == node.port()) {
+              my_node_.set_id(node.id());
+              std::string rank = std::to_string(Postoffice::IDtoRank(node.id()));
+              setenv("DMLC_RANK", rank.c_str(), true);
             }
           }
-        } else {
-          Postoffice::Get()->Manage(msg);
+          Connect(received);
+          SetReady();
+        }
+      } else if (ctrl.cmd() == Control::BARRIER) {
+        barrier_->Process(msg);
+      } else if (ctrl.cmd() == Control::HEARTBEAT) {
+        std::lock_guard<std::mutex> lk(heartbeat_mu_);
+        if (!IsDead(msg.sender)) {
+          heartbeats_[msg.sender] = std::chrono::steady_clock::now();
+        }
+      } else if (ctrl.cmd() == Control::DEAD_NODE) {
+        for (int i = 0; i < ctrl.node_size(); ++i) {
+          MarkDead(ctrl.node(i).id());
         }
+        // the dead nodes will never reach the barriers
+        barrier_->Update();
+      }
+    } else if (msg.meta.batch()) {
+      std::vector<Message> msgs;
+      Coalescer::Unpack(msg, &msgs);
+      for (auto& m : msgs) {
+        ReadMeta(&m);
+        size_t bytes = 0;
+        for (const auto& data : m.data) bytes += data.size();
+        metrics->AddRecv(m, bytes);
+        Dispatch(&m);
+        if (shm_) shm_->CountReceived(msg.sender);
       }
     } else {
-      CHECK_NE(msg.sender, Message::kInvalidNode);
-      CHECK_NE(msg.recver, Message::kInvalidNode);
-      CHECK(msg.meta.has_customer_id());
-      int id = msg.meta.customer_id();
-      auto* obj = Postoffice::Get()->GetCustomer(id, 5);
-      CHECK(obj) << "timeout (5 sec) to wait App " << id << " ready";
-      obj->Accept(msg);
+      Dispatch(&msg);
+      // so the sender knows when it can go back to shared memory
+      if (shm_) shm_->CountReceived(msg.sender);
     }
   }
 }
 
+void Van::SetReady() {
+  std::lock_guard<std::mutex> lk(ready_mu_);
+  ready_ = true;
+  ready_cond_.notify_all();
+}
+
+void Van::Heartbeat() {
+  Message msg;
+  msg.recver = kScheduler;
+  msg.meta.mutable_control()->set_cmd(Control::HEARTBEAT);
+  std::unique_lock<std::mutex> lk(heartbeat_mu_);
+  while (!heartbeat_cond_.wait_for(lk, heartbeat_interval_,
+                                   [this] { return exit_.load(); })) {
+    lk.unlock();
+    Send_(msg);
+    lk.lock();
+  }
+}
+
 void Van::Monitoring() {
-  void *s = CHECK_NOTNULL(zmq_socket(context_, ZMQ_PAIR));
-  CHECK(!zmq_connect (s, "inproc://monitor"));
-  while (true) {
-    //  First frame in message contains event number and value
-    zmq_msg_t msg;
-    zmq_msg_init(&msg);
-    if (zmq_msg_recv(&msg, s, 0) == -1) {
-      if (errno == EINTR) continue;
-      break;
+  std::unique_lock<std::mutex> lk(heartbeat_mu_);
+  // the nodes are given a full timeout from now
+  auto start = std::chrono::steady_clock::now();
+  for (int r : Postoffice::Get()->GetNodeIDs(kWorkerGroup + kServerGroup)) {
+    heartbeats_[r] = start;
+  }
+  while (!heartbeat_cond_.wait_for(lk, heartbeat_interval_,
+                                   [this] { return exit_.load(); })) {
+    auto now = std::chrono::steady_clock::now();
+    Message msg;
+    msg.meta.mutable_control()->set_cmd(Control::DEAD_NODE);
+    for (auto it = heartbeats_.begin(); it != heartbeats_.end(); ) {
+      if (now - it->second > heartbeat_timeout_) {
+        LOG(WARNING) << "node " << it->first << " is dead, no heartbeat for "
+                     << std::chrono::duration_cast<std::chrono::seconds>(
+                         now - it->second).count() << " sec";
+        auto node = msg.meta.mutable_control()->add_node();
+        node->set_id(it->first);
+        const auto& servers = Postoffice::Get()->GetNodeIDs(kServerGroup);
+        bool is_server = std::find(servers.begin(), servers.end(),
+                                   it->first) != servers.end();
+        node->set_role(is_server ? Node::SERVER : Node::WORKER);
+        // before unlocking, so a late heartbeat does not bring it back
+        MarkDead(it->first);
+        it = heartbeats_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (msg.meta.control().node_size() == 0) continue;
+    lk.unlock();
+    // including myself, whose receiving thread updates the barriers
+    for (int r : Postoffice::Get()->GetNodeIDs(
+             kWorkerGroup + kServerGroup + kScheduler)) {
+      if (IsDead(r)) continue;
+      msg.recver = r;
+      Send_(msg);
     }
-    uint8_t *data = (uint8_t *)zmq_msg_data (&msg);
-    int event = *(uint16_t *)(data);
-    // int value = *(uint32_t *)(data + 2);
+    lk.lock();
+  }
+}
+
+bool Van::IsDead(int id) {
+  if (!has_dead_) return false;
+  std::lock_guard<std::mutex> lk(dead_mu_);
+  return dead_nodes_.count(id);
+}
 
-    // Second frame in message contains event address. it's just the router's
-    // address. no help
+void Van::MarkDead(int id) {
+  {
+    std::lock_guard<std::mutex> lk(dead_mu_);
+    if (!dead_nodes_.insert(id).second) return;
+    has_dead_ = true;
+  }
+  // fail the requests waiting for it
+  auto pending = pending_.Find(id);
+  if (!pending) return;
+  std::vector<std::pair<uint64_t, bool>> reqs;
+  {
+    std::lock_guard<std::mutex> lk(pending->mu);
+    reqs.assign(pending->reqs.begin(), pending->reqs.end());
+  }
+  for (const auto& req : reqs) {
+    Message msg;
+    msg.recver = id;
+    msg.meta.set_request(true);
+    msg.meta.set_customer_id(req.first >> 32);
+    msg.meta.set_timestamp((uint32_t)req.first);
+    msg.meta.set_simple_app(req.second);
+    ReportError(msg);
+  }
+}
 
-    if (event == ZMQ_EVENT_DISCONNECTED) {
-      // huh...
+void Van::AddPending(const Message& msg) {
+  auto pending = pending_.Find(msg.recver);
+  if (!pending) {
+    std::lock_guard<std::mutex> lk(pending_mu_);
+    pending = pending_.Find(msg.recver);
+    if (!pending) {
+      pending = std::make_shared<Pending>();
+      pending_.Put(msg.recver, pending);
     }
-    if (event == ZMQ_EVENT_MONITOR_STOPPED) break;
   }
-  zmq_close (s);
+  uint64_t key = ((uint64_t)msg.meta.customer_id() << 32) |
+                 (uint32_t)msg.meta.timestamp();
+  std::lock_guard<std::mutex> lk(pending->mu);
+  pending->reqs[key] = msg.meta.simple_app();
+}
+
+bool Van::RemovePending(const Message& msg) {
+  auto pending = pending_.Find(msg.sender);
+  if (!pending) return false;
+  uint64_t key = ((uint64_t)msg.meta.customer_id() << 32) |
+                 (uint32_t)msg.meta.timestamp();
+  std::lock_guard<std::mutex> lk(pending->mu);
+  return pending->reqs.erase(key);
+}
+
+void Van::ShmReceiving() {
+  while (true) {
+    Message msg;
+    int recv_bytes = shm_->RecvMsg(&msg);
+    if (recv_bytes < 0) break;
+    msg.recver = my_node_.id();
+    ReadMeta(&msg);
+    Postoffice::Get()->metrics()->AddRecv(msg, recv_bytes);
+    Dispatch(&msg);
+  }
+}
+
+void Van::Dispatch(Message* msg) {
+  CHECK_NE(msg->sender, Message::kInvalidNode);
+  CHECK_NE(msg->recver, Message::kInvalidNode);
+  CHECK(msg->meta.has_customer_id());
+  // a request gets exactly one response, the real one or the one made up
+  // when its receiver died
+  if (heartbeat_interval_.count() && !msg->meta.request() &&
+      !RemovePending(*msg)) {
+    return;
+  }
+  int id = msg->meta.customer_id();
+  if (!dispatch_queues_.empty()) {
+    // node ids interleave by role, so mix the bits before sharding
+    uint64_t key = (uint64_t)msg->sender * 1000003 + id;
+    size_t shard =
+        ((key * 0x9E3779B97F4A7C15ULL) >> 32) % dispatch_queues_.size();
+    dispatch_queues_[shard]->Push(std::move(*msg));
+    return;
+  }
+  Compressor::Decompress(msg);
+  Postoffice::Get()->Deliver(msg);
+}
+
+void Van::ReadMeta(Message* msg) {
+  const auto& raw = msg->raw_meta;
+  // the dispatching threads decode the rest of the meta of a data message
+  if (!dispatch_queues_.empty() &&
+      MetaCodec::Peek(raw.data(), raw.size(), &msg->meta)) {
+    return;
+  }
+  MetaCodec::Decode(msg);
+}
+
+void Van::Dispatching(int shard) {
+  auto& queue = dispatch_queues_[shard];
+  while (true) {
+    Message msg;
+    queue->WaitAndPop(&msg);
+    if (msg.meta.has_control()) break;
+    if (!msg.raw_meta.empty()) MetaCodec::Decode(&msg);
+    Compressor::Decompress(&msg);
+    Postoffice::Get()->Deliver(&msg);
+  }
 }
 
 }  // namespace ps
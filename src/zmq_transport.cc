@@ -0,0 +1,247 @@
+#include "ps/internal/zmq_transport.h"
+#include <zmq.h>
+#include <unistd.h>
+#include <cstring>
+#include "ps/sarray.h"
+#include "ps/internal/buffer_pool.h"
+#include "ps/internal/meta_codec.h"
+
+namespace ps {
+
+ZMQTransport::ZMQTransport() {
+  context_ = zmq_ctx_new();
+  CHECK(context_ != NULL) << "create 0mq context failed";
+  zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+  zmq_ctx_set(context_, ZMQ_IO_THREADS, GetEnv("DMLC_PS_ZMQ_IO_THREADS", 1));
+}
+
+int ZMQTransport::Bind(const Node& node, int max_retry) {
+  receiver_ = zmq_socket(context_, ZMQ_ROUTER);
+  CHECK(receiver_ != NULL)
+      << "create receiver socket failed: " << zmq_strerror(errno);
+  int local = GetEnv("DMLC_LOCAL", 0);
+  int port = node.port();
+  if (port == 0 && !local) {
+    // let the system pick the port
+    if (zmq_bind(receiver_, "tcp://*:*") != 0) {
+      LOG(WARNING) << "bind failed: " << zmq_strerror(errno);
+      return -1;
+    }
+    char endpoint[256];
+    size_t size = sizeof(endpoint);
+    CHECK_EQ(zmq_getsockopt(receiver_, ZMQ_LAST_ENDPOINT, endpoint, &size), 0);
+    return atoi(strrchr(endpoint, ':') + 1);
+  }
+
+  std::string addr = local ? "ipc:///tmp/" : "tcp://*:";
+  for (int i = 0; i < max_retry; ++i) {
+    if (port != 0) {
+      auto address = addr + std::to_string(port);
+      if (zmq_bind(receiver_, address.c_str()) == 0) return port;
+    }
+    port = RandomPort();
+    // binding ipc removes the existing file, which may be of a live node
+    if (local && access(("/tmp/" + std::to_string(port)).c_str(), F_OK) == 0) {
+      port = 0;
+    }
+  }
+  LOG(WARNING) << "bind failed after " << max_retry << " retries";
+  return -1;
+}
+
+void ZMQTransport::Stop() {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& sender : senders_.Clear()) {
+      std::lock_guard<std::mutex> slk(sender->mu);
+      zmq_close(sender->socket);
+      sender->socket = nullptr;
+    }
+  }
+  zmq_close(receiver_);
+  zmq_ctx_destroy(context_);
+}
+
+bool ZMQTransport::Connect(const Node& node, int my_id) {
+  std::lock_guard<std::mutex> lk(mu_);
+  int id = node.id();
+
+  void *sender = zmq_socket(context_, ZMQ_DEALER);
+  CHECK(sender != NULL)
+      << zmq_strerror(errno)
+      << ". it often can be solved by \"sudo ulimit -n 65536\""
+      << " or edit /etc/security/limits.conf";
+
+  if (my_id != Message::kInvalidNode) {
+    std::string my_id_str = "ps" + std::to_string(my_id);
+    zmq_setsockopt(sender, ZMQ_IDENTITY, my_id_str.data(), my_id_str.size());
+  }
+  // do not block Stop forever on the messages to a dead node
+  int linger = 1000;
+  zmq_setsockopt(sender, ZMQ_LINGER, &linger, sizeof(linger));
+
+  // connect
+  std::string addr = "tcp://" + node.hostname() + ":" + std::to_string(node.port());
+  if (GetEnv("DMLC_LOCAL", 0)) {
+    addr = "ipc:///tmp/" + std::to_string(node.port());
+  }
+
+  if (zmq_connect(sender, addr.c_str()) != 0) {
+    LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
+  }
+
+  // sends to other nodes go on while replacing the socket
+  auto existing = senders_.Find(id);
+  if (existing) {
+    std::lock_guard<std::mutex> slk(existing->mu);
+    zmq_close(existing->socket);
+    existing->socket = sender;
+  } else {
+    auto s = std::make_shared<Sender>();
+    s->socket = sender;
+    senders_.Put(id, s);
+  }
+  return true;
+}
+
+/**
+ * \brief be smart on freeing recved data
+ */
+void FreeData(void *data, void *hint) {
+  if (hint == NULL) {
+    delete [] (char*)data;
+  } else {
+    delete (SArray<char>*)hint;
+  }
+}
+
+/**
+ * \brief zero-copy, move a received frame into a block of the pool, which is
+ * kept until arr is released
+ */
+void KeepFrame(zmq_msg_t* zmsg, SArray<char>* arr) {
+  auto pool = BufferPool::Get();
+  size_t size = zmq_msg_size(zmsg);
+  zmq_msg_t* frame = new (pool->AllocBlock(sizeof(zmq_msg_t))) zmq_msg_t;
+  CHECK(zmq_msg_init(frame) == 0) << zmq_strerror(errno);
+  CHECK(zmq_msg_move(frame, zmsg) == 0) << zmq_strerror(errno);
+  zmq_msg_close(zmsg);
+  // a small frame is stored in the zmq_msg_t, so take its data again
+  pool->Wrap((char *)zmq_msg_data(frame), size, [frame](char*) {
+      zmq_msg_close(frame);
+      BufferPool::Get()->FreeBlock(frame, sizeof(zmq_msg_t));
+    }, arr);
+}
+
+int ZMQTransport::SendMsg(const Message& msg) {
+  // find the socket
+  int id = msg.recver;
+  auto sender = senders_.Find(id);
+  if (!sender) {
+    LOG(WARNING) << "there is no socket to node " << id;
+    return -1;
+  }
+
+  // send meta, a compact one fits in the message itself without allocating
+  int meta_size = MetaCodec::Size(msg.meta);
+  zmq_msg_t meta_msg;
+  CHECK_EQ(zmq_msg_init_size(&meta_msg, meta_size), 0) << zmq_strerror(errno);
+  MetaCodec::Encode(msg.meta, meta_size, (char*)zmq_msg_data(&meta_msg));
+
+  // only the sends to the same node are serialized
+  std::lock_guard<std::mutex> lk(sender->mu);
+  void *socket = sender->socket;
+  if (!socket) {
+    zmq_msg_close(&meta_msg);
+    return -1;
+  }
+
+  int tag = ZMQ_SNDMORE;
+  int n = msg.data.size();
+  if (n == 0) tag = 0;
+
+  while (true) {
+    if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
+    if (errno == EINTR) continue;
+    LOG(WARNING) << "failed to send message to node [" << id
+                 << "] errno: " << errno << " " << zmq_strerror(errno);
+    zmq_msg_close(&meta_msg);
+    return -1;
+  }
+  int send_bytes = meta_size;
+
+  // send data
+  for (int i = 0; i < n; ++i) {
+    zmq_msg_t data_msg;
+    SArray<char>* data = new SArray<char>(msg.data[i]);
+    int data_size = data->size();
+    zmq_msg_init_data(&data_msg, data->data(), data->size(), FreeData, data);
+    if (i == n - 1) tag = 0;
+    while (true) {
+      if (zmq_msg_send(&data_msg, socket, tag) == data_size) break;
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << errno << " " << zmq_strerror(errno)
+                   << ". " << i << "/" << n << ": " << msg.meta.ShortDebugString();
+      return -1;
+    }
+    send_bytes += data_size;
+  }
+  return send_bytes;
+}
+
+int ZMQTransport::GetNodeID(const char* buf, size_t size) {
+  if (size > 2 && buf[0] == 'p' && buf[1] == 's') {
+    int id = 0;
+    size_t i = 2;
+    for (; i < size; ++i) {
+      if (buf[i] >= '0' && buf[i] <= '9') {
+        id = id * 10 + buf[i] - '0';
+      } else {
+        break;
+      }
+    }
+    if (i == size) return id;
+  }
+  return Message::kInvalidNode;
+}
+
+int ZMQTransport::RecvMsg(Message* msg) {
+  msg->data.clear();
+  size_t recv_bytes = 0;
+  for (int i = 0; ; ++i) {
+    zmq_msg_t zmsg;
+    CHECK(zmq_msg_init(&zmsg) == 0) << zmq_strerror(errno);
+    while (true) {
+      if (zmq_msg_recv(&zmsg, receiver_, 0) != -1) break;
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to receive message. errno: "
+                   << errno << " " << zmq_strerror(errno);
+      zmq_msg_close(&zmsg);
+      return -1;
+    }
+    char* buf = CHECK_NOTNULL((char *)zmq_msg_data(&zmsg));
+    size_t size = zmq_msg_size(&zmsg);
+    bool more = zmq_msg_more(&zmsg);
+    recv_bytes += size;
+
+    if (i == 0) {
+      // identify
+      msg->sender = GetNodeID(buf, size);
+      CHECK(more);
+      zmq_msg_close(&zmsg);
+    } else if (i == 1) {
+      // task, decoded by the caller
+      KeepFrame(&zmsg, &msg->raw_meta);
+      if (!more) break;
+    } else {
+      SArray<char> data;
+      KeepFrame(&zmsg, &data);
+      msg->data.push_back(std::move(data));
+      if (!more) break;
+    }
+  }
+  return recv_bytes;
+}
+
+}  // namespace ps
@@ -0,0 +1,27 @@
+/**
+ * \brief benchmark starting and finalizing a cluster
+ *
+ * usage: bench_bootstrap
+ *
+ * the scheduler reports the time from its start until all nodes are added
+ * and the barrier of \ref Start is passed, and the time of \ref Finalize. see
+ * tests/bench_bootstrap.sh to launch many nodes on the local machine
+ */
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  auto start = std::chrono::steady_clock::now();
+  Start();
+  auto started = std::chrono::steady_clock::now();
+  Finalize();
+  auto finalized = std::chrono::steady_clock::now();
+  if (IsScheduler()) {
+    typedef std::chrono::duration<double, std::milli> ms;
+    LL << "scheduler: " << NumServers() + NumWorkers() << " nodes, start "
+       << ms(started - start).count() << " ms, finalize "
+       << ms(finalized - started).count() << " ms";
+  }
+  return 0;
+}
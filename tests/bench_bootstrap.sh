@@ -0,0 +1,15 @@
+#!/bin/bash
+# time the bootstrap of many nodes on the local machine
+# usage: ./tests/bench_bootstrap.sh num_servers num_workers
+if [ $# -lt 2 ]; then
+    echo "usage: $0 num_servers num_workers"
+    exit -1;
+fi
+
+dir=`dirname "$0"`
+for van in ${VAN_TYPES:-zmq tcp}; do
+    echo "${van}:"
+    start=`date +%s%N`
+    DMLC_PS_VAN_TYPE=${van} ${dir}/local.sh $1 $2 ${dir}/bench_bootstrap 2>&1 | grep "scheduler"
+    echo "all nodes exited in $(( (`date +%s%N` - start) / 1000000 )) ms"
+done
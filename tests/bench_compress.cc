@@ -0,0 +1,83 @@
+/**
+ * \brief the ratio and speed of the codecs of \ref Compressor
+ *
+ * usage: bench_compress [num_vals] [repeat]
+ *
+ * runs the codecs on a few kinds of synthetic data and checks that the data
+ * survive the round trip. it does not start the system
+ */
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/compressor.h"
+using namespace ps;
+
+template <typename V>
+void Run(const std::string& name, const SArray<V>& vals, int repeat) {
+  for (int codec : {LZ, FLOAT_SHUFFLE}) {
+    Message msg;
+    msg.meta.set_compression(codec);
+    msg.AddData(vals);
+    double comp = 0, decomp = 0;
+    size_t size = 0;
+    for (int i = 0; i < repeat; ++i) {
+      Message m = msg;
+      auto start = std::chrono::steady_clock::now();
+      Compressor::Compress(&m);
+      auto mid = std::chrono::steady_clock::now();
+      size = m.data[0].size();
+      Compressor::Decompress(&m);
+      auto end = std::chrono::steady_clock::now();
+      comp += std::chrono::duration<double>(mid - start).count();
+      decomp += std::chrono::duration<double>(end - mid).count();
+      const auto& in = msg.data[0];
+      const auto& out = m.data[0];
+      CHECK_EQ(out.size(), in.size());
+      CHECK_EQ(memcmp(out.data(), in.data(), in.size()), 0) << "corrupted";
+    }
+    double mb = (double)repeat * msg.data[0].size() / 1e6;
+    LL << name << (codec == LZ ? " lz: " : " float_shuffle: ")
+       << (double)msg.data[0].size() / size << "x, compress " << mb / comp
+       << " MB/sec, decompress " << mb / decomp << " MB/sec";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  int repeat = argc > 2 ? atoi(argv[2]) : 10;
+  std::mt19937 gen(0);
+  std::normal_distribution<float> normal;
+
+  // 90% of the values are zero
+  SArray<float> sparse(n, 0);
+  for (int i = 0; i < n; ++i) if (gen() % 10 == 0) sparse[i] = normal(gen);
+  Run("sparse gradient", sparse, repeat);
+
+  // the sums of a few pushes of small integers, like the values kept by
+  // KVServerDefaultHandle in tests/test_kv_app.cc
+  SArray<float> sums(n);
+  for (int i = 0; i < n; ++i) sums[i] = (float)(gen() % 4) * (i % 100);
+  Run("pushed sums", sums, repeat);
+
+  // slowly changing values kept in half precision
+  SArray<float> embedding(n);
+  float v = 0;
+  for (int i = 0; i < n; ++i) {
+    v += normal(gen) * 0.01f;
+    uint32_t bits; memcpy(&bits, &v, 4); bits &= 0xFFFFE000;
+    memcpy(&embedding[i], &bits, 4);
+  }
+  Run("embedding", embedding, repeat);
+
+  SArray<float> random(n);
+  for (int i = 0; i < n; ++i) random[i] = normal(gen);
+  Run("random", random, repeat);
+
+  SArray<Key> keys(n);
+  Key k = 0;
+  for (int i = 0; i < n; ++i) keys[i] = k += gen() % 100;
+  Run("sorted keys", keys, repeat);
+  return 0;
+}
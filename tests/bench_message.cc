@@ -0,0 +1,59 @@
+/**
+ * \brief the messages per second through the receiving path of a node
+ *
+ * usage: bench_message [num_keys] [num_msgs]
+ *
+ * a thread hands push requests to \ref Postoffice as the receiving thread of
+ * the van does, and they go through the queue of the customer and the
+ * processing of \ref KVServer, whose handle only counts them. it does not
+ * start the system, so no network is involved
+ */
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+#include "ps/internal/futex.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  int num_keys = argc > 1 ? atoi(argv[1]) : 16;
+  int num_msgs = argc > 2 ? atoi(argv[2]) : 1000000;
+  setenv("DMLC_NUM_WORKER", "1", 0);
+  setenv("DMLC_NUM_SERVER", "1", 0);
+  setenv("DMLC_ROLE", "server", 0);
+
+  std::atomic<int> count{0};
+  std::atomic<uint32_t> done{0};
+  KVServer<float> server(0);
+  server.set_request_handle([&](const KVMeta& meta, const KVPairs<float>& data,
+                                KVServer<float>* server) {
+      CHECK_EQ(data.keys.size(), (size_t)num_keys);
+      if (++count == num_msgs) {
+        done = 1;
+        FutexWake(&done);
+      }
+    });
+
+  SArray<Key> keys(num_keys);
+  SArray<float> vals(num_keys);
+  for (int i = 0; i < num_keys; ++i) keys[i] = i;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_msgs; ++i) {
+    Message msg;
+    msg.sender = 9;
+    msg.recver = 8;
+    msg.meta.set_customer_id(0);
+    msg.meta.set_request(true);
+    msg.meta.set_push(true);
+    msg.meta.set_timestamp(i);
+    msg.AddData(keys);
+    msg.AddData(vals);
+    Postoffice::Get()->Deliver(&msg);
+  }
+  while (!done) FutexWait(&done, 0);
+  double sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  LL << num_msgs << " messages of " << num_keys << " keys: "
+     << num_msgs / sec / 1e6 << " M messages/sec";
+  return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * \brief the cost of encoding and decoding the meta of a message
+ *
+ * usage: bench_meta [repeat]
+ *
+ * compares protobuf with the compact layout used by \ref MetaCodec on the
+ * meta of a typical push request and its response. then counts the heap
+ * allocations per message of building, encoding and decoding messages in a
+ * steady state, where \ref MetaPool recycles the metas. it does not start
+ * the system
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/meta_codec.h"
+using namespace ps;
+
+/** \brief the number of calls of operator new */
+static std::atomic<uint64_t> num_allocs{0};
+
+void* operator new(size_t size) {
+  ++num_allocs;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+template <typename F>
+double NanoSecPerMsg(int repeat, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i) f(i);
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / repeat;
+}
+
+void Run(const std::string& name, const MetaMessage& meta, int repeat) {
+  std::vector<char> buf(1024);
+  double pb_enc = NanoSecPerMsg(repeat, [&](int i) {
+      int size = meta.ByteSize();
+      CHECK(meta.SerializeToArray(buf.data(), size));
+    });
+  int pb_size = meta.ByteSize();
+  double pb_dec = NanoSecPerMsg(repeat, [&](int i) {
+      MetaMessage out;
+      CHECK(out.ParseFromArray(buf.data(), pb_size));
+    });
+
+  double enc = NanoSecPerMsg(repeat, [&](int i) {
+      int size = MetaCodec::Size(meta);
+      MetaCodec::Encode(meta, size, buf.data());
+    });
+  int size = MetaCodec::Size(meta);
+  double dec = NanoSecPerMsg(repeat, [&](int i) {
+      MetaMessage out;
+      CHECK(MetaCodec::Decode(buf.data(), size, &out));
+    });
+
+  LL << name << ": protobuf " << pb_size << " bytes, encode " << pb_enc
+     << " ns, decode " << pb_dec << " ns; compact " << size
+     << " bytes, encode " << enc << " ns, decode " << dec << " ns";
+}
+
+int main(int argc, char *argv[]) {
+  int repeat = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  MetaMessage push;
+  push.set_head(0);
+  push.set_customer_id(0);
+  push.set_timestamp(123456);
+  push.set_request(true);
+  push.set_push(true);
+  push.add_data_type(UINT64);
+  push.add_data_type(FLOAT);
+  push.add_data_type(INT32);
+  Run("push request", push, repeat);
+
+  MetaMessage resp;
+  resp.set_head(0);
+  resp.set_customer_id(0);
+  resp.set_timestamp(123456);
+  resp.set_push(true);
+  Run("push response", resp, repeat);
+
+  // a worker builds and sends pushes, a server receives them
+  SArray<Key> keys(16);
+  SArray<float> vals(16);
+  std::vector<char> buf(1024);
+  uint64_t build = 0, decode = 0;
+  int warmup = 1000;
+  for (int i = 0; i < warmup + repeat; ++i) {
+    if (i == warmup) build = decode = 0;
+    uint64_t start = num_allocs;
+    int size;
+    {
+      Message msg;
+      msg.meta.set_customer_id(0);
+      msg.meta.set_timestamp(i);
+      msg.meta.set_request(true);
+      msg.meta.set_push(true);
+      // as KVWorker::Send, the data vector takes 2 allocations
+      msg.AddData(keys);
+      msg.AddData(vals);
+      size = MetaCodec::Size(msg.meta);
+      MetaCodec::Encode(msg.meta, size, buf.data());
+    }
+    uint64_t mid = num_allocs;
+    {
+      Message msg;
+      CHECK(MetaCodec::Decode(buf.data(), size, &msg.meta));
+    }
+    build += mid - start;
+    decode += num_allocs - mid;
+  }
+  auto stats = MetaPool::GetStats();
+  LL << "steady state: building and encoding " << (double)build / repeat
+     << " allocations per message (2 of the data vector), decoding "
+     << (double)decode / repeat << "; meta pool hits " << stats.hits
+     << ", misses " << stats.misses << ", drops " << stats.drops;
+  return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * \brief the throughput of the queues between threads
+ *
+ * usage: bench_queue [num_producers] [num_items]
+ *
+ * producers push num_items in total to one consumer, through the locked \ref
+ * ThreadsafeQueue and the lock-free \ref MPSCQueue, popping one by one or in
+ * batches. the last line pushes messages through \ref
+ * ThreadsafePriorityQueue, as the receiving threads do. it does not start the
+ * system
+ */
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpsc_queue.h"
+#include "ps/internal/priority_queue.h"
+using namespace ps;
+
+/**
+ * \brief run the producers and the consumer, return million items per sec
+ * \param pop pops at least one item into the vector, returns the number
+ */
+template <typename T, typename Q, typename P>
+double Run(int num_producers, int num_items, Q* queue, P pop) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.emplace_back([=]() {
+        for (int i = p; i < num_items; i += num_producers) queue->Push(T());
+      });
+  }
+  std::vector<T> items;
+  for (int n = 0; n < num_items; ) {
+    items.clear();
+    n += pop(&items);
+  }
+  for (auto& t : producers) t.join();
+  double sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  return num_items / sec / 1e6;
+}
+
+void Report(const std::string& name, double mops) {
+  LL << name << ": " << mops << " M items/sec";
+}
+
+int main(int argc, char *argv[]) {
+  int num_producers = argc > 1 ? atoi(argv[1]) : 4;
+  int num_items = argc > 2 ? atoi(argv[2]) : 2000000;
+  LL << num_producers << " producers, " << num_items << " items";
+
+  {
+    ThreadsafeQueue<int64_t> queue;
+    Report("locked, one by one", Run<int64_t>(
+        num_producers, num_items, &queue, [&](std::vector<int64_t>* items) {
+          items->emplace_back();
+          queue.WaitAndPop(&items->back());
+          return 1;
+        }));
+  }
+  {
+    ThreadsafeQueue<int64_t> queue;
+    Report("locked, batch", Run<int64_t>(
+        num_producers, num_items, &queue, [&](std::vector<int64_t>* items) {
+          items->emplace_back();
+          queue.WaitAndPop(&items->back());
+          return 1 + queue.PopAll(items);
+        }));
+  }
+  {
+    MPSCQueue<int64_t> queue;
+    Report("lock-free, one by one", Run<int64_t>(
+        num_producers, num_items, &queue, [&](std::vector<int64_t>* items) {
+          items->emplace_back();
+          queue.WaitAndPop(&items->back());
+          return 1;
+        }));
+  }
+  {
+    MPSCQueue<int64_t> queue;
+    Report("lock-free, batch", Run<int64_t>(
+        num_producers, num_items, &queue, [&](std::vector<int64_t>* items) {
+          items->emplace_back();
+          queue.WaitAndPop(&items->back());
+          return 1 + queue.PopAll(items);
+        }));
+  }
+  {
+    ThreadsafePriorityQueue queue;
+    Report("messages by priority", Run<Message>(
+        num_producers, num_items / 4, &queue, [&](std::vector<Message>* items) {
+          items->emplace_back();
+          queue.WaitAndPop(&items->back());
+          return 1;
+        }));
+  }
+  return 0;
+}
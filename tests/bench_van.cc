@@ -0,0 +1,97 @@
+/**
+ * \brief benchmark the transport engines on loopback
+ *
+ * usage: bench_van [num_keys] [val_len] [repeat] [window] [compression]
+ *
+ * each worker pushes and then pulls num_keys keys with val_len floats per
+ * key, repeat times with at most window (16 in default) requests in flight. the engine is chosen
+ * by DMLC_PS_VAN_TYPE, see tests/bench_van.sh. compression is a \ref
+ * Compression, 0 in default. at last it prints the counters of the \ref
+ * BufferPool of the worker
+ */
+#include <chrono>
+#include "ps/ps.h"
+#include "ps/internal/buffer_pool.h"
+using namespace ps;
+
+/**
+ * \brief ignores the pushed values and returns 0, 1, ..., val_len-1 per key for
+ * pull
+ */
+struct BenchHandle {
+  void operator()(
+      const KVMeta& req_meta, const KVPairs<float>& req_data, KVServer<float>* server) {
+    KVPairs<float> res;
+    if (!req_meta.push) {
+      res.keys = req_data.keys;
+      res.lens.resize(res.keys.size(), val_len);
+      res.vals.resize(res.keys.size() * val_len, 0);
+      for (size_t i = 0; i < res.vals.size(); ++i) res.vals[i] = i % val_len;
+    }
+    server->Response(req_meta, res);
+  }
+  int val_len;
+};
+
+void StartServer(int val_len) {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(BenchHandle{val_len});
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker(int num_keys, int val_len, int repeat, int window,
+               int compression) {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+  kv.set_compression((Compression)compression);
+
+  SArray<Key> keys(num_keys);
+  for (int i = 0; i < num_keys; ++i) keys[i] = kMaxKey / num_keys * i;
+  SArray<float> vals(num_keys * val_len, 1);
+  SArray<int> lens(num_keys, val_len);
+
+  // a pull buffer for each request in flight
+  std::vector<SArray<float>> rets(window);
+  std::vector<SArray<int>> rets_lens(window);
+  auto run = [&](bool push) {
+    std::vector<int> ts;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i) {
+      if (i >= window) kv.Wait(ts[i - window]);
+      ts.push_back(push ? kv.ZPush(keys, vals, lens) :
+                   kv.ZPull(keys, &rets[i % window], &rets_lens[i % window]));
+    }
+    for (int i = std::max(0, repeat - window); i < repeat; ++i) kv.Wait(ts[i]);
+    double sec = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    double mb = (double)repeat * vals.size() * sizeof(float) / 1e6;
+    LL << "worker " << MyRank() << (push ? " push: " : " pull: ")
+       << repeat / sec << " requests/sec, " << mb / sec << " MB/sec";
+  };
+  run(true);
+  run(false);
+  for (int i = 0; i < std::min(repeat, window); ++i) {
+    for (size_t j = 0; j < rets[i].size(); ++j) {
+      CHECK_EQ(rets[i][j], j % val_len) << "wrong pulled value";
+    }
+  }
+  auto stats = BufferPool::Get()->GetStats();
+  LL << "worker " << MyRank() << " buffer pool: " << stats.hits << " hits, "
+     << stats.misses << " misses, blocks: " << stats.block_hits << " hits, "
+     << stats.block_misses << " misses";
+}
+
+int main(int argc, char *argv[]) {
+  int num_keys = argc > 1 ? atoi(argv[1]) : 10;
+  int val_len = argc > 2 ? atoi(argv[2]) : 1;
+  int repeat = argc > 3 ? atoi(argv[3]) : 20000;
+  int window = argc > 4 ? atoi(argv[4]) : 16;
+  int compression = argc > 5 ? atoi(argv[5]) : 0;
+
+  StartServer(val_len);
+  Start();
+  RunWorker(num_keys, val_len, repeat, window, compression);
+  Finalize();
+  return 0;
+}
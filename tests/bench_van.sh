@@ -0,0 +1,13 @@
+#!/bin/bash
+# compare the transport engines on loopback
+# usage: ./tests/bench_van.sh num_servers num_workers [num_keys val_len repeat window]
+if [ $# -lt 2 ]; then
+    echo "usage: $0 num_servers num_workers [num_keys val_len repeat window]"
+    exit -1;
+fi
+
+dir=`dirname "$0"`
+for van in ${VAN_TYPES:-zmq tcp uring}; do
+    echo "${van}:"
+    DMLC_PS_VAN_TYPE=${van} ${dir}/local.sh $1 $2 ${dir}/bench_van ${@:3} 2>&1 | grep "worker"
+done
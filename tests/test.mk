@@ -1,8 +1,11 @@
 TEST_SRC = $(wildcard tests/test_*.cc)
 TEST = $(patsubst tests/test_%.cc, tests/test_%, $(TEST_SRC))
 
+BENCH_SRC = $(wildcard tests/bench_*.cc)
+BENCH = $(patsubst tests/bench_%.cc, tests/bench_%, $(BENCH_SRC))
+
 # -ltcmalloc_and_profiler
-LDFLAGS = -Wl,-rpath,$(DEPS_PATH)/lib $(PS_LDFLAGS_SO) -pthread
+LDFLAGS = -Wl,-rpath,$(DEPS_PATH)/lib $(PS_LDFLAGS_SO) -pthread -lrt
 tests/% : tests/%.cc build/libps.a
 	$(CXX) -std=c++0x $(CFLAGS) -MM -MT tests/$* $< >tests/$*.d
 	$(CXX) -std=c++0x $(CFLAGS) -o $@ $(filter %.cc %.a, $^) $(LDFLAGS)
@@ -0,0 +1,43 @@
+/**
+ * \brief back-to-back barriers on different groups
+ *
+ * in every round, each worker adds 1 to a key on the servers, then all nodes
+ * in the group of that round barrier, and the workers check that all adds
+ * are seen. the trees are made deep by a small fanout
+ */
+#include "ps/ps.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  setenv("DMLC_PS_BARRIER_FANOUT", "2", 0);
+  if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+    RegisterExitCallback([server](){ delete server; });
+  }
+  Start();
+
+  const int groups[] = {kWorkerGroup, kWorkerGroup + kServerGroup,
+                        kWorkerGroup + kScheduler,
+                        kWorkerGroup + kServerGroup + kScheduler};
+  int repeat = 50;
+  KVWorker<float>* kv = IsWorker() ? new KVWorker<float>(0) : nullptr;
+  std::vector<Key> keys = {1};
+  std::vector<float> ones = {1};
+  for (int i = 0; i < repeat; ++i) {
+    int group = groups[i % 4];
+    if (kv) kv->Wait(kv->Push(keys, ones));
+    if (IsServer() && !(group & kServerGroup)) continue;
+    if (IsScheduler() && !(group & kScheduler)) continue;
+    Postoffice::Get()->Barrier(group);
+    if (kv) {
+      std::vector<float> vals;
+      kv->Wait(kv->Pull(keys, &vals));
+      CHECK_GE(vals[0], (float)(i + 1) * NumWorkers()) << "round " << i;
+    }
+  }
+  if (kv) LL << "worker " << MyRank() << " passed " << repeat << " barriers";
+  delete kv;
+  Finalize();
+  return 0;
+}
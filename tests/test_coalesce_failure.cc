@@ -0,0 +1,63 @@
+/**
+ * \brief the requests packed into a batch which fails to send are failed
+ *
+ * the server of rank 0 quits without finalizing. a push is sent to find the
+ * connection to it broken, then the later pushes are packed into batches
+ * whose sending fails, and must fail long before the heartbeats find the
+ * server dead. zmq queues the messages to a dead node, so there only the
+ * heartbeats fail them
+ */
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+  int num = 100;
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+
+  // gets the reset of the dead server, its response comes from the heartbeats
+  sleep(1);
+  kv.Push(keys, vals);
+  usleep(200000);
+
+  const char* type = getenv("DMLC_PS_VAN_TYPE");
+  bool queued = !type || std::string(type) == "zmq";
+  for (int i = 0; i < 10; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    bool called = false;
+    int ts = kv.Push(keys, vals, {}, 0, [&called]() { called = true; });
+    kv.Wait(ts);
+    CHECK(kv.Failed(ts)) << "round " << i;
+    CHECK(called) << "the callback should run for a failed request";
+    if (!queued) {
+      CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+          << "the failed batch is not reported";
+    }
+  }
+  LL << "worker " << MyRank() << " passed";
+}
+
+int main(int argc, char *argv[]) {
+  setenv("DMLC_PS_COALESCE_BYTES", "65536", 0);
+  setenv("DMLC_PS_SHM", "0", 1);
+  // long enough to tell the failed sends from the dead server found
+  setenv("DMLC_PS_HEARTBEAT_INTERVAL", "1", 0);
+  setenv("DMLC_PS_HEARTBEAT_TIMEOUT", "10", 0);
+  StartServer();
+  Start();
+  if (IsServer() && MyRank() == 0) _exit(0);
+  RunWorker();
+  Finalize();
+  return 0;
+}
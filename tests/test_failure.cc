@@ -0,0 +1,60 @@
+/**
+ * \brief the requests to a dead server fail instead of waiting forever
+ *
+ * the server of rank 0 quits without finalizing. workers keep pulling until
+ * the scheduler finds it dead by its missing heartbeats, then the pending
+ * and the later requests fail, and the others can still finalize.
+ */
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+  int num = 1000;
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+
+  auto start = std::chrono::steady_clock::now();
+  while (true) {
+    std::vector<float> rets;
+    bool called = false;
+    int ts = kv.Pull(keys, &rets, nullptr, 0, [&called]() { called = true; });
+    kv.Wait(ts);
+    if (kv.Failed(ts)) {
+      CHECK(called) << "the callback should run for a failed request";
+      CHECK(rets.empty()) << "a failed pull should not touch vals";
+      break;
+    }
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+        << "the dead server is not detected";
+    usleep(100000);
+  }
+  LL << "worker " << MyRank() << " found the dead server";
+
+  // a later request fails at once
+  int ts = kv.Push(keys, vals);
+  kv.Wait(ts);
+  CHECK(kv.Failed(ts));
+}
+
+int main(int argc, char *argv[]) {
+  // find the dead server quickly
+  setenv("DMLC_PS_HEARTBEAT_INTERVAL", "1", 0);
+  setenv("DMLC_PS_HEARTBEAT_TIMEOUT", "2", 0);
+  StartServer();
+  Start();
+  if (IsServer() && MyRank() == 0) _exit(0);
+  RunWorker();
+  Finalize();
+  return 0;
+}
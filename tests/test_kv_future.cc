@@ -0,0 +1,98 @@
+/**
+ * \brief pushes and pulls by futures
+ *
+ * each worker pipelines rounds of push then pull chained by Then and
+ * WhenAll, and checks the values pulled. with C++20 coroutines, the rounds
+ * are also run by a coroutine awaiting the futures
+ */
+#include "ps/ps.h"
+using namespace ps;
+
+#ifdef PS_USE_COROUTINE
+/** \brief a coroutine started at once, and finishing a future when done */
+struct Task {
+  struct promise_type {
+    Future done = Future::Create();
+    Task get_return_object() { return Task{done}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() { done.Finish(); }
+    void unhandled_exception() { std::terminate(); }
+  };
+  Future done;
+};
+
+Task RunRounds(KVWorker<float>* kv, const std::vector<Key>& keys,
+               const std::vector<float>& vals, int repeat, float base) {
+  std::vector<float> rets;
+  for (int i = 0; i < repeat; ++i) {
+    CHECK(co_await kv->PushAsync(keys, vals));
+    rets.clear();
+    CHECK(co_await kv->PullAsync(keys, &rets));
+    CHECK_EQ(rets.size(), keys.size());
+    CHECK_GE(rets[0], base + vals[0] * (i + 1));
+  }
+}
+#endif
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+
+  int num = 1000;
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+
+  // pushes in flight, then a pull once all of them finished
+  int repeat = 100;
+  std::vector<Future> pushes;
+  for (int i = 0; i < repeat; ++i) pushes.push_back(kv.PushAsync(keys, vals));
+  std::vector<float> rets;
+  std::atomic<int> chained{0};
+  Future pull = Future::WhenAll(pushes).Then([&]() { ++chained; });
+  pull.Wait();
+  CHECK(!pull.failed());
+  CHECK_EQ(chained.load(), 1);
+  Postoffice::Get()->Barrier(kWorkerGroup);
+  kv.PullAsync(keys, &rets).Wait();
+  for (int i = 0; i < num; ++i) {
+    CHECK_EQ(rets[i], (float)repeat * NumWorkers()) << i;
+  }
+  Postoffice::Get()->Barrier(kWorkerGroup);
+
+  // a push chained by a pull, made on the receiving thread
+  std::vector<float> rets2;
+  Future push = kv.PushAsync(keys, vals);
+  Future pull2;
+  push.Then([&]() { pull2 = kv.PullAsync(keys, &rets2); }).Wait();
+  CHECK(push.ready());
+  pull2.Wait();
+  CHECK_EQ(rets2.size(), keys.size());
+
+  // chaining a finished future runs at once
+  bool now = false;
+  push.Then([&now]() { now = true; });
+  CHECK(now);
+
+#ifdef PS_USE_COROUTINE
+  Postoffice::Get()->Barrier(kWorkerGroup);
+  float base = (repeat + 1) * NumWorkers();
+  Task task = RunRounds(&kv, keys, vals, 20, base);
+  task.done.Wait();
+  LL << "worker " << MyRank() << " passed the coroutine rounds";
+#endif
+  LL << "worker " << MyRank() << " done";
+}
+
+int main(int argc, char *argv[]) {
+  if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+    RegisterExitCallback([server](){ delete server; });
+  }
+  Start();
+  RunWorker();
+  Finalize();
+  return 0;
+}
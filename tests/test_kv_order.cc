@@ -0,0 +1,46 @@
+/**
+ * \brief a pull sees the pushes of the same worker before it
+ *
+ * each worker pushes a few times and then pulls at once without waiting. the
+ * pulls have a higher priority than the pushes, but must not pass the pushes
+ * of the same worker in the queues, so every pull reads all pushes before it
+ */
+#include "ps/ps.h"
+using namespace ps;
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+
+  int num = 10000;
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+
+  int repeat = 20, pushes = 10;
+  std::vector<std::vector<float>> rets(repeat);
+  std::vector<int> ts;
+  for (int i = 0; i < repeat; ++i) {
+    for (int j = 0; j < pushes; ++j) kv.Push(keys, vals);
+    ts.push_back(kv.Pull(keys, &rets[i]));
+  }
+  for (int i = 0; i < repeat; ++i) {
+    kv.Wait(ts[i]);
+    for (int k = 0; k < num; ++k) {
+      CHECK_GE(rets[i][k], (float)pushes * (i + 1)) << "round " << i;
+    }
+  }
+  LL << "worker " << MyRank() << " passed";
+}
+
+int main(int argc, char *argv[]) {
+  if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+    RegisterExitCallback([server](){ delete server; });
+  }
+  Start();
+  RunWorker();
+  Finalize();
+  return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * \brief an app added after its requests arrive
+ *
+ * the servers add the kv app a while after starting, so the pushes of the
+ * workers wait for it, and must all be processed once it is added
+ */
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  Start();
+  KVServer<float>* server = nullptr;
+  if (IsServer()) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+  }
+  if (IsWorker()) {
+    KVWorker<float> kv(0);
+    std::vector<Key> keys = {1, kMaxKey / 2 + 1};
+    std::vector<float> vals = {1, 2};
+    int repeat = 10;
+    std::vector<int> ts;
+    for (int i = 0; i < repeat; ++i) ts.push_back(kv.Push(keys, vals));
+    for (int t : ts) kv.Wait(t);
+    std::vector<float> rets;
+    kv.Wait(kv.Pull(keys, &rets));
+    CHECK_GE(rets[0], repeat * vals[0]);
+    CHECK_GE(rets[1], repeat * vals[1]);
+    LL << "worker " << MyRank() << " pulled " << rets[0] << " " << rets[1];
+  }
+  Finalize();
+  delete server;
+  return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * \brief the traffic counters and latencies
+ *
+ * the workers push and pull, then check the counters of the servers they
+ * talked to and the latencies of their requests, and the servers check the
+ * requests received. every node checks the file written in the format of
+ * Prometheus, at DMLC_PS_METRICS_FILE if set, or a temporary file otherwise
+ */
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "ps/ps.h"
+using namespace ps;
+
+/** \brief the quantiles are within the relative error of the histogram */
+void CheckHistogram() {
+  LatencyHistogram hist;
+  CHECK_EQ(hist.Quantile(0.5), 0);
+  int n = 100000;
+  for (int i = 1; i <= n; ++i) hist.Record(i * 100);
+  CHECK_EQ(hist.count(), (uint64_t)n);
+  CHECK_EQ(hist.max(), (uint64_t)n * 100);
+  for (double q : {0.01, 0.5, 0.9, 0.99}) {
+    double expected = q * n * 100;
+    double value = hist.Quantile(q);
+    CHECK_GE(value, expected * 0.99) << q;
+    CHECK_LE(value, expected * (1 + 1.0 / 16)) << q;
+  }
+  CHECK_EQ(hist.Quantile(1), hist.max());
+}
+
+const Metrics::Snapshot::CustomerStats& FindCustomer(
+    const Metrics::Snapshot& snapshot, int id) {
+  for (const auto& c : snapshot.customers) {
+    if (c.customer_id == id) return c;
+  }
+  LOG(FATAL) << "no customer " << id;
+  return snapshot.customers[0];
+}
+
+const Metrics::Snapshot::PeerStats& FindPeer(
+    const Metrics::Snapshot& snapshot, int id) {
+  for (const auto& p : snapshot.peers) {
+    if (p.node_id == id) return p;
+  }
+  LOG(FATAL) << "no peer " << id;
+  return snapshot.peers[0];
+}
+
+int main(int argc, char *argv[]) {
+  CheckHistogram();
+  setenv("DMLC_PS_METRICS_FILE", "/tmp/test_metrics_%i.prom", 0);
+  KVServer<float>* server = nullptr;
+  if (IsServer()) {
+    server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+  }
+  Start();
+  int my_id = Postoffice::Get()->van()->my_node().id();
+  Metrics* metrics = Postoffice::Get()->metrics();
+
+  int repeat = 100;
+  if (IsWorker()) {
+    KVWorker<float> kv(0);
+    int num = 100;
+    std::vector<Key> keys(num);
+    std::vector<float> vals(num, 1);
+    for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+    std::vector<float> rets;
+    for (int i = 0; i < repeat; ++i) {
+      kv.Wait(kv.Push(keys, vals));
+      kv.Wait(kv.Pull(keys, &rets));
+    }
+
+    auto snapshot = metrics->GetSnapshot();
+    CHECK_EQ(snapshot.node_id, my_id);
+    const auto& customer = FindCustomer(snapshot, 0);
+    CHECK_EQ(customer.num_requests, (uint64_t)repeat * 2);
+    CHECK_EQ(customer.sent_messages, (uint64_t)repeat * 2 * NumServers());
+    CHECK_EQ(customer.recv_messages, (uint64_t)repeat * 2 * NumServers());
+    CHECK_GT(customer.recv_bytes, (uint64_t)repeat * num * sizeof(float));
+    CHECK_EQ(customer.queue_depth, 0);
+    CHECK_GT(customer.latency_p50, 0);
+    CHECK_LE(customer.latency_p50, customer.latency_p99);
+    CHECK_LE(customer.latency_p99, customer.latency_max);
+    CHECK_GE(customer.latency_sum, customer.latency_max);
+    for (int r = 0; r < NumServers(); ++r) {
+      const auto& peer = FindPeer(snapshot, Postoffice::ServerRankToID(r));
+      CHECK_GE(peer.sent_messages, (uint64_t)repeat * 2);
+      CHECK_GE(peer.recv_messages, (uint64_t)repeat * 2);
+    }
+  }
+
+  Finalize();
+  if (IsServer()) {
+    auto snapshot = metrics->GetSnapshot();
+    const auto& customer = FindCustomer(snapshot, 0);
+    CHECK_EQ(customer.recv_messages, (uint64_t)repeat * 2 * NumWorkers());
+    CHECK_EQ(customer.sent_messages, (uint64_t)repeat * 2 * NumWorkers());
+    CHECK_EQ(customer.num_requests, 0);
+    delete server;
+  }
+
+  // written at last by Finalize
+  std::string file = getenv("DMLC_PS_METRICS_FILE");
+  file.replace(file.find("%i"), 2, std::to_string(my_id));
+  std::ifstream in(file);
+  CHECK(in) << "no " << file;
+  std::stringstream text;
+  text << in.rdbuf();
+  std::string node = "{node=\"" + std::to_string(my_id) + "\"";
+  CHECK_NE(text.str().find("ps_peer_bytes_total" + node), std::string::npos);
+  if (!IsScheduler()) {
+    CHECK_NE(text.str().find("ps_request_latency_seconds_count" + node),
+             std::string::npos);
+  }
+  remove(file.c_str());
+  LL << "node " << my_id << " passed";
+  return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * \brief a server with several handler threads
+ *
+ * the servers run the handle on 4 threads, and respond to every other request
+ * from another thread after the handle returned. the workers push to keys
+ * spread over the key range and check the sums pulled. the first argument
+ * "sender" spreads the requests by the sender instead of the keys
+ */
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+/** \brief a store locked by stripes, responding from a thread every other time */
+struct Handle {
+  void operator()(const KVMeta& req_meta, const KVPairs<float>& req_data,
+                  KVServer<float>* server) {
+    size_t n = req_data.keys.size();
+    KVPairs<float> res;
+    if (!req_meta.push) {
+      res.keys = req_data.keys;
+      res.vals.resize(n);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      Key key = req_data.keys[i];
+      std::lock_guard<std::mutex> lk(mu[key % kStripes]);
+      if (req_meta.push) {
+        store[key % kStripes][key] += req_data.vals[i];
+      } else {
+        res.vals[i] = store[key % kStripes][key];
+      }
+    }
+    if (++count % 2) {
+      server->Response(req_meta, res);
+    } else {
+      std::thread([req_meta, res, server]() {
+          server->Response(req_meta, res);
+        }).detach();
+    }
+  }
+  static const int kStripes = 16;
+  std::mutex mu[kStripes];
+  std::unordered_map<Key, float> store[kStripes];
+  std::atomic<int> count{0};
+};
+
+int main(int argc, char *argv[]) {
+  auto dispatch = KVServer<float>::kByKey;
+  if (argc > 1 && std::string(argv[1]) == "sender") {
+    dispatch = KVServer<float>::kBySender;
+  }
+  if (IsServer()) {
+    auto server = new KVServer<float>(0, 4, dispatch);
+    auto handle = std::make_shared<Handle>();
+    server->set_request_handle(
+        [handle](const KVMeta& meta, const KVPairs<float>& data,
+                 KVServer<float>* server) { (*handle)(meta, data, server); });
+    RegisterExitCallback([server](){ delete server; });
+  }
+  Start();
+
+  if (IsWorker()) {
+    KVWorker<float> kv(0);
+    int num = 64, repeat = 200;
+    std::vector<int> ts;
+    for (int i = 0; i < repeat; ++i) {
+      // requests starting at different parts of the key ranges
+      std::vector<Key> keys;
+      for (int j = i % 8; j < num; ++j) keys.push_back(kMaxKey / num * j);
+      std::vector<float> vals(keys.size(), 1);
+      ts.push_back(kv.Push(keys, vals));
+    }
+    for (int t : ts) kv.Wait(t);
+    Postoffice::Get()->Barrier(kWorkerGroup);
+
+    std::vector<Key> keys;
+    for (int j = 0; j < num; ++j) keys.push_back(kMaxKey / num * j);
+    std::vector<float> vals;
+    kv.Wait(kv.Pull(keys, &vals));
+    for (int j = 0; j < num; ++j) {
+      int expected = 0;
+      for (int i = 0; i < repeat; ++i) expected += (j >= i % 8);
+      CHECK_EQ(vals[j], (float)expected * NumWorkers()) << j;
+    }
+    LL << "worker " << MyRank() << " checked " << num << " keys";
+  }
+  Finalize();
+  return 0;
+}
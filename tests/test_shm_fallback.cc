@@ -0,0 +1,49 @@
+/**
+ * \brief messages keep their order when shared memory falls back to the
+ * network and back
+ *
+ * each worker pushes a message larger than the ring of shared memory, which
+ * goes through the network, and then small ones, which go through shared
+ * memory again once the server has got the large one. the pulls read all
+ * pushes before them
+ */
+#include "ps/ps.h"
+using namespace ps;
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+
+  int num = 300000, small = 100;
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+  std::vector<Key> small_keys(keys.begin(), keys.begin() + small);
+  std::vector<float> small_vals(small, 1);
+
+  int repeat = 10, pushes = 20;
+  for (int i = 0; i < repeat; ++i) {
+    kv.Push(keys, vals);
+    for (int j = 0; j < pushes; ++j) kv.Push(small_keys, small_vals);
+    std::vector<float> rets;
+    kv.Wait(kv.Pull(small_keys, &rets));
+    for (int k = 0; k < small; ++k) {
+      CHECK_GE(rets[k], (float)(pushes + 1) * (i + 1)) << "round " << i;
+    }
+  }
+  LL << "worker " << MyRank() << " passed";
+}
+
+int main(int argc, char *argv[]) {
+  setenv("DMLC_PS_SHM", "1", 0);
+  setenv("DMLC_PS_SHM_SIZE", "1", 0);
+  if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    server->set_request_handle(KVServerDefaultHandle<float>());
+    RegisterExitCallback([server](){ delete server; });
+  }
+  Start();
+  RunWorker();
+  Finalize();
+  return 0;
+}